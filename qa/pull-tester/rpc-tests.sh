@@ -27,6 +27,8 @@ if [ "x${ENABLE_BITCOIND}${ENABLE_UTILS}${ENABLE_WALLET}" = "x111" ]; then
   ${BUILDDIR}/qa/rpc-tests/httpbasics.py --srcdir "${BUILDDIR}/src"
   ${BUILDDIR}/qa/rpc-tests/mempool_coinbase_spends.py --srcdir "${BUILDDIR}/src"
   ${BUILDDIR}/qa/rpc-tests/proxy_test.py --srcdir "${BUILDDIR}/src"
+  ${BUILDDIR}/qa/rpc-tests/compactblocks.py --srcdir "${BUILDDIR}/src"
+  ${BUILDDIR}/qa/rpc-tests/blockannounce.py --srcdir "${BUILDDIR}/src"
   #${BUILDDIR}/qa/rpc-tests/forknotify.py --srcdir "${BUILDDIR}/src"
 else
   echo "No rpc tests to run. Wallet, utils, and bitcoind must all be enabled"
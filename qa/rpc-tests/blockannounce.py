@@ -0,0 +1,52 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The LAPO developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the block announcement statistics in getpeerinfo: node0 mines and is
+# node1's only source of blocks, node2 only hears of them through node1.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+class BlockAnnounceTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = start_nodes(3, self.options.tmpdir)
+        # One connection per pair, made by node1, so the peers show up under their listening ports
+        connect_nodes(self.nodes[1], 0)
+        connect_nodes(self.nodes[1], 2)
+        self.is_network_split = False
+        self.sync_all()
+
+    def peer_stats(self, node, peer):
+        port = "%d" % p2p_port(peer)
+        for info in node.getpeerinfo():
+            if info["addr"].endswith(":" + port):
+                return info
+        raise AssertionError("node%d is not connected to node%d" % (self.nodes.index(node), peer))
+
+    def run_test(self):
+        # Leave initial block download first; announcements made during it are not counted
+        self.nodes[0].setgenerate(True, 1)
+        self.sync_all()
+        before = self.peer_stats(self.nodes[1], 0)["blockannouncements"]
+
+        for i in range(5):
+            self.nodes[0].setgenerate(True, 1)
+            self.sync_all()
+
+        stats = self.peer_stats(self.nodes[1], 0)
+        assert_equal(stats["blockannouncements"] - before, 5)
+        assert_greater_than(stats["blocksfirst"], 4)
+        assert_equal(stats["blockannouncedelay"], 0)
+
+        # node2 never knew of a block before node1 told it
+        stats = self.peer_stats(self.nodes[1], 2)
+        assert_equal(stats["blocksfirst"], 0)
+        assert("blockannouncedelay" not in stats)
+
+if __name__ == '__main__':
+    BlockAnnounceTest().main()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The LAPO developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test compact block relay: nodes 0/1 announce blocks as cmpctblock, nodes
+# 2/3 run with -peercompactblocks=0. Both pairs relay the same kind of
+# blocks; compare the bytes received and the time until the peer has the block.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+class CompactBlocksTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--txs", dest="txs", default=50, type="int",
+                          help="Number of transactions per block (default: %default)")
+        parser.add_option("--rounds", dest="rounds", default=5, type="int",
+                          help="Number of blocks relayed per configuration (default: %default)")
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-debug=cmpctblock"]] * 2)
+        self.nodes += [start_node(i, self.options.tmpdir, ["-peercompactblocks=0"]) for i in (2, 3)]
+        self.is_network_split = True
+
+    def relay_block(self, miner, peer, ntxs):
+        """Mine a block with ntxs mempool transactions on miner and return (bytes, seconds) until peer has it"""
+        address = peer.getnewaddress()
+        for i in range(ntxs):
+            miner.sendtoaddress(address, 0.01)
+        sync_mempools([miner, peer])
+        received = peer.getnettotals()["totalbytesrecv"]
+        start = time.time()
+        miner.setgenerate(True, 1)
+        sync_blocks([miner, peer])
+        elapsed = time.time() - start
+        assert_equal(len(peer.getblock(peer.getbestblockhash())["tx"]), ntxs + 1)
+        return peer.getnettotals()["totalbytesrecv"] - received, elapsed
+
+    def measure(self, label, miner, peer):
+        total_bytes, total_time = 0, 0.0
+        for r in range(self.options.rounds):
+            nbytes, elapsed = self.relay_block(miner, peer, self.options.txs)
+            total_bytes += nbytes
+            total_time += elapsed
+        print "%-14s %d blocks of %d txs: avg %d bytes, %.1fms per block" % (
+            label, self.options.rounds, self.options.txs, total_bytes / self.options.rounds,
+            1000 * total_time / self.options.rounds)
+        return total_bytes
+
+    def run_test(self):
+        # A transaction the peer never saw must be fetched with getblocktxn
+        address = self.nodes[1].getnewaddress()
+        txid = self.nodes[0].sendtoaddress(address, 1)
+        connect_nodes_bi(self.nodes, 0, 1)
+        connect_nodes_bi(self.nodes, 2, 3)
+        assert(txid not in self.nodes[1].getrawmempool())
+        self.nodes[0].setgenerate(True, 1)
+        sync_blocks(self.nodes[0:2])
+        assert(txid in self.nodes[1].getblock(self.nodes[1].getbestblockhash())["tx"])
+        self.nodes[2].setgenerate(True, 1)
+        sync_blocks(self.nodes[2:4])
+
+        compact = self.measure("cmpctblock", self.nodes[0], self.nodes[1])
+        legacy = self.measure("inv/getdata", self.nodes[2], self.nodes[3])
+        print "compact blocks use %.1f%% of the bytes of full block relay" % (100.0 * compact / legacy)
+        assert(compact < legacy)
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The LAPO developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Benchmark inbound connection scaling: open many fake peers against one
+# node, complete the version handshake and measure ping round trips.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+import hashlib
+import random
+import resource
+import select
+import socket
+import struct
+
+MAGIC = "\x1a\x20\x2a\x22" # regtest
+PROTOCOL_VERSION = 70915
+
+def msg(command, payload):
+    checksum = hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    return MAGIC + struct.pack("<12sI", command, len(payload)) + checksum + payload
+
+def net_addr(port):
+    return struct.pack("<Q", 1) + "\x00" * 10 + "\xff\xff" + socket.inet_aton("127.0.0.1") + struct.pack(">H", port)
+
+def version_msg(port):
+    payload = struct.pack("<iQq", PROTOCOL_VERSION, 1, int(time.time()))
+    payload += net_addr(port) + net_addr(0)
+    payload += struct.pack("<Q", random.getrandbits(64))
+    payload += "\x0c/fakepeer:1/" + struct.pack("<i", 0)
+    return msg("version", payload)
+
+class FakePeer(object):
+    """Minimal P2P client speaking just enough of the protocol to stay connected"""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.sock.setblocking(0)
+        self.recvbuf = ""
+        self.verack = False
+        self.pong = None
+        self.sock.sendall(version_msg(port))
+
+    def send(self, data):
+        self.sock.setblocking(1)
+        self.sock.sendall(data)
+        self.sock.setblocking(0)
+
+    def on_readable(self):
+        try:
+            data = self.sock.recv(65536)
+        except socket.error:
+            return
+        self.recvbuf += data
+        while len(self.recvbuf) >= 24:
+            command, length = struct.unpack("<12sI", self.recvbuf[4:20])
+            if len(self.recvbuf) < 24 + length:
+                break
+            payload = self.recvbuf[24:24 + length]
+            self.recvbuf = self.recvbuf[24 + length:]
+            command = command.rstrip("\x00")
+            if command == "version":
+                self.send(msg("verack", ""))
+            elif command == "verack":
+                self.verack = True
+            elif command == "ping":
+                self.send(msg("pong", payload))
+            elif command == "pong":
+                self.pong = struct.unpack("<Q", payload)[0]
+
+def poll_until(poller, peers, done, timeout=120):
+    fdmap = dict((p.sock.fileno(), p) for p in peers)
+    deadline = time.time() + timeout
+    while not done():
+        if time.time() > deadline:
+            raise AssertionError("timeout waiting for fake peers")
+        for fd, _ in poller.poll(0.1):
+            fdmap[fd].on_readable()
+
+class ConnectionBenchmark(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--peers", dest="peers", default=1000, type="int",
+                          help="Number of fake inbound peers (default: %default)")
+        parser.add_option("--rounds", dest="rounds", default=10, type="int",
+                          help="Number of ping rounds (default: %default)")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.is_network_split = False
+        self.nodes = [start_node(0, self.options.tmpdir,
+                                 ["-maxconnections=%d" % (self.options.peers + 32), "-whitelist=127.0.0.1"])]
+
+    def run_test(self):
+        n = self.options.peers
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (max(soft, min(hard, n + 256)), hard))
+
+        start = time.time()
+        peers = [FakePeer(p2p_port(0)) for i in range(n)]
+        poller = select.epoll()
+        for p in peers:
+            poller.register(p.sock.fileno(), select.EPOLLIN)
+        poll_until(poller, peers, lambda: all(p.verack for p in peers))
+        print "%d peers connected in %.2fs" % (n, time.time() - start)
+        assert_equal(self.nodes[0].getconnectioncount(), n)
+
+        latencies = []
+        for r in range(self.options.rounds):
+            nonce = random.getrandbits(64)
+            start = time.time()
+            for p in peers:
+                p.send(msg("ping", struct.pack("<Q", nonce)))
+            poll_until(poller, peers, lambda: all(p.pong == nonce for p in peers))
+            latencies.append(time.time() - start)
+        print "ping all %d peers: avg %.1fms, max %.1fms over %d rounds" % (
+            n, 1000 * sum(latencies) / len(latencies), 1000 * max(latencies), len(latencies))
+
+        for p in peers:
+            p.sock.close()
+
+if __name__ == '__main__':
+    ConnectionBenchmark().main()
@@ -0,0 +1,46 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The LAPO developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Benchmark block download: node 0 mines a chain, then fresh nodes with
+# different -blockcheckthreads settings sync it and report blocks per second.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+class SyncBenchmark(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--blocks", dest="blocks", default=1000, type="int",
+                          help="Number of blocks to sync (default: %default)")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir))
+
+    def sync_node(self, i, extra_args):
+        self.nodes.append(start_node(i, self.options.tmpdir, extra_args))
+        start = time.time()
+        connect_nodes(self.nodes[i], 0)
+        sync_blocks([self.nodes[0], self.nodes[i]])
+        elapsed = time.time() - start
+        print "%-24s %d blocks in %.2fs: %.1f blocks/s" % (" ".join(extra_args), self.options.blocks, elapsed, self.options.blocks / elapsed)
+
+    def run_test(self):
+        print "Mining %d blocks on node 0" % self.options.blocks
+        self.nodes[0].setgenerate(True, self.options.blocks)
+        assert_equal(self.nodes[0].getblockcount(), self.options.blocks)
+
+        self.sync_node(1, ["-blockcheckthreads=0"])
+        self.sync_node(2, ["-blockcheckthreads=2"])
+
+if __name__ == '__main__':
+    SyncBenchmark().main()
@@ -75,27 +75,33 @@ double CAddrInfo::GetChance(int64_t nNow) const
 
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    flatmap<CNetAddr, int, CNetAddrHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
+    if (IsUsed((*it).second))
+        return &vInfo[(*it).second];
     return NULL;
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -108,11 +114,11 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
+    assert(IsUsed(nId1));
+    assert(IsUsed(nId2));
 
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -120,15 +126,16 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    assert(IsUsed(nId));
+    CAddrInfo& info = vInfo[nId];
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
-    mapInfo.erase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
     nNew--;
 }
 
@@ -137,7 +144,7 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
+        CAddrInfo& infoDelete = vInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
         vvNew[nUBucket][nUBucketPos] = -1;
@@ -149,12 +156,13 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 {
-    // remove the entry from all new buckets
-    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-        int pos = info.GetBucketPosition(nKey, true, bucket);
-        if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
-            info.nRefCount--;
+    // remove the entry from all new buckets; scanning the table is far cheaper than hashing every bucket position
+    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount > 0; bucket++) {
+        for (int pos = 0; pos < ADDRMAN_BUCKET_SIZE; pos++) {
+            if (vvNew[bucket][pos] == nId) {
+                vvNew[bucket][pos] = -1;
+                info.nRefCount--;
+            }
         }
     }
     nNew--;
@@ -169,8 +177,8 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     if (vvTried[nKBucket][nKBucketPos] != -1) {
         // find an item to evict
         int nIdEvict = vvTried[nKBucket][nKBucketPos];
-        assert(mapInfo.count(nIdEvict) == 1);
-        CAddrInfo& infoOld = mapInfo[nIdEvict];
+        assert(IsUsed(nIdEvict));
+        CAddrInfo& infoOld = vInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
@@ -222,16 +230,10 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
         return;
 
     // find a bucket it is in now
-    int nRnd = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-    int nUBucket = -1;
-    for (unsigned int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
-        int nB = (n + nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
-        int nBpos = info.GetBucketPosition(nKey, true, nB);
-        if (vvNew[nB][nBpos] == nId) {
-            nUBucket = nB;
-            break;
-        }
-    }
+    const int* pBegin = &vvNew[0][0];
+    const int* pEnd = pBegin + ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE;
+    const int* pFound = std::find(pBegin, pEnd, nId);
+    int nUBucket = pFound == pEnd ? -1 : (pFound - pBegin) / ADDRMAN_BUCKET_SIZE;
 
     // if no bucket is found, something bad happened;
     // TODO: maybe re-add the node, but for now, just bail out
@@ -293,7 +295,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
-            CAddrInfo& infoExisting = mapInfo[vvNew[nUBucket][nUBucketPos]];
+            CAddrInfo& infoExisting = vInfo[vvNew[nUBucket][nUBucketPos]];
             if (infoExisting.IsTerrible() || (infoExisting.nRefCount > 1 && pinfo->nRefCount == 0)) {
                 // Overwrite the existing new table entry.
                 fInsert = true;
@@ -346,8 +348,8 @@ CAddress CAddrMan::Select_()
             if (vvTried[nKBucket][nKBucketPos] == -1)
                 continue;
             int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            assert(IsUsed(nId));
+            CAddrInfo& info = vInfo[nId];
             if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -361,8 +363,8 @@ CAddress CAddrMan::Select_()
             if (vvNew[nUBucket][nUBucketPos] == -1)
                 continue;
             int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            assert(IsUsed(nId));
+            CAddrInfo& info = vInfo[nId];
             if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -379,9 +381,10 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-        int n = (*it).first;
-        CAddrInfo& info = (*it).second;
+    for (int n = 0; n < (int)vInfo.size(); n++) {
+        if (!IsUsed(n))
+            continue;
+        CAddrInfo& info = vInfo[n];
         if (info.fInTried) {
             if (!info.nLastSuccess)
                 return -1;
@@ -415,9 +418,9 @@ int CAddrMan::Check_()
             if (vvTried[n][i] != -1) {
                 if (!setTried.count(vvTried[n][i]))
                     return -11;
-                if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
+                if (vInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
                     return -17;
-                if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
+                if (vInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
                     return -18;
                 setTried.erase(vvTried[n][i]);
             }
@@ -429,7 +432,7 @@ int CAddrMan::Check_()
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
-                if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
+                if (vInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
                     return -19;
                 if (--mapNew[vvNew[n][i]] == 0)
                     mapNew.erase(vvNew[n][i]);
@@ -461,9 +464,9 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
+        assert(IsUsed(vRandom[n]));
 
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
+        const CAddrInfo& ai = vInfo[vRandom[n]];
         if (!ai.IsTerrible())
             vAddr.push_back(ai);
     }
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_ADDRMAN_H
 #define BITCOIN_ADDRMAN_H
 
+#include "flatmap.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -12,6 +13,7 @@
 #include "timedata.h"
 #include "util.h"
 
+#include <limits>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -162,6 +164,21 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/** Hasher for the address index, salted per instance so peers cannot send colliding addresses */
+class CNetAddrHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CNetAddrHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    size_t operator()(const CNetAddr& addr) const
+    {
+        return addr.GetHash(k0, k1);
+    }
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -174,14 +191,14 @@ private:
     //! secret key to randomize bucket select with
     uint256 nKey;
 
-    //! last used nId
-    int nIdCount;
+    //! table with information about all nIds, indexed by nId; unused slots have nRandomPos == -1
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! unused slots in vInfo, reused before the table grows
+    std::vector<int> vFreeIds;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    flatmap<CNetAddr, int, CNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -202,10 +219,15 @@ protected:
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
 
-    //! find an entry, creating it if necessary.
-    //! nTime and nServices of the found node are updated, if necessary.
+    //! Create a new entry. Pointers to other entries are invalidated if the table grows.
     CAddrInfo* Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId = NULL);
 
+    //! Whether nId refers to a live entry.
+    bool IsUsed(int nId) const
+    {
+        return nId >= 0 && nId < (int)vInfo.size() && vInfo[nId].nRandomPos != -1;
+    }
+
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -275,47 +297,62 @@ public:
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersionDummy) const
     {
-        LOCK(cs);
+        // Take a snapshot of the tables and serialize that, so address gossip
+        // only waits for a copy of the contiguous tables rather than for the
+        // whole peers.dat encoding.
+        uint256 nKeySnapshot;
+        int nNewSnapshot, nTriedSnapshot;
+        std::vector<CAddrInfo> vInfoSnapshot;
+        std::vector<int> vNewSnapshot;
+        {
+            LOCK(cs);
+            nKeySnapshot = nKey;
+            nNewSnapshot = nNew;
+            nTriedSnapshot = nTried;
+            vInfoSnapshot = vInfo;
+            vNewSnapshot.assign(&vvNew[0][0], &vvNew[0][0] + ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE);
+        }
 
         unsigned char nVersion = 1;
         s << nVersion;
         s << ((unsigned char)32);
-        s << nKey;
-        s << nNew;
-        s << nTried;
+        s << nKeySnapshot;
+        s << nNewSnapshot;
+        s << nTriedSnapshot;
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfoSnapshot.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo& info = (*it).second;
+        for (size_t n = 0; n < vInfoSnapshot.size(); n++) {
+            const CAddrInfo& info = vInfoSnapshot[n];
             if (info.nRefCount) {
-                assert(nIds != nNew); // this means nNew was wrong, oh ow
+                assert(nIds != nNewSnapshot); // this means nNew was wrong, oh ow
+                vUnkIds[n] = nIds;
                 s << info;
                 nIds++;
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo& info = (*it).second;
+        for (size_t n = 0; n < vInfoSnapshot.size(); n++) {
+            const CAddrInfo& info = vInfoSnapshot[n];
             if (info.fInTried) {
-                assert(nIds != nTried); // this means nTried was wrong, oh ow
+                assert(nIds != nTriedSnapshot); // this means nTried was wrong, oh ow
                 s << info;
                 nIds++;
             }
         }
         for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
+            const int* pBucket = &vNewSnapshot[bucket * ADDRMAN_BUCKET_SIZE];
             int nSize = 0;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1)
+                if (pBucket[i] != -1)
                     nSize++;
             }
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                if (pBucket[i] != -1) {
+                    int nIndex = vUnkIds[pBucket[i]];
                     s << nIndex;
                 }
             }
@@ -344,8 +381,12 @@ public:
         }
 
         // Deserialize entries from the new table.
+        if (nNew < 0 || nTried < 0)
+            throw std::ios_base::failure("Invalid table size in addrman deserialization");
+        vInfo.reserve(std::min(nNew + nTried, ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE + ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE));
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo& info = mapInfo[n];
+            vInfo.push_back(CAddrInfo());
+            CAddrInfo& info = vInfo.back();
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
@@ -361,7 +402,6 @@ public:
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -371,13 +411,13 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                vvTried[nKBucket][nKBucketPos] = nId;
             } else {
                 nLost++;
             }
@@ -392,7 +432,7 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo& info = mapInfo[nIndex];
+                    CAddrInfo& info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
@@ -404,13 +444,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (int n = 0; n < (int)vInfo.size(); n++) {
+            if (IsUsed(n) && vInfo[n].fInTried == false && vInfo[n].nRefCount == 0) {
+                Delete(n);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -428,6 +465,9 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
@@ -440,7 +480,6 @@ public:
             }
         }
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
     }
@@ -0,0 +1,542 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/**
+ * Masternode-layer load generator. Synthesises a regtest chainstate holding the collaterals of N masternodes,
+ * then replays signed mnb, mnp, mnw, mvote, ix and txlvote streams into the managers, in the order
+ * ProcessMessage hands them extension messages, and reports throughput, lock hold times and memory use per
+ * stream. Throughput is timed with the lock profiler off; with -profilelocks the managers are then emptied
+ * and the streams replayed a second time with it on, for the lock sites alone.
+ *
+ * The replay is serial: every message is handled on the calling thread, without the signature check threads
+ * or the message workers a node hands these messages to. The lock hold times therefore have no contention
+ * behind them, they show how long each site holds its lock, not how long a node waits for it.
+ *
+ * The chain is written directly instead of being mined and connected: only the block holding the collaterals
+ * is on disk, with its transactions in the tx index and its outputs in the coins view, the other blocks only
+ * exist in the block index. Budget proposals are inserted into the budget manager directly, their fee
+ * transactions are not part of the chain.
+ */
+
+#include "bench/components.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "keystore.h"
+#include "lpctx.h"
+#include "main.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
+#include "masternode-sync.h"
+#include "masternodeman.h"
+#include "net.h"
+#include "obfuscation.h"
+#include "pow.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "spork.h"
+#include "sync.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+#ifdef ENABLE_WALLET
+#include "wallet.h"
+#endif
+
+#include <stdio.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+CClientUIInterface uiInterface;
+#ifdef ENABLE_WALLET
+CWallet* pwalletMain = NULL;
+#endif
+
+extern void noui_connect();
+
+static const int DEFAULT_BENCH_MASTERNODES = 1000;
+static const int DEFAULT_BENCH_PROPOSALS = 10;
+static const int DEFAULT_BENCH_IX = 200;
+/** Height of the synthetic chain, deep enough for the payment votes to rank masternodes 100 blocks back */
+static const int BENCH_CHAIN_HEIGHT = 200;
+/** Where the collaterals and the ix inputs confirm */
+static const int BENCH_FUNDING_HEIGHT = 10;
+/** Blocks the payment vote stream votes on, from the tip on */
+static const int BENCH_PAYMENT_BLOCKS = 10;
+static const CAmount BENCH_IX_INPUT = 10 * COIN;
+/** Lock sites listed per stream */
+static const unsigned int BENCH_LOCK_SITES = 6;
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+bool ShutdownRequested()
+{
+    return false;
+}
+
+struct CBenchMasternode {
+    CKey keyCollateral;
+    CPubKey pubKeyCollateral;
+    CKey keyMasternode;
+    CPubKey pubKeyMasternode;
+    CTxIn vin;
+};
+
+struct CStreamStats {
+    std::string strCommand;
+    size_t nMessages;
+    int64_t nMicros;
+    int64_t nMemoryBefore;
+    int64_t nMemoryAfter;
+    /** Replayed with the lock profiler on, nMicros is not a throughput then */
+    bool fProfiled;
+    std::vector<CLockSiteProfile> vLockSites;
+};
+
+/** Keys, collaterals and ix inputs of the synthetic chain, shared by every pass over the streams */
+struct CBenchSetup {
+    int64_t nTime;
+    std::vector<CBenchMasternode> vMasternodes;
+    std::map<COutPoint, CBenchMasternode*> mapMasternodes;
+    CBasicKeyStore keystoreIX;
+    CScript scriptIX;
+    CTransaction txIXFunding;
+};
+
+/** Resident set size in bytes, the peak one where the current one is not available */
+static int64_t GetMemoryUsage()
+{
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file) {
+        long nPages = 0, nResident = 0;
+        int nRead = fscanf(file, "%ld %ld", &nPages, &nResident);
+        fclose(file);
+        if (nRead == 2)
+            return (int64_t)nResident * sysconf(_SC_PAGESIZE);
+    }
+#endif
+#ifndef WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef MAC_OSX
+        return usage.ru_maxrss;
+#else
+        return (int64_t)usage.ru_maxrss * 1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+static CBlockIndex* AddBenchBlock(const CBlock& block, CBlockIndex* pindexPrev)
+{
+    CBlockIndex* pindex = new CBlockIndex(block);
+    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+    pindex->nTx = block.vtx.size();
+    pindex->nChainTx = (pindexPrev ? pindexPrev->nChainTx : 0) + pindex->nTx;
+    pindex->nChainWork = (pindexPrev ? pindexPrev->nChainWork : 0) + GetBlockProof(*pindex);
+    pindex->BuildSkip();
+    pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+    if (pindexPrev)
+        pindexPrev->pnext = pindex;
+    return pindex;
+}
+
+/** Write the funding block and index its transactions and outputs the way ConnectBlock would */
+static bool WriteFundingBlock(CBlock& block, CBlockIndex* pindex)
+{
+    CDiskBlockPos blockPos(0, 0);
+    if (!WriteBlockToDisk(block, blockPos))
+        return false;
+    pindex->nFile = blockPos.nFile;
+    pindex->nDataPos = blockPos.nPos;
+    pindex->nStatus |= BLOCK_HAVE_DATA;
+
+    CDiskTxPos txPos(blockPos, GetSizeOfCompactSize(block.vtx.size()));
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxPos;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        vTxPos.push_back(std::make_pair(tx.GetHash(), txPos));
+        txPos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        pcoinsTip->ModifyCoins(tx.GetHash())->FromTx(tx, pindex->nHeight);
+    }
+    return pblocktree->WriteTxIndex(vTxPos);
+}
+
+/** A chain of BENCH_CHAIN_HEIGHT blocks a minute apart up to nTime, with vFunding confirmed at BENCH_FUNDING_HEIGHT */
+static bool CreateBenchChain(const std::vector<CTransaction>& vFunding, int64_t nTime)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CBlockIndex* pindex = AddBenchBlock(genesis, NULL);
+
+    for (int nHeight = 1; nHeight <= BENCH_CHAIN_HEIGHT; nHeight++) {
+        CBlock block;
+        block.nVersion = genesis.nVersion;
+        block.hashPrevBlock = pindex->GetBlockHash();
+        block.nTime = nTime - (BENCH_CHAIN_HEIGHT - nHeight) * 60;
+        block.nBits = genesis.nBits;
+        block.nNonce = nHeight;
+
+        CMutableTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        txCoinbase.vout.push_back(CTxOut(0, CScript() << OP_TRUE));
+        block.vtx.push_back(txCoinbase);
+
+        if (nHeight == BENCH_FUNDING_HEIGHT)
+            block.vtx.insert(block.vtx.end(), vFunding.begin(), vFunding.end());
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        pindex = AddBenchBlock(block, pindex);
+        if (nHeight == BENCH_FUNDING_HEIGHT && !WriteFundingBlock(block, pindex))
+            return false;
+    }
+
+    chainActive.SetTip(pindex);
+    pindexBestHeader = pindex;
+    pcoinsTip->SetBestBlock(pindex->GetBlockHash());
+    return true;
+}
+
+/** Hand a message to the extension handlers the way ProcessMessage does */
+static void ProcessBenchMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    budget.ProcessMessage(pfrom, strCommand, vRecv);
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    ProcessMessageLPCtx(pfrom, strCommand, vRecv);
+    ProcessSpork(pfrom, strCommand, vRecv);
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
+template <typename T>
+static void AddMessage(std::vector<CDataStream>& vMessages, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    vMessages.push_back(ss);
+}
+
+static CStreamStats ReplayStream(const std::string& strCommandIn, std::vector<CDataStream>& vMessages, CNode* pfrom, bool fProfileLocks)
+{
+    CStreamStats stats;
+    stats.strCommand = strCommandIn;
+    stats.nMessages = vMessages.size();
+    stats.fProfiled = fProfileLocks;
+    stats.nMemoryBefore = GetMemoryUsage();
+
+    ResetLockProfile();
+    fLockProfiling = fProfileLocks;
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH (CDataStream& vRecv, vMessages) {
+        std::string strCommand = strCommandIn;
+        try {
+            ProcessBenchMessage(pfrom, strCommand, vRecv);
+        } catch (std::exception& e) {
+            LogPrintf("bench_lapo : %s message failed - %s\n", strCommand, e.what());
+        }
+    }
+    stats.nMicros = GetTimeMicros() - nStart;
+    fLockProfiling = false;
+
+    stats.nMemoryAfter = GetMemoryUsage();
+    GetLockProfile(stats.vLockSites);
+    vMessages.clear();
+    return stats;
+}
+
+static void PrintStream(const CStreamStats& stats, int nAccepted)
+{
+    if (!stats.fProfiled) {
+        double dSeconds = std::max(stats.nMicros, (int64_t)1) * 0.000001;
+        fprintf(stdout, "%-8s %8u messages %8d accepted %10.1f msg/s %9.1f us/msg   rss %7.1f MB (%+.1f MB)\n",
+            stats.strCommand.c_str(), (unsigned int)stats.nMessages, nAccepted, stats.nMessages / dSeconds,
+            stats.nMessages ? (double)stats.nMicros / stats.nMessages : 0.0,
+            stats.nMemoryAfter / 1048576.0, (stats.nMemoryAfter - stats.nMemoryBefore) / 1048576.0);
+        return;
+    }
+
+    fprintf(stdout, "%-8s %8u messages %8d accepted\n", stats.strCommand.c_str(), (unsigned int)stats.nMessages, nAccepted);
+    for (unsigned int i = 0; i < stats.vLockSites.size() && i < BENCH_LOCK_SITES; i++) {
+        const CLockSiteProfile& site = stats.vLockSites[i];
+        fprintf(stdout, "    %-40s %-36s %8llu held %10.2f ms total %8lld us max\n",
+            site.strName.c_str(), site.strSite.c_str(), (unsigned long long)site.nCount,
+            site.nTotalMicros * 0.001, (long long)site.nMaxMicros);
+    }
+}
+
+static bool SignConsensusVote(CConsensusVote& vote, const CBenchMasternode& mn)
+{
+    std::string strError;
+    return obfuScationSigner.SignMessage(vote.GetStrMessage(), strError, vote.vchMasterNodeSignature, mn.keyMasternode);
+}
+
+/** Forget everything a pass of ReplayStreams left in the managers and the mempool, the chain stays */
+static void ResetBenchState()
+{
+    mnodeman.Clear();
+    masternodePayments.Clear();
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        masternodePayments.mapMasternodesLastVote.clear();
+    }
+    budget.Clear();
+    txLockManager.Clear();
+    mempool.clear();
+}
+
+/**
+ * Replay every stream once, in the order a syncing node sees them. With fProfileLocks the pass records lock hold
+ * times instead of being timed, the profiler's own bookkeeping would otherwise be part of the throughput.
+ */
+static bool ReplayStreams(CNode* pnode, CBenchSetup& setup, int nProposals, bool fProfileLocks)
+{
+    std::vector<CBenchMasternode>& vMasternodes = setup.vMasternodes;
+    int nMasternodes = vMasternodes.size();
+    int nIX = setup.txIXFunding.vout.size();
+    SetMockTime(setup.nTime);
+
+    // Announcements, each carrying its first ping
+    std::vector<CDataStream> vMessages;
+    BOOST_FOREACH (CBenchMasternode& mn, vMasternodes) {
+        unsigned int n = &mn - &vMasternodes[0] + 1;
+        CService addr(strprintf("10.%d.%d.%d", (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff), Params().GetDefaultPort());
+        CMasternodeBroadcast mnb(addr, mn.vin, mn.pubKeyCollateral, mn.pubKeyMasternode, PROTOCOL_VERSION);
+        mnb.lastPing = CMasternodePing(mn.vin);
+        mnb.lastPing.Sign(mn.keyMasternode, mn.pubKeyMasternode);
+        mnb.Sign(mn.keyCollateral);
+        AddMessage(vMessages, mnb);
+    }
+    CStreamStats stats = ReplayStream("mnb", vMessages, pnode, fProfileLocks);
+    PrintStream(stats, mnodeman.size());
+
+    // Pings, once the previous ones are old enough to be replaced
+    int64_t nPingTime = setup.nTime + MASTERNODE_MIN_MNP_SECONDS;
+    SetMockTime(nPingTime);
+    BOOST_FOREACH (CBenchMasternode& mn, vMasternodes) {
+        CMasternodePing mnp(mn.vin);
+        mnp.Sign(mn.keyMasternode, mn.pubKeyMasternode);
+        AddMessage(vMessages, mnp);
+    }
+    stats = ReplayStream("mnp", vMessages, pnode, fProfileLocks);
+    int nAccepted = 0;
+    BOOST_FOREACH (CBenchMasternode& mn, vMasternodes) {
+        CMasternode* pmn = mnodeman.Find(mn.vin);
+        if (pmn && pmn->lastPing.sigTime == nPingTime)
+            nAccepted++;
+    }
+    PrintStream(stats, nAccepted);
+
+    // Payment votes by the masternodes ranked high enough for each block
+    int nTip = chainActive.Height();
+    for (int nHeight = nTip; nHeight < nTip + BENCH_PAYMENT_BLOCKS; nHeight++) {
+        CMasternode* pmnPayee = mnodeman.GetMasternodeByRank(1, nHeight - 100, ActiveProtocol());
+        if (!pmnPayee) continue;
+        CScript payee = GetScriptForDestination(pmnPayee->pubKeyCollateralAddress.GetID());
+        for (int nRank = 1; nRank <= MNPAYMENTS_SIGNATURES_TOTAL; nRank++) {
+            CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, nHeight - 100, ActiveProtocol());
+            if (!pmn) break;
+            CBenchMasternode& mn = *setup.mapMasternodes[pmn->vin.prevout];
+            CMasternodePaymentWinner winner(mn.vin);
+            winner.nBlockHeight = nHeight;
+            winner.AddPayee(payee);
+            winner.Sign(mn.keyMasternode, mn.pubKeyMasternode);
+            AddMessage(vMessages, winner);
+        }
+    }
+    size_t nPaymentVotes = masternodePayments.mapMasternodePayeeVotes.size();
+    stats = ReplayStream("mnw", vMessages, pnode, fProfileLocks);
+    PrintStream(stats, masternodePayments.mapMasternodePayeeVotes.size() - nPaymentVotes);
+
+    // Budget votes, every masternode on every proposal
+    std::vector<uint256> vProposals;
+    {
+        LOCK(budget.cs);
+        for (int i = 0; i < nProposals; i++) {
+            CBudgetProposal proposal(strprintf("bench-%d", i), "http://localhost", nTip, nTip + 10 * GetBudgetPaymentCycleBlocks(),
+                GetScriptForDestination(vMasternodes[i % nMasternodes].pubKeyCollateral.GetID()), 100 * COIN, Hash(BEGIN(i), END(i)));
+            vProposals.push_back(proposal.GetHash());
+            budget.mapProposals.insert(std::make_pair(proposal.GetHash(), proposal));
+        }
+    }
+    BOOST_FOREACH (const uint256& hashProposal, vProposals) {
+        BOOST_FOREACH (CBenchMasternode& mn, vMasternodes) {
+            CBudgetVote vote(mn.vin, hashProposal, (&mn - &vMasternodes[0]) % 3 ? VOTE_YES : VOTE_NO);
+            vote.Sign(mn.keyMasternode, mn.pubKeyMasternode);
+            AddMessage(vMessages, vote);
+        }
+    }
+    stats = ReplayStream("mvote", vMessages, pnode, fProfileLocks);
+    nAccepted = 0;
+    BOOST_FOREACH (const uint256& hashProposal, vProposals) {
+        CBudgetProposal* pproposal = budget.FindProposal(hashProposal);
+        if (pproposal)
+            nAccepted += pproposal->GetYeas() + pproposal->GetNays() + pproposal->GetAbstains();
+    }
+    PrintStream(stats, nAccepted);
+
+    // LPCtx lock requests, each spending one of the confirmed ix inputs
+    std::vector<CTransaction> vIX;
+    for (int i = 0; i < nIX; i++) {
+        CMutableTransaction tx;
+        tx.vin.push_back(CTxIn(COutPoint(setup.txIXFunding.GetHash(), i)));
+        tx.vout.push_back(CTxOut(BENCH_IX_INPUT - Params().LPCtxMinFee(), setup.scriptIX));
+        if (!SignSignature(setup.keystoreIX, setup.txIXFunding, tx, 0)) {
+            fprintf(stderr, "bench_lapo: failed to sign an ix request\n");
+            return false;
+        }
+        vIX.push_back(tx);
+        AddMessage(vMessages, vIX.back());
+    }
+    stats = ReplayStream("ix", vMessages, pnode, fProfileLocks);
+    CTransactionLockStats lockStats;
+    txLockManager.GetStats(lockStats);
+    PrintStream(stats, lockStats.nRequests);
+
+    // Their votes, from every masternode ranked to vote at the height CreateNewLock picks for their inputs
+    int nInputAge = chainActive.Height() + 1 - BENCH_FUNDING_HEIGHT;
+    int nLockHeight = chainActive.Height() - nInputAge + 4;
+    std::vector<const CBenchMasternode*> vVoters;
+    for (int nRank = 1; nRank <= LPCTX_SIGNATURES_TOTAL; nRank++) {
+        CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, nLockHeight, MIN_LPCTX_PROTO_VERSION);
+        if (pmn) vVoters.push_back(setup.mapMasternodes[pmn->vin.prevout]);
+    }
+    BOOST_FOREACH (const CTransaction& tx, vIX) {
+        BOOST_FOREACH (const CBenchMasternode* pmn, vVoters) {
+            CConsensusVote vote;
+            vote.vinMasternode = pmn->vin;
+            vote.txHash = tx.GetHash();
+            vote.nBlockHeight = nLockHeight;
+            SignConsensusVote(vote, *pmn);
+            AddMessage(vMessages, vote);
+        }
+    }
+    stats = ReplayStream("txlvote", vMessages, pnode, fProfileLocks);
+    nAccepted = 0;
+    BOOST_FOREACH (const CTransaction& tx, vIX)
+        nAccepted += std::max(txLockManager.GetSignatures(tx.GetHash()), 0);
+    PrintStream(stats, nAccepted);
+    txLockManager.GetStats(lockStats);
+    fprintf(stdout, "\n%llu of %d locks completed\n", (unsigned long long)lockStats.nCompleted, nIX);
+    return true;
+}
+
+static void RunBenchmark(CNode* pnode)
+{
+    int nMasternodes = std::max((int)GetArg("-masternodes", DEFAULT_BENCH_MASTERNODES), LPCTX_SIGNATURES_TOTAL);
+    int nProposals = GetArg("-proposals", DEFAULT_BENCH_PROPOSALS);
+    int nIX = GetArg("-ix", DEFAULT_BENCH_IX);
+    bool fProfileLocks = GetBoolArg("-profilelocks", true);
+
+    fprintf(stdout, "bench_lapo: %d masternodes, %d proposals, %d ix requests, lock profiling %s\n",
+        nMasternodes, nProposals, nIX, fProfileLocks ? "on" : "off");
+
+    CBenchSetup setup;
+    setup.nTime = GetTime();
+    SetMockTime(setup.nTime);
+
+    int64_t nStart = GetTimeMicros();
+    setup.vMasternodes.resize(nMasternodes);
+    std::vector<CTransaction> vFunding;
+    BOOST_FOREACH (CBenchMasternode& mn, setup.vMasternodes) {
+        mn.keyCollateral.MakeNewKey(true);
+        mn.pubKeyCollateral = mn.keyCollateral.GetPubKey();
+        mn.keyMasternode.MakeNewKey(true);
+        mn.pubKeyMasternode = mn.keyMasternode.GetPubKey();
+
+        // The collaterals are funded from nowhere, nothing looks further back than them
+        unsigned int n = vFunding.size();
+        CMutableTransaction tx;
+        tx.vin.push_back(CTxIn(COutPoint(Hash(BEGIN(n), END(n)), 0)));
+        tx.vout.push_back(CTxOut(Params().MasternodeCollateral() * COIN, GetScriptForDestination(mn.pubKeyCollateral.GetID())));
+        vFunding.push_back(tx);
+        mn.vin = CTxIn(COutPoint(vFunding.back().GetHash(), 0));
+        setup.mapMasternodes[mn.vin.prevout] = &mn;
+    }
+
+    CKey keyIX;
+    keyIX.MakeNewKey(true);
+    setup.keystoreIX.AddKey(keyIX);
+    setup.scriptIX = GetScriptForDestination(keyIX.GetPubKey().GetID());
+    CMutableTransaction txIXFundingMutable;
+    txIXFundingMutable.vin.push_back(CTxIn(COutPoint(Hash(BEGIN(setup.nTime), END(setup.nTime)), 0)));
+    for (int i = 0; i < nIX; i++)
+        txIXFundingMutable.vout.push_back(CTxOut(BENCH_IX_INPUT, setup.scriptIX));
+    setup.txIXFunding = CTransaction(txIXFundingMutable);
+    vFunding.push_back(setup.txIXFunding);
+
+    if (!CreateBenchChain(vFunding, setup.nTime)) {
+        fprintf(stderr, "bench_lapo: failed to write the synthetic chain\n");
+        return;
+    }
+    fprintf(stdout, "setup: %d blocks, %d collaterals in %.2fs\n\n", chainActive.Height(), nMasternodes, (GetTimeMicros() - nStart) * 0.000001);
+
+    if (!ReplayStreams(pnode, setup, nProposals, false) || !fProfileLocks)
+        return;
+
+    // The same streams again from empty managers, this time only for where they hold locks
+    ResetBenchState();
+    fprintf(stdout, "\nlock hold times, serial replay without contention:\n");
+    ReplayStreams(pnode, setup, nProposals, true);
+}
+
+int main(int argc, char* argv[])
+{
+    SetupEnvironment();
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("-help")) {
+        fprintf(stdout, "Usage: bench_lapo [options]\n\n"
+                        "  -masternodes=<n>  Masternodes to synthesise (default: %d)\n"
+                        "  -proposals=<n>    Budget proposals every masternode votes on (default: %d)\n"
+                        "  -ix=<n>           LPCtx lock requests (default: %d)\n"
+                        "  -components       Time the last-paid index of the payment queue too (default: 1)\n"
+                        "  -profilelocks     Replay the streams a second time for their lock hold times (default: 1)\n"
+                        "  -printtoconsole   Send the debug log to the console, with -debug=<category>\n",
+            DEFAULT_BENCH_MASTERNODES, DEFAULT_BENCH_PROPOSALS, DEFAULT_BENCH_IX);
+        return 0;
+    }
+    fPrintToConsole = GetBoolArg("-printtoconsole", false);
+    fPrintToDebugLog = false;
+    fDebug = !mapMultiArgs["-debug"].empty();
+    SelectParams(CBaseChainParams::REGTEST);
+    noui_connect();
+
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("bench_lapo_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    fTxIndex = true;
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    CCoinsViewDB* pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    pnode->nVersion = PROTOCOL_VERSION;
+
+    RunBenchmark(pnode);
+    if (GetBoolArg("-components", true)) {
+        fprintf(stdout, "\n");
+        RunComponentBenchmarks();
+    }
+
+    delete pnode;
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    boost::filesystem::remove_all(pathTemp);
+    return 0;
+}
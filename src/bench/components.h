@@ -0,0 +1,11 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_COMPONENTS_H
+#define BITCOIN_BENCH_COMPONENTS_H
+
+/** Time the masternode payment queue's last-paid index on synthetic data */
+void RunComponentBenchmarks();
+
+#endif // BITCOIN_BENCH_COMPONENTS_H
@@ -0,0 +1,183 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <map>
+
+/** Smallest possible serialized transaction, bounds the number of transactions in a block */
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             header(block.GetBlockHeader()),
+                                                                             vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        // The coinbase and coinstake never are in a mempool, neither may zerocoin spends be
+        bool fPrefill = i == 0 || (i == 1 && block.IsProofOfStake()) || tx.IsZerocoinSpend();
+        if (fPrefill) {
+            PrefilledTransaction prefilled;
+            prefilled.index = i;
+            prefilled.tx = tx;
+            prefilledtxn.push_back(prefilled);
+        } else {
+            shorttxids.push_back(GetShortID(tx.GetHash()));
+        }
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    unsigned char shorttxidhash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(shorttxidhash);
+    shorttxidk0 = ReadLE64(shorttxidhash);
+    shorttxidk1 = ReadLE64(shorttxidhash + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& poolIn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE_CURRENT / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    // Prefilled indexes are strictly increasing after decoding, only the last one needs a range check
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull() || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Short IDs fill the gaps between the prefilled transactions, in order
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    uint16_t index = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vHave[index])
+            index++;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[i], index)).second) {
+            // Two transactions of the block share a short ID; this happens in
+            // about one in 2^30 blocks, so just fall back to the full block.
+            return READ_STATUS_FAILED;
+        }
+        index++;
+    }
+
+    // A short ID matching more than one mempool transaction cannot be resolved
+    // locally; such slots are cleared again and requested with getblocktxn.
+    std::vector<bool> vCollision(txn_available.size(), false);
+    {
+        LOCK(poolIn.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = poolIn.mapTx.begin(); it != poolIn.mapTx.end(); ++it) {
+            std::map<uint64_t, uint16_t>::const_iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (idit == mapShortIDs.end())
+                continue;
+            if (vCollision[idit->second])
+                continue;
+            if (!vHave[idit->second]) {
+                txn_available[idit->second] = it->second.GetTx();
+                vHave[idit->second] = true;
+                mempool_count++;
+            } else {
+                txn_available[idit->second] = CTransaction();
+                vHave[idit->second] = false;
+                vCollision[idit->second] = true;
+                mempool_count--;
+            }
+        }
+    }
+    pool = &poolIn;
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %u\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+void PartiallyDownloadedBlock::GetMissing(std::vector<uint16_t>& vMissing) const
+{
+    vMissing.clear();
+    for (size_t i = 0; i < vHave.size(); i++) {
+        if (!vHave[i])
+            vMissing.push_back(i);
+    }
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const
+{
+    assert(!header.IsNull());
+    block = header;
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!vHave[i]) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        } else {
+            block.vtx[i] = txn_available[i];
+        }
+    }
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+    block.vchBlockSig = vchBlockSig;
+
+    // A short ID collision with a mempool transaction shows up as a merkle root
+    // mismatch. That is not the peer's fault, so ask for the full block instead.
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %u txn prefilled, %u txn from mempool and %u txn requested\n",
+        header.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
+
+void PartiallyDownloadedBlock::SetNull()
+{
+    txn_available.clear();
+    vHave.clear();
+    prefilled_count = 0;
+    mempool_count = 0;
+    pool = NULL;
+    header.SetNull();
+    vchBlockSig.clear();
+}
@@ -0,0 +1,231 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay (after BIP 152), adapted to proof-of-stake blocks.
+ *
+ * A compact block carries the header, the block signature and a 6-byte short
+ * ID (SipHash-2-4 of the txid, keyed per block) for every transaction. The
+ * receiver fills in what it has in its mempool and asks for the rest with
+ * getblocktxn. Transactions a peer can never have in its mempool are sent
+ * along in full: the coinbase, the coinstake and zerocoin spends, whose
+ * serials may be rejected from a mempool while the spend is in flight.
+ *
+ * Indexes in getblocktxn and prefilled transactions are differentially
+ * encoded: each one is stored as the distance to the previous index minus one.
+ */
+
+/** Transaction at a known position in a block, sent in full within a compact block */
+class PrefilledTransaction
+{
+public:
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t idx = index;
+        READWRITE(COMPACTSIZE(idx));
+        if (idx > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = idx;
+        READWRITE(tx);
+    }
+};
+
+typedef enum ReadStatus_t {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  //! Failed to process object, fall back to a full block
+} ReadStatus;
+
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t shorttxids_size = shorttxids.size();
+        READWRITE(COMPACTSIZE(shorttxids_size));
+        if (ser_action.ForRead()) {
+            size_t i = 0;
+            while (shorttxids.size() < shorttxids_size) {
+                // Grow in steps so a bogus size cannot make us allocate much
+                shorttxids.resize(std::min((uint64_t)(1000 + shorttxids.size()), shorttxids_size));
+                for (; i < shorttxids.size(); i++) {
+                    uint32_t lsb = 0;
+                    uint16_t msb = 0;
+                    READWRITE(lsb);
+                    READWRITE(msb);
+                    shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+                }
+            }
+        } else {
+            for (size_t i = 0; i < shorttxids.size(); i++) {
+                uint32_t lsb = shorttxids[i] & 0xffffffff;
+                uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+            }
+        }
+
+        uint64_t prefilledtxn_size = prefilledtxn.size();
+        READWRITE(COMPACTSIZE(prefilledtxn_size));
+        if (ser_action.ForRead())
+            prefilledtxn.resize(std::min(prefilledtxn_size, (uint64_t)std::numeric_limits<uint16_t>::max() + 1));
+        if (prefilledtxn.size() != prefilledtxn_size)
+            throw std::ios_base::failure("too many prefilled transactions");
+        // Turn the differential indexes into absolute ones on the way in, and back on the way out
+        int32_t offset = 0;
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            if (!ser_action.ForRead()) {
+                PrefilledTransaction diff = prefilledtxn[i];
+                diff.index = prefilledtxn[i].index - offset;
+                READWRITE(diff);
+            } else {
+                READWRITE(prefilledtxn[i]);
+                if (int32_t(prefilledtxn[i].index) + offset > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("prefilled index overflowed 16 bits");
+                prefilledtxn[i].index += offset;
+            }
+            offset = int32_t(prefilledtxn[i].index) + 1;
+        }
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** Request for the transactions of a compact block that could not be found in the mempool */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        uint64_t indexes_size = indexes.size();
+        READWRITE(COMPACTSIZE(indexes_size));
+        if (ser_action.ForRead()) {
+            if (indexes_size > std::numeric_limits<uint16_t>::max() + 1)
+                throw std::ios_base::failure("too many indexes");
+            indexes.resize(indexes_size);
+        }
+
+        int32_t offset = 0;
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t index = ser_action.ForRead() ? 0 : indexes[i] - offset;
+            READWRITE(COMPACTSIZE(index));
+            if (ser_action.ForRead()) {
+                if (index + offset > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("index overflowed 16 bits");
+                indexes[i] = index + offset;
+            }
+            offset = int32_t(indexes[i]) + 1;
+        }
+    }
+};
+
+/** Reply to a getblocktxn: the requested transactions, in the order asked for */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A block being reconstructed from a compact block and the mempool */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock() : prefilled_count(0), mempool_count(0), pool(NULL) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& poolIn);
+    bool IsTxAvailable(size_t index) const;
+    /** Indexes still missing after InitData, to be requested with getblocktxn */
+    void GetMissing(std::vector<uint16_t>& vMissing) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+
+    size_t GetPrefilledCount() const { return prefilled_count; }
+    size_t GetMempoolCount() const { return mempool_count; }
+    bool IsNull() const { return pool == NULL; }
+    void SetNull();
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -9,6 +9,7 @@
 
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -97,4 +98,45 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, by itself it is cryptographically secure (it uses
+ * random tweaks).
+ *
+ * It needs around 1.8 bytes per element per factor 0.1 of false positive rate,
+ * far less than a set of the items themselves. For example, if we want 1000
+ * elements, we'd need:
+ * - ~1800 bytes for a false positive rate of 0.1
+ * - ~3600 bytes for a false positive rate of 0.01
+ * - ~5400 bytes for a false positive rate of 0.001
+ *
+ * Entries are kept in generations of nElements / 2; inserting into a fourth
+ * generation wipes the oldest one, so between nElements and 1.5 * nElements
+ * of the most recent entries are remembered.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    //! Two bits per filter position: 00 is unset, 01/10/11 is set in generation 1/2/3
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
 #endif // BITCOIN_BLOOM_H
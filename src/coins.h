@@ -7,6 +7,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "flatmap.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -16,7 +18,6 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
-#include <boost/unordered_map.hpp>
 
 /** 
 
@@ -88,6 +89,10 @@ public:
     //! as new tx version will probably only be introduced at certain heights
     int nVersion;
 
+    //! upper bound on the output records the per-outpoint coin database holds for this transaction; set when
+    //! it is read from there and carried along so a flush can erase them without reading them back. Not serialized.
+    unsigned int nStoredOutputs;
+
     void FromTx(const CTransaction& tx, int nHeightIn)
     {
         fCoinBase = tx.IsCoinBase();
@@ -99,7 +104,7 @@ public:
     }
 
     //! construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction& tx, int nHeightIn)
+    CCoins(const CTransaction& tx, int nHeightIn) : nStoredOutputs(0)
     {
         FromTx(tx, nHeightIn);
     }
@@ -114,7 +119,7 @@ public:
     }
 
     //! empty constructor
-    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nVersion(0) {}
+    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nVersion(0), nStoredOutputs(0) {}
 
     //!remove spent outputs at the end of vout
     void Cleanup()
@@ -141,6 +146,7 @@ public:
         to.vout.swap(vout);
         std::swap(to.nHeight, nHeight);
         std::swap(to.nVersion, nVersion);
+        std::swap(to.nStoredOutputs, nStoredOutputs);
     }
 
     //! equality test
@@ -283,6 +289,15 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += memusage::DynamicUsage(out.scriptPubKey);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -294,9 +309,7 @@ public:
     CCoinsKeyHasher();
 
     /**
-     * This *must* return size_t. With Boost 1.46 on 32-bit systems the
-     * unordered_map will behave unpredictably if the custom hasher returns a
-     * uint64_t, resulting in failures when syncing the chain (#4634).
+     * This *must* return size_t, as flatmap keeps the full hash in its slots.
      */
     size_t operator()(const uint256& key) const
     {
@@ -316,7 +329,7 @@ struct CCoinsCacheEntry {
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef flatmap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
 
 struct CCoinsStats {
     int nHeight;
@@ -398,7 +411,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -421,6 +435,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -456,6 +473,9 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of lapo coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -0,0 +1,314 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * STL-like hash map using open addressing (linear probing) over a flat slot
+ * array, with the elements themselves kept in pooled, chunk-allocated nodes.
+ *
+ * Each slot holds the full hash and a node pointer, so most probes are
+ * resolved without touching the node. Nodes never move, which keeps pointers
+ * and iterators to elements valid until that element is erased or the map is
+ * cleared, also across rehashes; only the iteration order changes then.
+ * Erasing leaves a tombstone, so erasing while iterating is safe.
+ *
+ * Only the subset of the std::unordered_map interface used in this codebase is
+ * provided.
+ */
+template <typename K, typename V, typename Hash>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+private:
+    struct Node {
+        value_type value;
+        size_t nSlot;
+        Node(const value_type& valueIn) : value(valueIn), nSlot(0) {}
+    };
+
+    //! Empty slots have pnode == NULL and nHash == 0, tombstones pnode == NULL and nHash == 1
+    struct Slot {
+        size_t nHash;
+        Node* pnode;
+        Slot() : nHash(0), pnode(NULL) {}
+    };
+
+    static const size_t NODES_PER_CHUNK = 256;
+    static const size_t MIN_SLOTS = 16;
+
+    Hash hasher;
+    std::vector<Slot> vSlots;
+    size_t nSize;
+    size_t nDeleted;
+
+    std::vector<Node*> vChunks;
+    std::vector<Node*> vFreeNodes;
+    size_t nChunkUsed; //! nodes handed out from the last chunk
+
+    Node* AllocNode(const value_type& value)
+    {
+        Node* p;
+        if (!vFreeNodes.empty()) {
+            p = vFreeNodes.back();
+            vFreeNodes.pop_back();
+        } else {
+            if (vChunks.empty() || nChunkUsed == NODES_PER_CHUNK) {
+                vChunks.push_back(static_cast<Node*>(::operator new(sizeof(Node) * NODES_PER_CHUNK)));
+                nChunkUsed = 0;
+            }
+            p = vChunks.back() + nChunkUsed++;
+        }
+        return new (p) Node(value);
+    }
+
+    void FreeNode(Node* p)
+    {
+        p->~Node();
+        vFreeNodes.push_back(p);
+    }
+
+    size_t Mask() const { return vSlots.size() - 1; }
+
+    //! Slot index of key, or vSlots.size() if absent
+    size_t Lookup(const K& key, size_t nHash) const
+    {
+        if (vSlots.empty())
+            return 0;
+        for (size_t i = nHash & Mask();; i = (i + 1) & Mask()) {
+            const Slot& slot = vSlots[i];
+            if (slot.pnode == NULL) {
+                if (slot.nHash == 0)
+                    return vSlots.size();
+            } else if (slot.nHash == nHash && slot.pnode->value.first == key) {
+                return i;
+            }
+        }
+    }
+
+    void PlaceNode(Node* pnode, size_t nHash)
+    {
+        size_t i = nHash & Mask();
+        while (vSlots[i].pnode != NULL)
+            i = (i + 1) & Mask();
+        if (vSlots[i].nHash == 1)
+            nDeleted--;
+        vSlots[i].nHash = nHash;
+        vSlots[i].pnode = pnode;
+        pnode->nSlot = i;
+    }
+
+    void Rehash(size_t nSlots)
+    {
+        std::vector<Slot> vOld(nSlots);
+        vOld.swap(vSlots);
+        nDeleted = 0;
+        for (size_t i = 0; i < vOld.size(); i++) {
+            if (vOld[i].pnode != NULL)
+                PlaceNode(vOld[i].pnode, vOld[i].nHash);
+        }
+    }
+
+    //! Make room for one more element, keeping the load (including tombstones) at most 3/4
+    void Reserve()
+    {
+        if ((nSize + nDeleted + 1) * 4 <= vSlots.size() * 3)
+            return;
+        size_t nSlots = MIN_SLOTS;
+        while ((nSize + 1) * 2 > nSlots)
+            nSlots <<= 1;
+        Rehash(nSlots);
+    }
+
+    size_t NextLive(size_t i) const
+    {
+        while (i < vSlots.size() && vSlots[i].pnode == NULL)
+            i++;
+        return i;
+    }
+
+    template <bool fConst>
+    class iterator_base
+    {
+        friend class flatmap;
+        typedef typename std::conditional<fConst, const flatmap*, flatmap*>::type map_ptr;
+        map_ptr map;
+        Node* pnode;
+
+        iterator_base(map_ptr mapIn, Node* pnodeIn) : map(mapIn), pnode(pnodeIn) {}
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename flatmap::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef typename std::conditional<fConst, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<fConst, const value_type&, value_type&>::type reference;
+
+        iterator_base() : map(NULL), pnode(NULL) {}
+        // Allow iterator -> const_iterator
+        iterator_base(const iterator_base<false>& it) : map(it.map), pnode(it.pnode) {}
+
+        reference operator*() const { return pnode->value; }
+        pointer operator->() const { return &pnode->value; }
+
+        iterator_base& operator++()
+        {
+            size_t i = map->NextLive(pnode->nSlot + 1);
+            pnode = i < map->vSlots.size() ? map->vSlots[i].pnode : NULL;
+            return *this;
+        }
+        iterator_base operator++(int)
+        {
+            iterator_base ret = *this;
+            ++*this;
+            return ret;
+        }
+
+        bool operator==(const iterator_base& other) const { return pnode == other.pnode; }
+        bool operator!=(const iterator_base& other) const { return pnode != other.pnode; }
+
+        friend class iterator_base<!fConst>;
+    };
+
+    flatmap(const flatmap&);
+    flatmap& operator=(const flatmap&);
+
+public:
+    typedef iterator_base<false> iterator;
+    typedef iterator_base<true> const_iterator;
+
+    flatmap() : nSize(0), nDeleted(0), nChunkUsed(0) {}
+    ~flatmap() { clear(); }
+
+    iterator begin()
+    {
+        size_t i = NextLive(0);
+        return iterator(this, i < vSlots.size() ? vSlots[i].pnode : NULL);
+    }
+    const_iterator begin() const
+    {
+        size_t i = NextLive(0);
+        return const_iterator(this, i < vSlots.size() ? vSlots[i].pnode : NULL);
+    }
+    iterator end() { return iterator(this, NULL); }
+    const_iterator end() const { return const_iterator(this, NULL); }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const K& key)
+    {
+        size_t i = Lookup(key, hasher(key));
+        return iterator(this, i < vSlots.size() ? vSlots[i].pnode : NULL);
+    }
+    const_iterator find(const K& key) const
+    {
+        size_t i = Lookup(key, hasher(key));
+        return const_iterator(this, i < vSlots.size() ? vSlots[i].pnode : NULL);
+    }
+    size_type count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        size_t nHash = hasher(value.first);
+        size_t i = Lookup(value.first, nHash);
+        if (i < vSlots.size())
+            return std::make_pair(iterator(this, vSlots[i].pnode), false);
+        Reserve();
+        Node* pnode = AllocNode(value);
+        PlaceNode(pnode, nHash);
+        nSize++;
+        return std::make_pair(iterator(this, pnode), true);
+    }
+
+    V& operator[](const K& key)
+    {
+        return insert(value_type(key, V())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        Slot& slot = vSlots[it.pnode->nSlot];
+        FreeNode(slot.pnode);
+        slot.pnode = NULL;
+        slot.nHash = 1;
+        nSize--;
+        nDeleted++;
+    }
+
+    size_type erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    //! Destroy all elements and release all memory
+    void clear()
+    {
+        for (size_t i = 0; i < vSlots.size(); i++) {
+            if (vSlots[i].pnode != NULL)
+                vSlots[i].pnode->~Node();
+        }
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<Slot>().swap(vSlots);
+        std::vector<Node*>().swap(vChunks);
+        std::vector<Node*>().swap(vFreeNodes);
+        nSize = 0;
+        nDeleted = 0;
+        nChunkUsed = 0;
+    }
+
+    void swap(flatmap& other)
+    {
+        std::swap(hasher, other.hasher);
+        vSlots.swap(other.vSlots);
+        std::swap(nSize, other.nSize);
+        std::swap(nDeleted, other.nDeleted);
+        vChunks.swap(other.vChunks);
+        vFreeNodes.swap(other.vFreeNodes);
+        std::swap(nChunkUsed, other.nChunkUsed);
+    }
+
+    //! Heap memory owned by the map itself (not by the elements' own members)
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(vSlots) +
+               memusage::MallocUsage(sizeof(Node) * NODES_PER_CHUNK) * vChunks.size() +
+               memusage::DynamicUsage(vChunks) + memusage::DynamicUsage(vFreeNodes);
+    }
+};
+
+namespace memusage
+{
+template <typename K, typename V, typename H>
+static inline size_t DynamicUsage(const flatmap<K, V, H>& m)
+{
+    return m.DynamicMemoryUsage();
+}
+}
+
+#endif // BITCOIN_FLATMAP_H
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "governancedb.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
+#include "masternodeman.h"
+
+CGovernanceDB* pGovernanceDB = NULL;
+
+CGovernanceDB::CGovernanceDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "governance", nCacheSize, fMemory, fWipe),
+                                                                            masternodes('m'),
+                                                                            masternodeOrder('l'),
+                                                                            seenMasternodeBroadcasts('b'),
+                                                                            seenMasternodePings('p'),
+                                                                            masternodeRequests('q'),
+                                                                            paymentVotes('w'),
+                                                                            paymentBlocks('k'),
+                                                                            proposals('r'),
+                                                                            finalizedBudgets('f'),
+                                                                            orphanProposalVotes('o'),
+                                                                            orphanFinalizedBudgetVotes('O')
+{
+}
+
+bool CGovernanceDB::ReadVersion(int& nVersion)
+{
+    return Read('V', nVersion);
+}
+
+bool CGovernanceDB::WriteVersion(int nVersion)
+{
+    return Write('V', nVersion, true);
+}
+
+bool LoadGovernanceDB()
+{
+    int nVersion = 0;
+    if (!pGovernanceDB->ReadVersion(nVersion) || nVersion != GOVERNANCE_DB_VERSION)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    mnodeman.Load(*pGovernanceDB);
+    budget.Load(*pGovernanceDB);
+    masternodePayments.Load(*pGovernanceDB);
+    LogPrint("masternode", "Loaded governance database  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode", "  %s\n", mnodeman.ToString());
+    LogPrint("masternode", "  %s\n", budget.ToString());
+    LogPrint("masternode", "  %s\n", masternodePayments.ToString());
+
+    // the same cleanup the flat files got after loading
+    mnodeman.CheckAndRemove(true);
+    budget.CheckAndRemove();
+    masternodePayments.CleanPaymentList();
+    return true;
+}
+
+bool FlushGovernanceDB()
+{
+    // the periodic flush and the one on shutdown must not interleave their passes
+    static CCriticalSection cs_flush;
+    LOCK(cs_flush);
+
+    if (pGovernanceDB == NULL) return false;
+
+    int64_t nStart = GetTimeMillis();
+    try {
+        mnodeman.Flush(*pGovernanceDB);
+        masternodePayments.Flush(*pGovernanceDB);
+        budget.Flush(*pGovernanceDB);
+    } catch (const leveldb_error& e) {
+        // what did not make it is written by the next flush
+        LogPrintf("%s : %s\n", __func__, e.what());
+        return false;
+    }
+
+    LogPrint("masternode", "Governance database flushed  %dms\n", GetTimeMillis() - nStart);
+    return true;
+}
@@ -0,0 +1,188 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LAPO_GOVERNANCEDB_H
+#define LAPO_GOVERNANCEDB_H
+
+#include "hash.h"
+#include "leveldbwrapper.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+
+class CGovernanceDB;
+
+extern CGovernanceDB* pGovernanceDB;
+
+/** Layout of the records, bumped when it changes; the flat files are imported once when it is missing */
+static const int GOVERNANCE_DB_VERSION = 1;
+
+/**
+ * The entries of one record type in the governance database, with the hash of each value as it was last written.
+ * A flush walks the in-memory state and only writes what changed, then erases whatever it did not come across.
+ */
+template <typename K>
+class CGovernanceRecords
+{
+private:
+    // key -> (hash of the stored value, pass that last came across it)
+    std::map<K, std::pair<uint256, unsigned int> > mapWritten;
+    // writes and erasures queued in the batch of the current pass, applied once the batch made it to disk
+    std::vector<std::pair<K, uint256> > vPendingWrites;
+    std::vector<K> vPendingErases;
+    unsigned int nPass;
+
+public:
+    const char chType;
+
+    explicit CGovernanceRecords(char chTypeIn) : nPass(0), chType(chTypeIn) {}
+
+    size_t size() const { return mapWritten.size(); }
+
+    void BeginPass()
+    {
+        nPass++;
+        vPendingWrites.clear();
+        vPendingErases.clear();
+    }
+
+    /// Queue value for writing unless it is stored already; immutable values are never compared, only their key is
+    template <typename V>
+    void Write(CLevelDBBatch& batch, const K& key, const V& value, bool fImmutable = false)
+    {
+        typename std::map<K, std::pair<uint256, unsigned int> >::iterator it = mapWritten.find(key);
+        if (it != mapWritten.end() && fImmutable) {
+            it->second.second = nPass;
+            return;
+        }
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << value;
+        uint256 hash = fImmutable ? uint256() : Hash(ssValue.begin(), ssValue.end());
+        if (it != mapWritten.end()) {
+            it->second.second = nPass;
+            if (it->second.first == hash) return;
+        }
+
+        batch.WriteSerialized(std::make_pair(chType, key), ssValue);
+        vPendingWrites.push_back(std::make_pair(key, hash));
+    }
+
+    /// Queue the erasure of every stored entry the current pass did not write
+    void EraseOthers(CLevelDBBatch& batch)
+    {
+        for (typename std::map<K, std::pair<uint256, unsigned int> >::iterator it = mapWritten.begin(); it != mapWritten.end(); ++it) {
+            if (it->second.second != nPass) {
+                batch.Erase(std::make_pair(chType, it->first));
+                vPendingErases.push_back(it->first);
+            }
+        }
+    }
+
+    /// The batch of the current pass was written
+    void Commit()
+    {
+        for (unsigned int i = 0; i < vPendingErases.size(); i++)
+            mapWritten.erase(vPendingErases[i]);
+        for (unsigned int i = 0; i < vPendingWrites.size(); i++)
+            mapWritten[vPendingWrites[i].first] = std::make_pair(vPendingWrites[i].second, nPass);
+        vPendingWrites.clear();
+        vPendingErases.clear();
+    }
+
+    /// Remember a value found in the database as written
+    void Loaded(const K& key, const uint256& hash)
+    {
+        mapWritten[key] = std::make_pair(hash, nPass);
+    }
+};
+
+/** Masternode list, payment votes and budget objects, stored entry by entry so a flush only writes what changed */
+class CGovernanceDB : public CLevelDBWrapper
+{
+public:
+    CGovernanceDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CGovernanceDB(const CGovernanceDB&);
+    void operator=(const CGovernanceDB&);
+
+public:
+    // CMasternodeMan
+    CGovernanceRecords<COutPoint> masternodes;
+    // the collateral outpoints in list order, as one record: lookups and ranks depend on the order of the list
+    CGovernanceRecords<int> masternodeOrder;
+    CGovernanceRecords<uint256> seenMasternodeBroadcasts;
+    CGovernanceRecords<uint256> seenMasternodePings;
+    CGovernanceRecords<int> masternodeRequests;
+    // CMasternodePayments
+    CGovernanceRecords<uint256> paymentVotes;
+    CGovernanceRecords<int> paymentBlocks;
+    // CBudgetManager
+    CGovernanceRecords<uint256> proposals;
+    CGovernanceRecords<uint256> finalizedBudgets;
+    CGovernanceRecords<uint256> orphanProposalVotes;
+    CGovernanceRecords<uint256> orphanFinalizedBudgetVotes;
+
+    bool ReadVersion(int& nVersion);
+    bool WriteVersion(int nVersion);
+
+    /// Read every entry of a record type into mapOut, remembering each one as written
+    template <typename K, typename V>
+    void ReadRecords(CGovernanceRecords<K>& records, std::map<K, V>& mapOut)
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << records.chType;
+        leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+
+        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+        for (pcursor->Seek(slPrefix); pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (!slKey.starts_with(slPrefix))
+                break;
+            std::pair<char, K> key;
+            try {
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                ssKey >> key;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : skipping unreadable key of type %c - %s\n", __func__, records.chType, e.what());
+                continue;
+            }
+            leveldb::Slice slValue = pcursor->value();
+            try {
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                V value;
+                ssValue >> value;
+                mapOut.insert(std::make_pair(key.second, value));
+                records.Loaded(key.second, Hash(slValue.data(), slValue.data() + slValue.size()));
+            } catch (const std::exception& e) {
+                // the next flush erases it, the entry will come from the network again
+                LogPrintf("%s : skipping unreadable record of type %c - %s\n", __func__, records.chType, e.what());
+                records.Loaded(key.second, uint256());
+            }
+        }
+        HandleError(pcursor->status());
+    }
+
+    /// Read one entry, remembering it as written
+    template <typename K, typename V>
+    bool ReadRecord(CGovernanceRecords<K>& records, const K& key, V& value)
+    {
+        if (!Read(std::make_pair(records.chType, key), value)) return false;
+        records.Loaded(key, SerializeHash(value, SER_DISK, CLIENT_VERSION));
+        return true;
+    }
+};
+
+/** Load the masternode list, the payment votes and the budget, false if the database holds none yet */
+bool LoadGovernanceDB();
+/** Write what changed in the masternode list, the payment votes and the budget since the last flush, false on a database error */
+bool FlushGovernanceDB();
+
+#endif // LAPO_GOVERNANCEDB_H
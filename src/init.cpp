@@ -18,6 +18,7 @@
 #include "amount.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "governancedb.h"
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
@@ -163,7 +164,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 void Interrupt(boost::thread_group& threadGroup)
@@ -202,10 +202,11 @@ void PrepareShutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL, 0);
 #endif
+    ClearPendingBlocks();
     StopNode();
-    DumpMasternodes();
-    DumpBudgets();
-    DumpMasternodePayments();
+    FlushGovernanceDB();
+    delete pGovernanceDB;
+    pGovernanceDB = NULL;
     UnregisterNodeSignals(GetNodeSignals());
 
     if (fFeeEstimatesInitialized) {
@@ -353,8 +354,13 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the coin database from a background thread instead of while holding the chain lock (default: %u)"), DEFAULT_ASYNC_FLUSH));
+    strUsage += HelpMessageOpt("-blockcheckthreads=<n>", strprintf(_("Set the number of threads pre-validating received blocks ahead of connection (0 to %d, default: %d)"), MAX_BLOCK_CHECK_THREADS, DEFAULT_BLOCK_CHECK_THREADS));
+    strUsage += HelpMessageOpt("-messagethreads=<n>", strprintf(_("Set the number of threads handling masternode, budget, spork and LPCtx vote messages (0 to %d, default: %d)"), MAX_MESSAGE_WORKER_THREADS, DEFAULT_MESSAGE_WORKER_THREADS));
+    strUsage += HelpMessageOpt("-sigcheckthreads=<n>", strprintf(_("Set the number of threads checking masternode, payment, budget and LPCtx vote signatures ahead of the message threads (%d to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SIGNATURE_CHECK_THREADS, DEFAULT_SIGNATURE_CHECK_THREADS));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blocksizenotify=<cmd>", _("Execute command when the best block changes and its size is over (%s in cmd is replaced by block hash, %d with the block size)"));
+    strUsage += HelpMessageOpt("-chainstateformat=<format>", _("Layout of the chainstate database: txid (one record per transaction) or outpoint (one record per unspent output, converted in place on first start; cannot be reverted without -reindex) (default: txid)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "lapo.conf"));
     if (mode == HMM_BITCOIND) {
@@ -390,6 +396,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-discover", _("Discover own IP address (default: 1 when listening and no -externalip)"));
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)"));
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
+    strUsage += HelpMessageOpt("-evictslowpeers", strprintf(_("Periodically replace the automatic outbound peer that announces new blocks latest (default: %u)"), DEFAULT_EVICT_SLOW_PEERS));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
@@ -397,10 +404,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-maxpeeruploadrate=<n>", strprintf(_("Limit the upload rate to each peer to <n> KB/s, 0 = no limit (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-maxuploadrate=<n>", strprintf(_("Limit the upload rate to all peers together to <n> KB/s, 0 = no limit (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
+    strUsage += HelpMessageOpt("-peercompactblocks", strprintf(_("Announce new blocks as compact blocks and reconstruct them from the mempool (default: %u)"), DEFAULT_PEERCOMPACTBLOCKS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 31714, 31715));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
@@ -471,7 +482,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, http, libevent, lapo, (obfuscation, lpctx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, http, libevent, lapo, (obfuscation, lpctx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -842,9 +853,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef USE_EPOLL
+    // The epoll socket handler is not limited by FD_SETSIZE, only by the descriptor limit below
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -889,6 +905,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -blockcheckthreads=0 processes received blocks in the message handler thread
+    nBlockCheckThreads = std::max(0, std::min(MAX_BLOCK_CHECK_THREADS, (int)GetArg("-blockcheckthreads", DEFAULT_BLOCK_CHECK_THREADS)));
+
+    // -messagethreads=0 handles all messages in the message handler thread
+    nMessageWorkerThreads = std::max(0, std::min(MAX_MESSAGE_WORKER_THREADS, (int)GetArg("-messagethreads", DEFAULT_MESSAGE_WORKER_THREADS)));
+
+    // -sigcheckthreads=0 means autodetect; signatures are only checked ahead of the message workers
+    nSignatureCheckThreads = GetArg("-sigcheckthreads", DEFAULT_SIGNATURE_CHECK_THREADS);
+    if (nSignatureCheckThreads <= 0)
+        nSignatureCheckThreads += boost::thread::hardware_concurrency();
+    nSignatureCheckThreads = std::max(0, std::min(MAX_SIGNATURE_CHECK_THREADS, nSignatureCheckThreads));
+    if (!nMessageWorkerThreads)
+        nSignatureCheckThreads = 0;
+
+    fEvictSlowPeers = GetBoolArg("-evictslowpeers", DEFAULT_EVICT_SLOW_PEERS);
+
     fServer = GetBoolArg("-server", false);
     setvbuf(stdout, NULL, _IOLBF, 0); /// ***TODO*** do we still need this after -printtoconsole is gone?
 
@@ -970,6 +1002,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    if (GetBoolArg("-peercompactblocks", DEFAULT_PEERCOMPACTBLOCKS))
+        nLocalServices |= NODE_COMPACT_BLOCKS;
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Sanity check
@@ -1013,10 +1048,27 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        for (int i = 0; i < nScriptCheckThreads - 1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadMasternodeScore);
+        }
     }
 
+    LogPrintf("Using %u threads for block pre-validation\n", nBlockCheckThreads);
+    if (nBlockCheckThreads) {
+        for (int i = 0; i < nBlockCheckThreads; i++)
+            threadGroup.create_thread(&ThreadBlockCheck);
+        threadGroup.create_thread(&ThreadBlockProcess);
+    }
+
+    LogPrintf("Using %u threads for masternode-layer messages\n", nMessageWorkerThreads);
+    for (int i = 0; i < nMessageWorkerThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadMessageWorker, i));
+
+    LogPrintf("Using %u threads for masternode-layer signature checks\n", nSignatureCheckThreads);
+    for (int i = 0; i < nSignatureCheckThreads; i++)
+        threadGroup.create_thread(&ThreadSignatureCheck);
+
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
         if (!sporkManager.SetPrivKey(GetArg("-sporkkey", "")))
@@ -1306,6 +1358,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     BOOST_FOREACH (string strDest, mapMultiArgs["-seednode"])
         AddOneShot(strDest);
 
+    if (mapArgs.count("-maxuploadtarget")) {
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
+    }
+    CNode::SetMaxUploadRate(1000 * GetArg("-maxuploadrate", 0));
+
 #if ENABLE_ZMQ
     pzmqNotificationInterface = CZMQNotificationInterface::CreateWithArguments(mapArgs);
 
@@ -1355,7 +1412,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache, which is flushed by size in bytes
+
+    std::string strCoinsFormat = GetArg("-chainstateformat", "txid");
+    if (strCoinsFormat != "txid" && strCoinsFormat != "outpoint")
+        return InitError(strprintf(_("Unknown -chainstateformat: '%s'"), strCoinsFormat));
+    bool fPerOutpointCoins = strCoinsFormat == "outpoint";
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1380,10 +1442,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pSporkDB = new CSporkDB(0, false, false);
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH));
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                if (fPerOutpointCoins)
+                    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+                if (!pcoinsdbview->Upgrade(fPerOutpointCoins)) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
 
@@ -1660,55 +1729,74 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 10: setup ObfuScation
 
+    // Watch collaterals from before the first masternode is checked
+    RegisterValidationInterface(&collateralWatcher);
+
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    delete pGovernanceDB;
+    pGovernanceDB = new CGovernanceDB(0, false, false);
+    if (!LoadGovernanceDB()) {
+        // First start with the governance database: take over what the flat files have, if anything
+        CMasternodeDB mndb;
+        CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
+        if (readResult == CMasternodeDB::FileError)
+            LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
+        else if (readResult != CMasternodeDB::Ok) {
+            LogPrintf("Error reading mncache.dat: ");
+            if (readResult == CMasternodeDB::IncorrectFormat)
+                LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+            else
+                LogPrintf("file format is unknown or invalid, please fix it manually\n");
+        }
 
-    uiInterface.InitMessage(_("Loading budget cache..."));
+        uiInterface.InitMessage(_("Loading budget cache..."));
 
-    CBudgetDB budgetdb;
-    CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
+        CBudgetDB budgetdb;
+        CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
 
-    if (readResult2 == CBudgetDB::FileError)
-        LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
-    else if (readResult2 != CBudgetDB::Ok) {
-        LogPrintf("Error reading budget.dat: ");
-        if (readResult2 == CBudgetDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+        if (readResult2 == CBudgetDB::FileError)
+            LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
+        else if (readResult2 != CBudgetDB::Ok) {
+            LogPrintf("Error reading budget.dat: ");
+            if (readResult2 == CBudgetDB::IncorrectFormat)
+                LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+            else
+                LogPrintf("file format is unknown or invalid, please fix it manually\n");
+        }
 
-    //flag our cached items so we send them to our peers
-    budget.ResetSync();
-    budget.ClearSeen();
+        uiInterface.InitMessage(_("Loading masternode payment cache..."));
 
+        CMasternodePaymentDB mnpayments;
+        CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
 
-    uiInterface.InitMessage(_("Loading masternode payment cache..."));
+        if (readResult3 == CMasternodePaymentDB::FileError)
+            LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
+        else if (readResult3 != CMasternodePaymentDB::Ok) {
+            LogPrintf("Error reading mnpayments.dat: ");
+            if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
+                LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+            else
+                LogPrintf("file format is unknown or invalid, please fix it manually\n");
+        }
 
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
+        if (!FlushGovernanceDB() || !pGovernanceDB->WriteVersion(GOVERNANCE_DB_VERSION))
+            return InitError(_("Error writing the governance database"));
+        LogPrintf("Imported masternode, budget and payment caches into the governance database\n");
 
-    if (readResult3 == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
-    else if (readResult3 != CMasternodePaymentDB::Ok) {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
+        // imported once, the database holds them from now on
+        const char* const vFlatFiles[] = {"mncache.dat", "budget.dat", "mnpayments.dat"};
+        for (unsigned int i = 0; i < ARRAYLEN(vFlatFiles); i++) {
+            boost::filesystem::path pathFlat = GetDataDir() / vFlatFiles[i];
+            if (boost::filesystem::exists(pathFlat))
+                RenameOver(pathFlat, GetDataDir() / strprintf("%s.old", vFlatFiles[i]));
+        }
     }
 
+    //flag our cached items so we send them to our peers
+    budget.ResetSync();
+    budget.ClearSeen();
+
     fMasterNode = GetBoolArg("-masternode", false);
 
     if ((fMasterNode || masternodeConfig.getCount() > -1) && fTxIndex == false) {
@@ -49,6 +49,20 @@ public:
         batch.Put(slKey, slValue);
     }
 
+    /** Write a value that is serialized already */
+    template <typename K>
+    void WriteSerialized(const K& key, const CDataStream& ssValue)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+
+        leveldb::Slice slValue(ssValue.empty() ? NULL : &ssValue[0], ssValue.size());
+
+        batch.Put(slKey, slValue);
+    }
+
     template <typename K>
     void Erase(const K& key)
     {
@@ -23,13 +23,8 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
-std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
-int nCompleteTXLocks;
+CTransactionLockManager txLockManager;
+std::atomic<int> nCompleteTXLocks(0);
 
 //txlock - Locks transaction
 //
@@ -54,7 +49,7 @@ void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRe
         pfrom->AddInventoryKnown(inv);
         GetMainSignals().Inventory(inv.hash);
 
-        if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
+        if (txLockManager.HaveRequest(tx.GetHash())) {
             return;
         }
 
@@ -86,20 +81,25 @@ void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRe
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddRequest(tx);
 
             LogPrintf("ProcessMessageLPCtx::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
-            if (GetTransactionLockSignatures(tx.GetHash()) == LPCTX_SIGNATURES_REQUIRED) {
-                GetMainSignals().NotifyTransactionLock(tx);
+            // the votes may all have been here before the request
+            txLockManager.CompleteLock(tx.GetHash());
+            CTransaction txLocked;
+            if (txLockManager.NotifyCompleteLock(tx.GetHash(), txLocked)) {
+                // listeners like the collateral watcher expect cs_main held, as for the other transaction events
+                LOCK(cs_main);
+                GetMainSignals().NotifyTransactionLock(txLocked);
             }
 
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddRejectedRequest(tx);
 
             // can we get the conflicting transaction as proof?
 
@@ -107,24 +107,15 @@ void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRe
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
-
             // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()) {
-                //we only care if we have a complete tx lock
-                if ((*i).second.CountSignatures() >= LPCTX_SIGNATURES_REQUIRED) {
-                    if (!CheckForConflictingLocks(tx)) {
-                        LogPrintf("ProcessMessageLPCtx::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
-                    }
+            //we only care if we have a complete tx lock
+            if (txLockManager.GetSignatures(tx.GetHash()) >= LPCTX_SIGNATURES_REQUIRED) {
+                if (!txLockManager.CheckForConflictingLocks(tx)) {
+                    LogPrintf("ProcessMessageLPCtx::ix - Found Existing Complete IX Lock\n");
+
+                    //reprocess the last 15 blocks
+                    ReprocessBlocks(15);
+                    txLockManager.AddRequest(tx);
                 }
             }
 
@@ -138,12 +129,10 @@ void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRe
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockVote.count(ctx.GetHash())) {
+        if (!txLockManager.AddVote(ctx)) {
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
-
         if (ProcessConsensusVote(pfrom, ctx)) {
             //Spam/Dos protection
             /*
@@ -151,26 +140,19 @@ void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRe
                 This tracks those messages and allows it at the same rate of the rest of the network, if
                 a peer violates it, it will simply be ignored
             */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
-
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageLPCtx::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+            if (!txLockManager.HaveRequest(ctx.txHash) && !txLockManager.AllowUnknownVote(ctx.vinMasternode.prevout.hash)) {
+                LogPrintf("ProcessMessageLPCtx::ix - masternode is spamming transaction votes: %s %s\n",
+                    ctx.vinMasternode.ToString().c_str(),
+                    ctx.txHash.ToString().c_str());
+                return;
             }
             RelayInv(inv);
         }
 
-        if (mapTxLockReq.count(ctx.txHash) && GetTransactionLockSignatures(ctx.txHash) == LPCTX_SIGNATURES_REQUIRED) {
-            GetMainSignals().NotifyTransactionLock(mapTxLockReq[ctx.txHash]);
+        CTransaction tx;
+        if (txLockManager.NotifyCompleteLock(ctx.txHash, tx)) {
+            LOCK(cs_main);
+            GetMainSignals().NotifyTransactionLock(tx);
         }
 
         return;
@@ -243,20 +225,7 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
-    if (!mapTxLocks.count(tx.GetHash())) {
-        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
-    } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
-        LogPrint("lpctx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
-    }
-
+    txLockManager.CreateLock(tx.GetHash(), nBlockHeight);
 
     return nBlockHeight;
 }
@@ -296,7 +265,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    txLockManager.AddVote(ctx);
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
     RelayInv(inv);
@@ -330,136 +299,49 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         return false;
     }
 
-    if (!mapTxLocks.count(ctx.txHash)) {
-        LogPrintf("LPCtx::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else
-        LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
-
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+    int nSignatures = txLockManager.AddSignature(ctx);
 
 #ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if (pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
+    if (pwalletMain) {
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        LOCK(pwalletMain->cs_wallet);
+        if (pwalletMain->mapRequestCount.count(ctx.txHash))
+            pwalletMain->mapRequestCount[ctx.txHash]++;
+    }
 #endif
 
-        LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+    LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", nSignatures, ctx.GetHash().ToString().c_str());
 
-        if ((*i).second.CountSignatures() >= LPCTX_SIGNATURES_REQUIRED) {
-            LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+    if (nSignatures >= LPCTX_SIGNATURES_REQUIRED) {
+        LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", ctx.txHash.ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if (!CheckForConflictingLocks(tx)) {
+        if (txLockManager.CompleteLock(ctx.txHash)) {
 #ifdef ENABLE_WALLET
-                if (pwalletMain) {
-                    if (pwalletMain->UpdatedTransaction((*i).second.txHash)) {
-                        nCompleteTXLocks++;
-                    }
-                }
-#endif
-
-                if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
-
-                // resolve conflicts
-
-                //if this tx lock was rejected, we need to remove the conflicting blocks
-                if (mapTxLockReqRejected.count((*i).second.txHash)) {
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
+            if (pwalletMain) {
+                if (pwalletMain->UpdatedTransaction(ctx.txHash)) {
+                    nCompleteTXLocks++;
                 }
             }
-        }
-        return true;
-    }
-
-
-    return false;
-}
+#endif
 
-bool CheckForConflictingLocks(CTransaction& tx)
-{
-    /*
-        It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
-        In that case, they will cancel each other out.
+            // resolve conflicts
 
-        Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
-        rescan the blocks and find they're acceptable and then take the chain with the most work.
-    */
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("LPCtx::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
+            //if this tx lock was rejected, we need to remove the conflicting blocks
+            if (txLockManager.IsRejected(ctx.txHash)) {
+                //reprocess the last 15 blocks
+                ReprocessBlocks(15);
             }
         }
     }
 
-    return false;
-}
-
-int64_t GetAverageVoteTime()
-{
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
-
-    return total / count;
+    return true;
 }
 
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
-
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
-
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
-
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
-
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
-
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
-
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
-        }
-    }
+    txLockManager.Clean();
 }
 
 int GetTransactionLockSignatures(uint256 txHash)
@@ -467,10 +349,7 @@ int GetTransactionLockSignatures(uint256 txHash)
     if(fLargeWorkForkFound || fLargeWorkInvalidChainFound) return -2;
     if (!IsSporkActive(SPORK_2_LPCTX)) return -1;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
-    if(it != mapTxLocks.end()) return it->second.CountSignatures();
-
-    return -1;
+    return txLockManager.GetSignatures(txHash);
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -482,7 +361,7 @@ uint256 CConsensusVote::GetHash() const
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -506,7 +385,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -528,6 +407,11 @@ bool CConsensusVote::Sign()
     return true;
 }
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 
 bool CTransactionLock::SignaturesValid()
 {
@@ -553,12 +437,24 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+void CTransactionLock::AddSignature(const CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    if (cv.nBlockHeight == nBlockHeight)
+        nSignatures++;
+}
+
+void CTransactionLock::SetBlockHeight(int nBlockHeightIn)
+{
+    nBlockHeight = nBlockHeightIn;
+    nSignatures = 0;
+    BOOST_FOREACH (const CConsensusVote& v, vecConsensusVotes) {
+        if (v.nBlockHeight == nBlockHeight)
+            nSignatures++;
+    }
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -567,11 +463,344 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
+    return nSignatures;
+}
+
+void CLatencyHistogram::Add(int64_t nMicros)
+{
+    if (nCount == 0 || nMicros < nMin) nMin = nMicros;
+    if (nCount == 0 || nMicros > nMax) nMax = nMicros;
+    nCount++;
+    nTotal += nMicros;
+
     int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
-        if (v.nBlockHeight == nBlockHeight) {
-            n++;
+    while (n < LPCTX_LATENCY_BUCKETS - 1 && nMicros > GetBucketLimit(n))
+        n++;
+    vBuckets[n]++;
+}
+
+int64_t CLatencyHistogram::GetBucketLimit(int n)
+{
+    if (n >= LPCTX_LATENCY_BUCKETS - 1) return -1;
+    return (LPCTX_LATENCY_BUCKET_MIN_MS * 1000) << n;
+}
+
+CTransactionLock& CTransactionLockManager::GetOrCreateLock(const uint256& txHash, int64_t nNow)
+{
+    AssertLockHeld(cs);
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it != mapTxLocks.end()) return it->second;
+
+    CTransactionLock& lock = mapTxLocks[txHash];
+    lock.txHash = txHash;
+    lock.nExpiration = nNow + (60 * 60); //locks expire after 60 minutes (24 confirmations)
+    lock.nTimeout = nNow + (60 * 5);
+    setLockExpirations.insert(std::make_pair((int64_t)lock.nExpiration, txHash));
+    return lock;
+}
+
+void CTransactionLockManager::SetExpiration(CTransactionLock& lock, int64_t nExpiration)
+{
+    AssertLockHeld(cs);
+
+    setLockExpirations.erase(std::make_pair((int64_t)lock.nExpiration, lock.txHash));
+    lock.nExpiration = nExpiration;
+    setLockExpirations.insert(std::make_pair((int64_t)lock.nExpiration, lock.txHash));
+}
+
+void CTransactionLockManager::LockInput(const COutPoint& outpoint, const uint256& txHash)
+{
+    AssertLockHeld(cs);
+
+    if (mapLockedInputs.insert(std::make_pair(outpoint, txHash)).second)
+        mapLockedInputsByTx[txHash].push_back(outpoint);
+}
+
+void CTransactionLockManager::UpdateLockState(CTransactionLock& lock)
+{
+    AssertLockHeld(cs);
+
+    if (lock.fComplete || lock.CountSignatures() < LPCTX_SIGNATURES_REQUIRED) return;
+
+    lock.fComplete = true;
+    nCompleted++;
+    if (lock.nTimeRequest)
+        latency.Add(GetTimeMicros() - lock.nTimeRequest);
+}
+
+int64_t CTransactionLockManager::GetAverageVoteTime()
+{
+    AssertLockHeld(cs);
+
+    if (mapUnknownVotes.empty()) return 0;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
+}
+
+bool CTransactionLockManager::HaveRequest(const uint256& txHash) const
+{
+    LOCK(cs);
+    return mapTxLockReq.count(txHash) || mapTxLockReqRejected.count(txHash);
+}
+
+bool CTransactionLockManager::IsRejected(const uint256& txHash) const
+{
+    LOCK(cs);
+    return mapTxLockReqRejected.count(txHash) > 0;
+}
+
+bool CTransactionLockManager::GetRequest(const uint256& txHash, CTransaction& tx) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransaction>::const_iterator it = mapTxLockReq.find(txHash);
+    if (it == mapTxLockReq.end()) return false;
+    tx = it->second;
+    return true;
+}
+
+void CTransactionLockManager::AddRequest(const CTransaction& tx)
+{
+    LOCK(cs);
+    mapTxLockReq.insert(std::make_pair(tx.GetHash(), tx));
+}
+
+void CTransactionLockManager::AddRejectedRequest(const CTransaction& tx)
+{
+    LOCK(cs);
+    mapTxLockReqRejected.insert(std::make_pair(tx.GetHash(), tx));
+    // the lock expiring is what releases the inputs again
+    GetOrCreateLock(tx.GetHash(), GetTime());
+    BOOST_FOREACH (const CTxIn& in, tx.vin)
+        LockInput(in.prevout, tx.GetHash());
+}
+
+bool CTransactionLockManager::HaveVote(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapTxLockVote.count(hash) > 0;
+}
+
+bool CTransactionLockManager::GetVote(const uint256& hash, CConsensusVote& vote) const
+{
+    LOCK(cs);
+    std::map<uint256, CConsensusVote>::const_iterator it = mapTxLockVote.find(hash);
+    if (it == mapTxLockVote.end()) return false;
+    vote = it->second;
+    return true;
+}
+
+bool CTransactionLockManager::AddVote(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    return mapTxLockVote.insert(std::make_pair(vote.GetHash(), vote)).second;
+}
+
+void CTransactionLockManager::CreateLock(const uint256& txHash, int nBlockHeight)
+{
+    LOCK(cs);
+    if (mapTxLocks.count(txHash)) {
+        LogPrint("lpctx", "CreateNewLock - Transaction Lock Exists %s !\n", txHash.ToString().c_str());
+    } else {
+        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", txHash.ToString().c_str());
+    }
+
+    CTransactionLock& lock = GetOrCreateLock(txHash, GetTime());
+    if (!lock.nTimeRequest) lock.nTimeRequest = GetTimeMicros();
+    lock.SetBlockHeight(nBlockHeight);
+    UpdateLockState(lock);
+}
+
+int CTransactionLockManager::AddSignature(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    if (mapTxLocks.count(vote.txHash)) {
+        LogPrint("lpctx", "LPCtx::ProcessConsensusVote - Transaction Lock Exists %s !\n", vote.txHash.ToString().c_str());
+    } else {
+        LogPrintf("LPCtx::ProcessConsensusVote - New Transaction Lock %s !\n", vote.txHash.ToString().c_str());
+    }
+
+    CTransactionLock& lock = GetOrCreateLock(vote.txHash, GetTime());
+    lock.AddSignature(vote);
+    UpdateLockState(lock);
+    return lock.CountSignatures();
+}
+
+int CTransactionLockManager::GetSignatures(const uint256& txHash) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end()) return -1;
+    return it->second.CountSignatures();
+}
+
+bool CTransactionLockManager::IsLockTimedOut(const uint256& txHash) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end()) return false;
+    return GetTime() > it->second.nTimeout;
+}
+
+bool CTransactionLockManager::NotifyCompleteLock(const uint256& txHash, CTransaction& tx)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end() || !it->second.fComplete || it->second.fNotified) return false;
+
+    std::map<uint256, CTransaction>::const_iterator mi = mapTxLockReq.find(txHash);
+    if (mi == mapTxLockReq.end()) return false;
+
+    it->second.fNotified = true;
+    tx = mi->second;
+    return true;
+}
+
+bool CTransactionLockManager::IsInputLocked(const COutPoint& outpoint) const
+{
+    LOCK(cs);
+    return mapLockedInputs.count(outpoint) > 0;
+}
+
+bool CTransactionLockManager::GetLockedInput(const COutPoint& outpoint, uint256& txHash) const
+{
+    LOCK(cs);
+    std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(outpoint);
+    if (it == mapLockedInputs.end()) return false;
+    txHash = it->second;
+    return true;
+}
+
+void CTransactionLockManager::LockInputs(const CTransaction& tx)
+{
+    LOCK(cs);
+    BOOST_FOREACH (const CTxIn& in, tx.vin)
+        LockInput(in.prevout, tx.GetHash());
+}
+
+bool CTransactionLockManager::CheckForConflictingLocks(const CTransaction& tx)
+{
+    LOCK(cs);
+    return CancelConflictingLocks(tx);
+}
+
+bool CTransactionLockManager::CompleteLock(const uint256& txHash)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end() || !it->second.fComplete) return true;
+
+    std::map<uint256, CTransaction>::const_iterator mi = mapTxLockReq.find(txHash);
+    if (mi == mapTxLockReq.end()) return true;
+
+    // checked and held in one go, so of two conflicting locks completing at once the second sees the first
+    if (CancelConflictingLocks(mi->second)) return false;
+
+    BOOST_FOREACH (const CTxIn& in, mi->second.vin)
+        LockInput(in.prevout, txHash);
+    return true;
+}
+
+bool CTransactionLockManager::CancelConflictingLocks(const CTransaction& tx)
+{
+    /*
+        It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
+        In that case, they will cancel each other out.
+
+        Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
+        rescan the blocks and find they're acceptable and then take the chain with the most work.
+    */
+    AssertLockHeld(cs);
+
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            LogPrintf("LPCtx::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), it->second.ToString().c_str());
+            int64_t nNow = GetTime();
+            std::map<uint256, CTransactionLock>::iterator mi = mapTxLocks.find(tx.GetHash());
+            if (mi != mapTxLocks.end()) SetExpiration(mi->second, nNow);
+            mi = mapTxLocks.find(it->second);
+            if (mi != mapTxLocks.end()) SetExpiration(mi->second, nNow);
+            nConflicts++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool CTransactionLockManager::AllowUnknownVote(const uint256& hashMasternode)
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(hashMasternode);
+    if (it == mapUnknownVotes.end()) {
+        it = mapUnknownVotes.insert(std::make_pair(hashMasternode, nNow + (60 * 10))).first;
+        nUnknownVotesTotal += it->second;
+    }
+
+    if (it->second > nNow && it->second - GetAverageVoteTime() > 60 * 10)
+        return false;
+
+    nUnknownVotesTotal += nNow + (60 * 10) - it->second;
+    it->second = nNow + (60 * 10);
+    return true;
+}
+
+void CTransactionLockManager::Clean()
+{
+    LOCK(cs);
+
+    // keep them for an hour
+    int64_t nNow = GetTime();
+    while (!setLockExpirations.empty() && setLockExpirations.begin()->first < nNow) {
+        uint256 txHash = setLockExpirations.begin()->second;
+        setLockExpirations.erase(setLockExpirations.begin());
+        LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
+
+        std::map<uint256, std::vector<COutPoint> >::iterator mi = mapLockedInputsByTx.find(txHash);
+        if (mi != mapLockedInputsByTx.end()) {
+            BOOST_FOREACH (const COutPoint& outpoint, mi->second)
+                mapLockedInputs.erase(outpoint);
+            mapLockedInputsByTx.erase(mi);
+        }
+
+        mapTxLockReq.erase(txHash);
+        mapTxLockReqRejected.erase(txHash);
+
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if (it != mapTxLocks.end()) {
+            BOOST_FOREACH (const CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
+            mapTxLocks.erase(it);
         }
+        nExpired++;
     }
-    return n;
+}
+
+void CTransactionLockManager::Clear()
+{
+    LOCK(cs);
+    mapTxLockReq.clear();
+    mapTxLockReqRejected.clear();
+    mapTxLockVote.clear();
+    mapTxLocks.clear();
+    mapLockedInputs.clear();
+    mapLockedInputsByTx.clear();
+    setLockExpirations.clear();
+    mapUnknownVotes.clear();
+    nUnknownVotesTotal = 0;
+}
+
+void CTransactionLockManager::GetStats(CTransactionLockStats& stats) const
+{
+    LOCK(cs);
+    stats.nRequests = mapTxLockReq.size();
+    stats.nRejected = mapTxLockReqRejected.size();
+    stats.nLocks = mapTxLocks.size();
+    stats.nVotes = mapTxLockVote.size();
+    stats.nLockedInputs = mapLockedInputs.size();
+    stats.nCompleted = nCompleted;
+    stats.nConflicts = nConflicts;
+    stats.nExpired = nExpired;
+    stats.latency = latency;
 }
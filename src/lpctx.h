@@ -15,6 +15,8 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of LPCtx
@@ -33,24 +35,22 @@ using namespace boost;
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
+class CTransactionLockManager;
 
 static const int MIN_LPCTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
-extern int nCompleteTXLocks;
+/** Lock latency buckets: the first one holds locks completed within LPCTX_LATENCY_BUCKET_MIN_MS, each next one twice as long */
+static const int LPCTX_LATENCY_BUCKETS = 12;
+static const int64_t LPCTX_LATENCY_BUCKET_MIN_MS = 100;
+
+extern CTransactionLockManager txLockManager;
+extern std::atomic<int> nCompleteTXLocks;
 
 
 int64_t CreateNewLock(CTransaction tx);
 
 bool IsIXTXValid(const CTransaction& txCollateral);
 
-// if two conflicting locks are approved by the network, they will cancel out
-bool CheckForConflictingLocks(CTransaction& tx);
-
 void ProcessMessageLPCtx(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
@@ -65,8 +65,6 @@ void CleanTransactionLocksList();
 // get the accepted transaction lock signatures
 int GetTransactionLockSignatures(uint256 txHash);
 
-int64_t GetAverageVoteTime();
-
 class CConsensusVote
 {
 public:
@@ -79,6 +77,8 @@ public:
 
     bool SignatureValid();
     bool Sign();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -94,16 +94,28 @@ public:
 
 class CTransactionLock
 {
+private:
+    // votes for nBlockHeight, the only ones that count
+    int nSignatures;
+
 public:
     int nBlockHeight;
     uint256 txHash;
     std::vector<CConsensusVote> vecConsensusVotes;
     int nExpiration;
     int nTimeout;
+    // when the lock request was first seen (GetTimeMicros), 0 while only votes are known
+    int64_t nTimeRequest;
+    // whether the lock got its signatures, and whether that was announced
+    bool fComplete;
+    bool fNotified;
+
+    CTransactionLock() : nSignatures(0), nBlockHeight(0), nExpiration(0), nTimeout(0), nTimeRequest(0), fComplete(false), fNotified(false) {}
 
     bool SignaturesValid();
-    int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    int CountSignatures() const;
+    void AddSignature(const CConsensusVote& cv);
+    void SetBlockHeight(int nBlockHeightIn);
 
     uint256 GetHash()
     {
@@ -111,5 +123,120 @@ public:
     }
 };
 
+/** Counts of lock latencies, from the lock request to the lock getting LPCTX_SIGNATURES_REQUIRED signatures */
+class CLatencyHistogram
+{
+public:
+    uint64_t nCount;
+    int64_t nTotal;
+    int64_t nMin;
+    int64_t nMax;
+    uint64_t vBuckets[LPCTX_LATENCY_BUCKETS];
+
+    CLatencyHistogram() : nCount(0), nTotal(0), nMin(0), nMax(0)
+    {
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+
+    void Add(int64_t nMicros);
+    /// Upper bound of bucket n in microseconds, -1 for the last one
+    static int64_t GetBucketLimit(int n);
+};
+
+struct CTransactionLockStats {
+    size_t nRequests;
+    size_t nRejected;
+    size_t nLocks;
+    size_t nVotes;
+    size_t nLockedInputs;
+    uint64_t nCompleted;
+    uint64_t nConflicts;
+    uint64_t nExpired;
+    CLatencyHistogram latency;
+};
+
+/**
+ * Lock requests, votes and locks, indexed by transaction, by locked outpoint and by expiration so none of the
+ * lookups or the periodic cleanup has to walk all of them. Its lock is taken last. Each call is atomic on its own,
+ * so a check that has to hold until the state is changed belongs in a single call, like CompleteLock.
+ */
+class CTransactionLockManager
+{
+private:
+    mutable CCriticalSection cs;
+
+    std::map<uint256, CTransaction> mapTxLockReq;
+    std::map<uint256, CTransaction> mapTxLockReqRejected;
+    std::map<uint256, CConsensusVote> mapTxLockVote;
+    std::map<uint256, CTransactionLock> mapTxLocks;
+    // locked outpoint -> transaction holding it, and the other way round
+    std::map<COutPoint, uint256> mapLockedInputs;
+    std::map<uint256, std::vector<COutPoint> > mapLockedInputsByTx;
+    // (nExpiration, txHash) of every lock in mapTxLocks
+    std::set<std::pair<int64_t, uint256> > setLockExpirations;
+    // masternode -> when it may next vote for an unknown transaction, for DOS; and the sum of those times
+    std::map<uint256, int64_t> mapUnknownVotes;
+    int64_t nUnknownVotesTotal;
+
+    uint64_t nCompleted;
+    uint64_t nConflicts;
+    uint64_t nExpired;
+    CLatencyHistogram latency;
+
+    CTransactionLock& GetOrCreateLock(const uint256& txHash, int64_t nNow);
+    void SetExpiration(CTransactionLock& lock, int64_t nExpiration);
+    void LockInput(const COutPoint& outpoint, const uint256& txHash);
+    void UpdateLockState(CTransactionLock& lock);
+    bool CancelConflictingLocks(const CTransaction& tx);
+    int64_t GetAverageVoteTime();
+
+public:
+    CTransactionLockManager() : nUnknownVotesTotal(0), nCompleted(0), nConflicts(0), nExpired(0) {}
+
+    /// Known as an accepted or a rejected lock request
+    bool HaveRequest(const uint256& txHash) const;
+    bool IsRejected(const uint256& txHash) const;
+    bool GetRequest(const uint256& txHash, CTransaction& tx) const;
+    void AddRequest(const CTransaction& tx);
+    /// Remember a request the mempool refused, holding its inputs that no other lock holds
+    void AddRejectedRequest(const CTransaction& tx);
+
+    bool HaveVote(const uint256& hash) const;
+    bool GetVote(const uint256& hash, CConsensusVote& vote) const;
+    /// False if the vote is known already
+    bool AddVote(const CConsensusVote& vote);
+
+    /// Start the lock of a requested transaction, or move an existing one to nBlockHeight
+    void CreateLock(const uint256& txHash, int nBlockHeight);
+    /// Add a checked vote to the lock of its transaction, creating the lock if needed; returns its signatures
+    int AddSignature(const CConsensusVote& vote);
+    /// Signatures of the lock of txHash, -1 if there is none
+    int GetSignatures(const uint256& txHash) const;
+    bool IsLockTimedOut(const uint256& txHash) const;
+    /// Once a lock with a known request has its signatures, returns true the first time with the request in tx
+    bool NotifyCompleteLock(const uint256& txHash, CTransaction& tx);
+
+    bool IsInputLocked(const COutPoint& outpoint) const;
+    /// The transaction holding outpoint, false if none does
+    bool GetLockedInput(const COutPoint& outpoint, uint256& txHash) const;
+    /// Hold the inputs of tx that no other lock holds
+    void LockInputs(const CTransaction& tx);
+    /// If two conflicting locks are approved by the network, they will cancel out
+    bool CheckForConflictingLocks(const CTransaction& tx);
+    /**
+     * Once the lock of txHash has its signatures and its request is known, hold the inputs of the request,
+     * unless another lock holds one of them and both get cancelled. False on such a conflict.
+     */
+    bool CompleteLock(const uint256& txHash);
+
+    /// Rate limit votes for transactions we don't know, false if the masternode is spamming them
+    bool AllowUnknownVote(const uint256& hashMasternode);
+
+    /// Drop the locks that expired, with their requests, votes and inputs
+    void Clean();
+    void Clear();
+    void GetStats(CTransactionLockStats& stats) const;
+};
+
 
 #endif
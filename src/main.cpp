@@ -11,6 +11,7 @@
 #include "accumulators.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -73,13 +74,17 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nBlockCheckThreads = 0;
+int nMessageWorkerThreads = 0;
+int nSignatureCheckThreads = 0;
+bool fEvictSlowPeers = DEFAULT_EVICT_SLOW_PEERS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -179,6 +184,16 @@ map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/** When each recent new block was first announced to us (in microseconds). Protected by cs_main. */
+limitedmap<uint256, int64_t> mapBlockFirstAnnounced(BLOCK_ANNOUNCE_HISTORY);
+
+/** Number of new blocks announced to us so far. Protected by cs_main. */
+int nBlocksAnnounced = 0;
+
+/** Peer to disconnect on its next SendMessages to make room for a better outbound peer, or -1. Protected by cs_main. */
+NodeId nOutboundToEvict = -1;
+int64_t nNextOutboundEvictionCheck = 0;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -233,8 +248,34 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! Smoothed time between block deliveries while blocks were in flight (in microseconds), or 0 if unknown.
+    int64_t nBlockInterval;
+    //! When the last requested block was delivered (in microseconds), or 0.
+    int64_t nLastBlockReceived;
+    //! Number of times this peer stalled block download and had its blocks reassigned.
+    int nStallReassigned;
+    //! Until when no new blocks are requested from this peer after a stall (in microseconds), or 0.
+    int64_t nDownloadBackoffUntil;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Compact block from this peer waiting for the blocktxn answering our getblocktxn.
+    PartiallyDownloadedBlock partialBlock;
+    //! When the connection was made (in seconds), and nBlocksAnnounced at that time.
+    int64_t nTimeConnected;
+    int nBlocksAnnouncedAtConnect;
+    //! New blocks this peer announced to us, and how many of those it was first to announce.
+    int nBlockAnnouncements;
+    int nBlocksFirst;
+    //! Smoothed delay of its announcements after the first one (in microseconds), or -1 if unknown.
+    int64_t nBlockAnnounceDelay;
+    //! When this peer last announced a new block (in seconds), or 0.
+    int64_t nLastBlockAnnouncement;
+    //! Blocks it announced before we had their header, with when (in microseconds); counted once the header is accepted.
+    std::map<uint256, int64_t> mapUnconfirmedAnnouncements;
+    //! Smoothed rate at which requested blocks arrive from this peer (bytes per second), or 0 if unknown.
+    int64_t nBlockThroughput;
+    //! Whether this peer is an automatic outbound connection that may be replaced.
+    bool fEvictable;
 
     CNodeState()
     {
@@ -247,7 +288,19 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlockInterval = 0;
+        nLastBlockReceived = 0;
+        nStallReassigned = 0;
+        nDownloadBackoffUntil = 0;
         fPreferredDownload = false;
+        nTimeConnected = 0;
+        nBlocksAnnouncedAtConnect = 0;
+        nBlockAnnouncements = 0;
+        nBlocksFirst = 0;
+        nBlockAnnounceDelay = -1;
+        nLastBlockAnnouncement = 0;
+        nBlockThroughput = 0;
+        fEvictable = false;
     }
 };
 
@@ -291,6 +344,8 @@ void InitializeNode(NodeId nodeid, const CNode* pnode)
     CNodeState& state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
     state.name = pnode->addrName;
     state.address = pnode->addr;
+    state.nTimeConnected = pnode->nTimeConnected;
+    state.nBlocksAnnouncedAtConnect = nBlocksAnnounced;
 }
 
 void FinalizeNode(NodeId nodeid)
@@ -314,19 +369,45 @@ void FinalizeNode(NodeId nodeid)
 }
 
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+void EraseBlockInFlight(map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight)
+{
+    CNodeState* state = State(itInFlight->second.first);
+    nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
+    state->vBlocksInFlight.erase(itInFlight->second.second);
+    state->nBlocksInFlight--;
+    state->nStallingSince = 0;
+    mapBlocksInFlight.erase(itInFlight);
+}
+
+// Requires cs_main.
+void MarkBlockAsReceived(const uint256& hash, const CBlock* pblock = NULL)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
+        // Track how fast the peer delivers: the time since its previous delivery, or since the request if
+        // the peer was idle in between.
         CNodeState* state = State(itInFlight->second.first);
-        nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->vBlocksInFlight.erase(itInFlight->second.second);
-        state->nBlocksInFlight--;
-        state->nStallingSince = 0;
-        mapBlocksInFlight.erase(itInFlight);
+        int64_t nNow = GetTimeMicros();
+        int64_t nInterval = nNow - std::max(state->nLastBlockReceived, itInFlight->second.second->nTime);
+        state->nBlockInterval = state->nBlockInterval ? (state->nBlockInterval * 7 + nInterval) / 8 : nInterval;
+        state->nLastBlockReceived = nNow;
+        if (pblock && nInterval > 0) {
+            int64_t nThroughput = (int64_t)::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION) * 1000000 / nInterval;
+            state->nBlockThroughput = state->nBlockThroughput ? (state->nBlockThroughput * 7 + nThroughput) / 8 : nThroughput;
+        }
+        EraseBlockInFlight(itInFlight);
     }
 }
 
+/** Number of blocks to keep in flight from a peer, enough for BLOCK_DOWNLOAD_TARGET_TIME at its delivery rate. */
+int GetBlocksInFlightTarget(const CNodeState* state)
+{
+    if (state->nBlockInterval <= 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nTarget = 1000000 * (int64_t)BLOCK_DOWNLOAD_TARGET_TIME / state->nBlockInterval;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER, nTarget));
+}
+
 // Requires cs_main.
 void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
 {
@@ -334,7 +415,9 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     assert(state != NULL);
 
     // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end())
+        EraseBlockInFlight(itInFlight);
 
     QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
@@ -343,6 +426,107 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main.
+/** Time an announcement of a block with an accepted header, made at nTime (in microseconds), against the first
+ *  announcement of it we got. Blocks we already had before anyone announced them are not counted. */
+void static CreditBlockAnnouncement(CNodeState* state, const uint256& hash, int64_t nTime)
+{
+    int64_t nDelay = 0;
+    limitedmap<uint256, int64_t>::const_iterator it = mapBlockFirstAnnounced.find(hash);
+    if (it != mapBlockFirstAnnounced.end()) {
+        nDelay = std::max((int64_t)0, std::min(nTime - it->second, (int64_t)BLOCK_ANNOUNCE_DELAY_MAX * 1000000));
+    } else {
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+            return;
+        mapBlockFirstAnnounced.insert(std::make_pair(hash, nTime));
+        nBlocksAnnounced++;
+        state->nBlocksFirst++;
+    }
+    state->nBlockAnnouncements++;
+    state->nBlockAnnounceDelay = state->nBlockAnnounceDelay >= 0 ? (state->nBlockAnnounceDelay * 7 + nDelay) / 8 : nDelay;
+    state->nLastBlockAnnouncement = std::max(state->nLastBlockAnnouncement, nTime / 1000000);
+}
+
+// Requires cs_main.
+/** Note a peer's announcement of a block. Announcements during initial block download are not counted, and
+ *  those of blocks whose header we don't have wait in the peer's state until AcceptBlockHeader accepts it, so
+ *  made-up hashes earn nothing. */
+void RecordBlockAnnouncement(NodeId nodeid, const uint256& hash)
+{
+    CNodeState* state = State(nodeid);
+    assert(state != NULL);
+    if (IsInitialBlockDownload())
+        return;
+
+    int64_t nNow = GetTimeMicros();
+    if (mapBlockIndex.count(hash)) {
+        CreditBlockAnnouncement(state, hash, nNow);
+        return;
+    }
+
+    std::map<uint256, int64_t>& mapUnconfirmed = state->mapUnconfirmedAnnouncements;
+    if (mapUnconfirmed.count(hash))
+        return;
+    if (mapUnconfirmed.size() >= MAX_UNCONFIRMED_ANNOUNCEMENTS) {
+        std::map<uint256, int64_t>::iterator itOldest = mapUnconfirmed.begin();
+        for (std::map<uint256, int64_t>::iterator it = mapUnconfirmed.begin(); it != mapUnconfirmed.end(); ++it) {
+            if (it->second < itOldest->second)
+                itOldest = it;
+        }
+        mapUnconfirmed.erase(itOldest);
+    }
+    mapUnconfirmed.insert(std::make_pair(hash, nNow));
+}
+
+// Requires cs_main.
+/** Count the announcements peers made of a block before its header was accepted, earliest first. */
+void static ConfirmBlockAnnouncements(const uint256& hash)
+{
+    vector<pair<int64_t, NodeId> > vAnnounced;
+    for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it) {
+        std::map<uint256, int64_t>::iterator mi = it->second.mapUnconfirmedAnnouncements.find(hash);
+        if (mi != it->second.mapUnconfirmedAnnouncements.end()) {
+            vAnnounced.push_back(std::make_pair(mi->second, it->first));
+            it->second.mapUnconfirmedAnnouncements.erase(mi);
+        }
+    }
+    sort(vAnnounced.begin(), vAnnounced.end());
+    for (unsigned int i = 0; i < vAnnounced.size(); i++)
+        CreditBlockAnnouncement(&mapNodeState[vAnnounced[i].second], hash, vAnnounced[i].first);
+}
+
+// Requires cs_main.
+/** Pick the automatic outbound peer to replace: one that stopped announcing new blocks, or else the one with
+ *  the latest announcements if it is well behind the others. Returns -1 if no peer deserves replacing. */
+NodeId SelectOutboundPeerToEvict()
+{
+    int64_t nNow = GetTime();
+    vector<pair<int64_t, NodeId> > vCandidates;
+    for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it) {
+        const CNodeState& state = it->second;
+        if (!state.fEvictable || nNow - state.nTimeConnected < OUTBOUND_EVICTION_MIN_CONNECT_TIME)
+            continue;
+        if (nBlocksAnnounced - state.nBlocksAnnouncedAtConnect < OUTBOUND_EVICTION_MIN_BLOCKS)
+            continue;
+        // Silent for as long as the minimum connection time while new blocks kept coming: rank last
+        bool fStale = nNow - std::max(state.nLastBlockAnnouncement, state.nTimeConnected) > OUTBOUND_EVICTION_MIN_CONNECT_TIME;
+        int64_t nScore = fStale || state.nBlockAnnounceDelay < 0 ? std::numeric_limits<int64_t>::max() : state.nBlockAnnounceDelay;
+        vCandidates.push_back(std::make_pair(nScore, it->first));
+    }
+    // Keep a few peers to compare against
+    if (vCandidates.size() < 4)
+        return -1;
+    sort(vCandidates.begin(), vCandidates.end());
+    const pair<int64_t, NodeId>& worst = vCandidates.back();
+    int64_t nMedian = vCandidates[vCandidates.size() / 2].first;
+    if (worst.first == std::numeric_limits<int64_t>::max())
+        return worst.second;
+    if (worst.first > 1000000 && worst.first > 2 * nMedian)
+        return worst.second;
+    return -1;
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -493,6 +677,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nBlockAnnouncements = state->nBlockAnnouncements;
+    stats.nBlocksFirst = state->nBlocksFirst;
+    stats.nBlockAnnounceDelay = state->nBlockAnnounceDelay;
+    stats.nBlockThroughput = state->nBlockThroughput;
     BOOST_FOREACH (const QueuedBlock& queue, state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -533,6 +721,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
 CSporkDB* pSporkDB = NULL;
@@ -840,10 +1029,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()) {
-            sigs = (*i).second.CountSignatures();
-        }
+        sigs = txLockManager.GetSignatures(nTXHash);
         if (sigs >= LPCTX_SIGNATURES_REQUIRED) {
             return nLPCtxDepth + nResult;
         }
@@ -854,12 +1040,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 
 int GetIXConfirmations(uint256 nTXHash)
 {
-    int sigs = 0;
-
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()) {
-        sigs = (*i).second.CountSignatures();
-    }
+    int sigs = txLockManager.GetSignatures(nTXHash);
     if (sigs >= LPCTX_SIGNATURES_REQUIRED) {
         return nLPCtxDepth;
     }
@@ -1576,8 +1757,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     // ----------- LPCtx transaction scanning -----------
 
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+        uint256 hashLock;
+        if (txLockManager.GetLockedInput(in.prevout, hashLock)) {
+            if (hashLock != tx.GetHash()) {
                 return state.DoS(0,
                     error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
                     REJECT_INVALID, "tx-lock-conflict");
@@ -1801,8 +1983,9 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     // ----------- LPCtx transaction scanning -----------
 
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+        uint256 hashLock;
+        if (txLockManager.GetLockedInput(in.prevout, hashLock)) {
+            if (hashLock != tx.GetHash()) {
                 return state.DoS(0,
                     error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
                     REJECT_INVALID, "tx-lock-conflict");
@@ -2498,6 +2681,34 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
 }
 
+namespace
+{
+/** Penalties from threads that don't hold cs_main, applied by SendMessages. */
+CCriticalSection cs_vQueuedMisbehavior;
+std::vector<std::pair<NodeId, int> > vQueuedMisbehavior;
+} // anon namespace
+
+void QueueMisbehaving(NodeId nodeid, int howmuch)
+{
+    if (howmuch == 0)
+        return;
+
+    LOCK(cs_vQueuedMisbehavior);
+    vQueuedMisbehavior.push_back(std::make_pair(nodeid, howmuch));
+}
+
+// Requires cs_main.
+void static ApplyQueuedMisbehavior()
+{
+    std::vector<std::pair<NodeId, int> > vQueued;
+    {
+        LOCK(cs_vQueuedMisbehavior);
+        vQueued.swap(vQueuedMisbehavior);
+    }
+    for (unsigned int i = 0; i < vQueued.size(); i++)
+        Misbehaving(vQueued[i].first, vQueued[i].second);
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (!pindexBestInvalid || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
@@ -2830,7 +3041,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, const CBlockUndo* pblockUndo, CZerocoinEraseBatch* pzcErase)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
         LogPrintf("%s : pindex=%s view=%s\n", __func__, pindex->GetBlockHash().GetHex(), view.GetBestBlock().GetHex());
@@ -2841,12 +3052,19 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    CBlockUndo blockUndoRead;
+    if (pblockUndo == NULL) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        if (!blockUndoRead.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+        pblockUndo = &blockUndoRead;
+    }
+    const CBlockUndo& blockUndo = *pblockUndo;
+
+    CZerocoinEraseBatch zcEraseLocal;
+    CZerocoinEraseBatch& zcErase = pzcErase ? *pzcErase : zcEraseLocal;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
@@ -2865,8 +3083,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 for (const CTxIn txin : tx.vin) {
                     if (txin.scriptSig.IsZerocoinSpend()) {
                         CoinSpend spend = TxInToZerocoinSpend(txin);
-                        if (!zerocoinDB->EraseCoinSpend(spend.getCoinSerialNumber()))
-                            return error("failed to erase spent zerocoin in block");
+                        zcErase.vSerials.push_back(spend.getCoinSerialNumber());
                     }
                 }
             }
@@ -2880,8 +3097,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                     if (!TxOutToPublicCoin(txout, pubCoin, state))
                         return error("DisconnectBlock(): TxOutToPublicCoin() failed");
 
-                    if(!zerocoinDB->EraseCoinMint(pubCoin.getValue()))
-                        return error("DisconnectBlock(): Failed to erase coin mint");
+                    zcErase.vMints.push_back(pubCoin.getValue());
                 }
             }
         }
@@ -2943,11 +3159,16 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (pzcErase == NULL && !zerocoinDB->EraseCoins(zcErase.vMints, zcErase.vSerials))
+        return error("DisconnectBlock(): failed to erase zerocoin mints and spends");
+
     if (!fVerifyingBlocks) {
         //if block is an accumulator checkpoint block, remove checkpoint and checksums from db
         uint256 nCheckpoint = pindex->nAccumulatorCheckpoint;
         if(nCheckpoint != pindex->pprev->nAccumulatorCheckpoint) {
-            if(!EraseAccumulatorValues(nCheckpoint, pindex->pprev->nAccumulatorCheckpoint))
+            if (pzcErase != NULL)
+                pzcErase->vCheckpoints.push_back(std::make_pair(nCheckpoint, pindex->pprev->nAccumulatorCheckpoint));
+            else if(!EraseAccumulatorValues(nCheckpoint, pindex->pprev->nAccumulatorCheckpoint))
                 return error("DisconnectBlock(): failed to erase checkpoint");
         }
     }
@@ -3514,7 +3735,7 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     static int64_t nLastWrite = 0;
     try {
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -3545,8 +3766,14 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
+            // With -asyncflush this only hands the dirty entries to the coin database's
+            // writer thread; the commit itself happens after cs_main is released.
+            int64_t nFlushStart = GetTimeMicros();
+            unsigned int nFlushSize = pcoinsTip->GetCacheSize();
+            size_t nFlushUsage = pcoinsTip->DynamicMemoryUsage();
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
+            LogPrint("bench", "    - Flush chainstate: %u entries (%.1fMiB), %.2fms under cs_main\n", nFlushSize, nFlushUsage * (1.0 / (1 << 20)), (GetTimeMicros() - nFlushStart) * 0.001);
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -3563,6 +3790,9 @@ void FlushStateToDisk()
 {
     CValidationState state;
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+    // Callers of this variant (shutdown, gettxoutsetinfo) expect the chainstate to be on disk
+    if (pcoinsdbview && !pcoinsdbview->WaitForFlush())
+        AbortNode("Failed to write to coin database");
 }
 
 /** Update chainActive and related internal data structures. */
@@ -3578,10 +3808,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu timestamp=%d date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu timestamp=%d date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         chainActive.Tip()->GetBlockTime(), DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3606,48 +3836,131 @@ void static UpdateTip(CBlockIndex* pindexNew)
     }
 }
 
-/** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState& state)
-{
-    CBlockIndex* pindexDelete = chainActive.Tip();
-    assert(pindexDelete);
-    mempool.check(pcoinsTip);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete))
-        return state.Abort("Failed to read block");
-    // Apply the block atomically to the chain state.
-    int64_t nStart = GetTimeMicros();
-    {
-        CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
-            return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
-        assert(view.Flush());
-    }
-    LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
-    // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
-        return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
+enum DisconnectReadResult {
+    DISCONNECT_READ_OK,
+    DISCONNECT_READ_NO_BLOCK,
+    DISCONNECT_READ_NO_UNDO,
+    DISCONNECT_READ_BAD_UNDO,
+};
+
+/** Read the block and undo data of every nStride'th entry of vpindex, starting at nFirst. */
+static void ReadDisconnectRange(const std::vector<CBlockIndex*>& vpindex, std::vector<CBlock>& vblock, std::vector<CBlockUndo>& vundo, std::vector<int>& vresult, size_t nFirst, size_t nStride)
+{
+    for (size_t i = nFirst; i < vpindex.size(); i += nStride) {
+        const CBlockIndex* pindex = vpindex[i];
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (!ReadBlockFromDisk(vblock[i], pindex))
+            vresult[i] = DISCONNECT_READ_NO_BLOCK;
+        else if (pos.IsNull())
+            vresult[i] = DISCONNECT_READ_NO_UNDO;
+        else if (!vundo[i].ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            vresult[i] = DISCONNECT_READ_BAD_UNDO;
+        else
+            vresult[i] = DISCONNECT_READ_OK;
     }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
-    mempool.check(pcoinsTip);
-    // Update chainActive and related variables.
-    UpdateTip(pindexDelete->pprev);
-    // Let wallets know transactions went from 1-confirmed to
-    // 0-confirmed or conflicted:
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
+}
+
+/** Read the block and undo data for a batch of blocks to disconnect, in parallel. */
+static void ReadDisconnectData(const std::vector<CBlockIndex*>& vpindex, std::vector<CBlock>& vblock, std::vector<CBlockUndo>& vundo, std::vector<int>& vresult)
+{
+    vblock.resize(vpindex.size());
+    vundo.resize(vpindex.size());
+    vresult.assign(vpindex.size(), DISCONNECT_READ_OK);
+
+    size_t nThreads = std::min((size_t)DISCONNECT_READ_THREADS, vpindex.size());
+    boost::thread_group threadGroup;
+    for (size_t i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ReadDisconnectRange, boost::cref(vpindex), boost::ref(vblock), boost::ref(vundo), boost::ref(vresult), i, nThreads));
+    ReadDisconnectRange(vpindex, vblock, vundo, vresult, 0, std::max(nThreads, (size_t)1));
+    threadGroup.join_all();
+}
+
+/** Disconnect chainActive's tip blocks until pindexFork is the tip. Up to MAX_DISCONNECT_BATCH blocks at a
+ *  time have their block and undo data read ahead in parallel, are disconnected against a single coins
+ *  cache and have their zerocoin index entries erased in one batch, followed by a single state flush.
+ *
+ *  Each batch is all or nothing: if a block in it cannot be read or disconnected, the batch's coins cache
+ *  is discarded before the zerocoin index, the accumulator checkpoints or chainActive are touched, and the
+ *  function returns false with the tip still at the first block of the batch. Batches that completed
+ *  before it stay disconnected. */
+bool static DisconnectTips(CValidationState& state, const CBlockIndex* pindexFork)
+{
+    AssertLockHeld(cs_main);
+    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
+        std::vector<CBlockIndex*> vpindexDelete;
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex != pindexFork && vpindexDelete.size() < (size_t)MAX_DISCONNECT_BATCH; pindex = pindex->pprev)
+            vpindexDelete.push_back(pindex);
+        mempool.check(pcoinsTip);
+        // Read blocks and undo data from disk.
+        int64_t nStart = GetTimeMicros();
+        std::vector<CBlock> vblock;
+        std::vector<CBlockUndo> vundo;
+        std::vector<int> vresult;
+        ReadDisconnectData(vpindexDelete, vblock, vundo, vresult);
+        for (size_t i = 0; i < vpindexDelete.size(); i++) {
+            if (vresult[i] == DISCONNECT_READ_NO_BLOCK)
+                return state.Abort("Failed to read block");
+            if (vresult[i] == DISCONNECT_READ_NO_UNDO)
+                return error("DisconnectTip() : no undo data available for %s", vpindexDelete[i]->GetBlockHash().ToString());
+            if (vresult[i] == DISCONNECT_READ_BAD_UNDO)
+                return error("DisconnectTip() : failure reading undo data for %s", vpindexDelete[i]->GetBlockHash().ToString());
+        }
+        int64_t nRead = GetTimeMicros();
+        // Apply the blocks atomically to the chain state.
+        {
+            CCoinsViewCache view(pcoinsTip);
+            CZerocoinEraseBatch zcErase;
+            for (size_t i = 0; i < vpindexDelete.size(); i++) {
+                if (!DisconnectBlock(vblock[i], state, vpindexDelete[i], view, NULL, &vundo[i], &zcErase))
+                    return error("DisconnectTip() : DisconnectBlock %s failed", vpindexDelete[i]->GetBlockHash().ToString());
+            }
+            if (!zerocoinDB->EraseCoins(zcErase.vMints, zcErase.vSerials))
+                return state.Abort("Failed to erase zerocoin mints and spends");
+            assert(view.Flush());
+            // Checkpoints go only once the rest of the batch is in, tip block first as DisconnectBlock would
+            for (size_t i = 0; i < zcErase.vCheckpoints.size(); i++) {
+                if (!EraseAccumulatorValues(zcErase.vCheckpoints[i].first, zcErase.vCheckpoints[i].second))
+                    return state.Abort("Failed to erase accumulator checkpoint");
+            }
+        }
+        LogPrint("bench", "- Disconnect %u blocks: %.2fms (read %.2fms)\n", vpindexDelete.size(), (GetTimeMicros() - nStart) * 0.001, (nRead - nStart) * 0.001);
+        // Write the chain state to disk, if necessary.
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return false;
+        // Update chainActive and related variables.
+        for (size_t i = 0; i < vpindexDelete.size(); i++)
+            UpdateTip(vpindexDelete[i]->pprev);
+        // Resurrect mempool transactions from the disconnected blocks, oldest block first so that
+        // transactions spending outputs of a later disconnected block find their inputs in the mempool.
+        for (size_t i = vpindexDelete.size(); i-- > 0;) {
+            BOOST_FOREACH (const CTransaction& tx, vblock[i].vtx) {
+                // ignore validation errors in resurrected transactions
+                list<CTransaction> removed;
+                CValidationState stateDummy;
+                if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+                    mempool.remove(tx, removed, true);
+            }
+        }
+        mempool.removeCoinbaseSpends(pcoinsTip, vpindexDelete.back()->nHeight);
+        mempool.check(pcoinsTip);
+        // Let wallets know transactions went from 1-confirmed to
+        // 0-confirmed or conflicted:
+        for (size_t i = 0; i < vpindexDelete.size(); i++) {
+            BOOST_FOREACH (const CTransaction& tx, vblock[i].vtx) {
+                SyncWithWallets(tx, NULL);
+            }
+        }
     }
     return true;
 }
 
+/** Disconnect chainActive's tip. */
+bool static DisconnectTip(CValidationState& state)
+{
+    assert(chainActive.Tip());
+    return DisconnectTips(state, chainActive.Tip()->pprev);
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -3740,8 +4053,7 @@ bool DisconnectBlocksAndReprocess(int blocks)
     CValidationState state;
 
     LogPrintf("DisconnectBlocksAndReprocess: Got command to replay %d blocks\n", blocks);
-    for (int i = 0; i <= blocks; i++)
-        DisconnectTip(state);
+    DisconnectTips(state, chainActive[std::max(0, chainActive.Height() - blocks - 1)]);
 
     return true;
 }
@@ -3903,10 +4215,8 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     const CBlockIndex* pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
-    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
-            return false;
-    }
+    if (!DisconnectTips(state, pindexFork))
+        return false;
 
     // Build list of new blocks to connect.
     std::vector<CBlockIndex*> vpindexToConnect;
@@ -4000,11 +4310,32 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            // Peers supporting compact blocks get the block itself right away, serialized once for all of them
+            CSharedMessage msgCmpctBlock;
+            if ((nLocalServices & NODE_COMPACT_BLOCKS) && pblock && pblock->GetHash() == hashNewTip) {
+                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                ss << CBlockHeaderAndShortTxIDs(*pblock);
+                msgCmpctBlock = MakeSharedMessage("cmpctblock", ss);
+            }
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                CInv inv(MSG_BLOCK, hashNewTip);
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (msgCmpctBlock && (pnode->nServices & NODE_COMPACT_BLOCKS) && pnode->fSuccessfullyConnected) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->filterInventoryKnown.contains(inv);
+                            pnode->filterInventoryKnown.insert(inv);
+                        }
+                        if (!fKnown)
+                            pnode->PushSharedMessage(msgCmpctBlock);
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -4037,14 +4368,15 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex* pindex)
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
-    while (chainActive.Contains(pindex)) {
-        CBlockIndex* pindexWalk = chainActive.Tip();
-        pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
-        setDirtyBlockIndex.insert(pindexWalk);
-        setBlockIndexCandidates.erase(pindexWalk);
+    if (chainActive.Contains(pindex)) {
+        for (CBlockIndex* pindexWalk = chainActive.Tip(); pindexWalk != pindex->pprev; pindexWalk = pindexWalk->pprev) {
+            pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
+            setDirtyBlockIndex.insert(pindexWalk);
+            setBlockIndexCandidates.erase(pindexWalk);
+        }
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTips(state, pindex->pprev)) {
             return false;
         }
     }
@@ -4384,10 +4716,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
                 BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+                    uint256 hashLock;
+                    if (txLockManager.GetLockedInput(in.prevout, hashLock)) {
+                        if (hashLock != tx.GetHash()) {
                             mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
+                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLock.ToString(), tx.GetHash().ToString());
                             return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
                                 REJECT_INVALID, "conflicting-tx-ix");
                         }
@@ -4642,8 +4975,10 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
-    if (pindex == NULL)
+    if (pindex == NULL) {
         pindex = AddToBlockIndex(block);
+        ConfirmBlockAnnouncements(hash);
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -4783,11 +5118,11 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp, bool fPrechecked)
 {
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
-    bool checked = CheckBlock(*pblock, state);
+    bool checked = CheckBlock(*pblock, state, true, !fPrechecked);
 
     int nMints = 0;
     int nSpends = 0;
@@ -4813,7 +5148,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     //    return error("ProcessNewBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, pblock->GetHash().ToString().c_str());
 
     // NovaCoin: check proof-of-stake block signature
-    if (!pblock->CheckBlockSignature())
+    if (!fPrechecked && !pblock->CheckBlockSignature())
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
@@ -4828,7 +5163,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     {
         LOCK(cs_main);   // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
-        MarkBlockAsReceived (pblock->GetHash ());
+        MarkBlockAsReceived(pblock->GetHash(), pblock);
         if (!checked) {
             return error ("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
         }
@@ -4847,6 +5182,13 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!ActivateBestChain(state, pblock, checked))
         return error("%s : ActivateBestChain failed", __func__);
 
+    if (pfrom) {
+        // Remember who gave us a block that moved our tip, for the inbound eviction logic in net.cpp
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == pblock->GetHash())
+            pfrom->nLastBlockTime = GetTime();
+    }
+
     if (!fLiteMode) {
         if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
             obfuScationPool.NewBlock();
@@ -4871,6 +5213,156 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     return true;
 }
 
+bool PrecheckBlock(const CBlock& block, CValidationState& state)
+{
+    // The header and proof of work are left to CheckBlock, which runs them either way
+    bool mutated;
+    uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+    if (block.hashMerkleRoot != hashMerkleRoot2)
+        return state.DoS(100, error("PrecheckBlock() : hashMerkleRoot mismatch"),
+            REJECT_INVALID, "bad-txnmrklroot", true);
+    if (mutated)
+        return state.DoS(100, error("PrecheckBlock() : duplicate transaction"),
+            REJECT_INVALID, "bad-txns-duplicate", true);
+
+    if (!block.CheckBlockSignature())
+        return error("PrecheckBlock() : bad proof-of-stake block signature");
+
+    return true;
+}
+
+namespace
+{
+/** A block received from the network, pre-validated by ThreadBlockCheck and connected by ThreadBlockProcess. */
+struct CPendingBlock {
+    CBlock block;
+    uint256 hash;
+    CNode* pfrom;
+    bool fChecked;
+    bool fValid;
+    CValidationState state;
+};
+
+/** Protects the pending block queues below. */
+CWaitableCriticalSection csPendingBlocks;
+CConditionVariable condPendingBlocks;
+/** All pending blocks in arrival order, which is the order they are connected in. */
+std::deque<CPendingBlock*> dequePendingBlocks;
+/** Pending blocks not yet picked up by a pre-validation thread. */
+std::deque<CPendingBlock*> dequeBlocksToCheck;
+set<uint256> setPendingBlocks;
+} // anon namespace
+
+void QueueBlockForProcessing(CNode* pfrom, const CBlock& block)
+{
+    CPendingBlock* pending = new CPendingBlock();
+    pending->block = block;
+    pending->hash = block.GetHash();
+    pending->pfrom = pfrom->AddRef();
+    pending->fChecked = false;
+    pending->fValid = false;
+
+    boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+    // Apply back pressure to the message handler while the connecting thread is behind.
+    while (dequePendingBlocks.size() >= MAX_BLOCKS_PENDING_CHECK)
+        condPendingBlocks.wait(lock);
+    if (!setPendingBlocks.insert(pending->hash).second) {
+        pending->pfrom->Release();
+        delete pending;
+        return;
+    }
+    dequePendingBlocks.push_back(pending);
+    dequeBlocksToCheck.push_back(pending);
+    condPendingBlocks.notify_all();
+}
+
+bool IsBlockPending(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+    return setPendingBlocks.count(hash);
+}
+
+void ClearPendingBlocks()
+{
+    boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+    // dequeBlocksToCheck only holds blocks that are in dequePendingBlocks as well
+    BOOST_FOREACH (CPendingBlock* pending, dequePendingBlocks) {
+        pending->pfrom->Release();
+        delete pending;
+    }
+    dequePendingBlocks.clear();
+    dequeBlocksToCheck.clear();
+    setPendingBlocks.clear();
+    condPendingBlocks.notify_all();
+}
+
+void ThreadBlockCheck()
+{
+    RenameThread("lapo-blockchk");
+    while (true) {
+        CPendingBlock* pending;
+        {
+            boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+            while (dequeBlocksToCheck.empty())
+                condPendingBlocks.wait(lock);
+            pending = dequeBlocksToCheck.front();
+            dequeBlocksToCheck.pop_front();
+        }
+        bool fValid = PrecheckBlock(pending->block, pending->state);
+        {
+            boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+            pending->fValid = fValid;
+            pending->fChecked = true;
+            condPendingBlocks.notify_all();
+        }
+    }
+}
+
+void ThreadBlockProcess()
+{
+    RenameThread("lapo-blockproc");
+    while (true) {
+        CPendingBlock* pending;
+        {
+            boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+            while (dequePendingBlocks.empty() || !dequePendingBlocks.front()->fChecked)
+                condPendingBlocks.wait(lock);
+            pending = dequePendingBlocks.front();
+        }
+
+        CNode* pfrom = pending->pfrom;
+        CValidationState& state = pending->state;
+        if (pending->fValid) {
+            ProcessNewBlock(state, pfrom, &pending->block, NULL, true);
+        } else {
+            LOCK(cs_main);
+            MarkBlockAsReceived(pending->hash);
+        }
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), pending->hash);
+            if (nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+
+        {
+            // Only forget the block once it is in mapBlockIndex (or rejected), so its children are not
+            // mistaken for orphans in between.
+            boost::unique_lock<boost::mutex> lock(csPendingBlocks);
+            dequePendingBlocks.pop_front();
+            setPendingBlocks.erase(pending->hash);
+            condPendingBlocks.notify_all();
+        }
+        pfrom->Release();
+        delete pending;
+    }
+}
+
 bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     AssertLockHeld(cs_main);
@@ -5137,7 +5629,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -5532,8 +6024,35 @@ string GetWarnings(string strFor)
 //
 
 
+/** The lock held by the message workers while they add masternode-layer inventory of this type, if any. */
+static CCriticalSection* MasternodeInventoryLock(int type)
+{
+    switch (type) {
+    case MSG_SPORK:
+        return &cs_mapSporks;
+    case MSG_MASTERNODE_WINNER:
+        return &masternodePayments.cs_process_message;
+    case MSG_BUDGET_VOTE:
+    case MSG_BUDGET_PROPOSAL:
+    case MSG_BUDGET_FINALIZED_VOTE:
+    case MSG_BUDGET_FINALIZED:
+        return &cs_budget;
+    case MSG_MASTERNODE_ANNOUNCE:
+    case MSG_MASTERNODE_PING:
+        return &mnodeman.cs_process_message;
+    }
+    return NULL;
+}
+
 bool static AlreadyHave(const CInv& inv)
 {
+    // Don't wait for a message worker busy with this kind of inventory; asking for the item
+    // again is harmless, the duplicate is recognised when it arrives.
+    CCriticalSection* pcsInv = MasternodeInventoryLock(inv.type);
+    TRY_LOCK(pcsInv, lockInv);
+    if (pcsInv && !lockInv)
+        return false;
+
     switch (inv.type) {
     case MSG_TX: {
         bool txInMap = false;
@@ -5544,12 +6063,11 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash);
+        return mapBlockIndex.count(inv.hash) || IsBlockPending(inv.hash);
     case MSG_TXLOCK_REQUEST:
-        return mapTxLockReq.count(inv.hash) ||
-               mapTxLockReqRejected.count(inv.hash);
+        return txLockManager.HaveRequest(inv.hash);
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        return txLockManager.HaveVote(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -5604,6 +6122,7 @@ void static ProcessGetData(CNode* pfrom)
 
     LOCK(cs_main);
 
+    pfrom->fGetDataDeferred = false;
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -5611,6 +6130,14 @@ void static ProcessGetData(CNode* pfrom)
 
         const CInv& inv = *it;
         {
+            // Leave the rest for the next round rather than block cs_main behind a message worker
+            CCriticalSection* pcsInv = MasternodeInventoryLock(inv.type);
+            TRY_LOCK(pcsInv, lockInv);
+            if (pcsInv && !lockInv) {
+                pfrom->fGetDataDeferred = true;
+                break;
+            }
+
             boost::this_thread::interruption_point();
             it++;
 
@@ -5631,6 +6158,16 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // disconnect node in case we have reached the outbound limit for serving historical blocks
+                // never disconnect whitelisted nodes
+                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                if (send && CNode::OutboundTargetReached(true) && (((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                    //disconnect node
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
                     // Send block from disk
@@ -5653,7 +6190,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5672,15 +6209,18 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
             } else if (inv.IsKnownType()) {
-                // Send stream from relay memory
+                // Send the message from relay memory, shared with all other peers it goes to
                 bool pushed = false;
+                CSharedMessage msgRelay;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end())
+                        msgRelay = (*mi).second;
+                }
+                if (msgRelay) {
+                    pfrom->PushSharedMessage(msgRelay);
+                    pushed = true;
                 }
 
                 if (!pushed && inv.type == MSG_TX) {
@@ -5694,19 +6234,21 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if (mapTxLockVote.count(inv.hash)) {
+                    CConsensusVote vote;
+                    if (txLockManager.GetVote(inv.hash, vote)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
+                        ss << vote;
                         pfrom->PushMessage("txlvote", ss);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if (mapTxLockReq.count(inv.hash)) {
+                    CTransaction tx;
+                    if (txLockManager.GetRequest(inv.hash, tx)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
+                        ss << tx;
                         pfrom->PushMessage("ix", ss);
                         pushed = true;
                     }
@@ -5829,6 +6371,238 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/** Pass a message on to the masternode, budget, spork, SwiftX and obfuscation handlers. */
+void static ProcessExtensionMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv)
+{
+    obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    budget.ProcessMessage(pfrom, strCommand, vRecv);
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    ProcessMessageLPCtx(pfrom, strCommand, vRecv);
+    ProcessSpork(pfrom, strCommand, vRecv);
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
+/**
+ * Messages whose handlers lock the state they touch themselves and need cs_main at most briefly, so they
+ * can run on the message workers. Their handlers penalise peers through QueueMisbehaving. SwiftX lock requests and obfuscation messages accept transactions into
+ * the mempool, and SwiftX votes may reprocess recent blocks, so they stay on the validation thread.
+ */
+static const char* const WORKER_COMMANDS[] = {
+    "mnb", "mnp", "dseg", "dsegsum", "dsee", "dseep", "mnget", "mngetsum", "mnw", "ssc",
+    "mnvs", "mnvssum", "mprop", "mvote", "fbs", "fbvote", "spork", "getsporks"};
+
+bool static IsWorkerMessage(const string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(WORKER_COMMANDS); i++) {
+        if (strCommand == WORKER_COMMANDS[i])
+            return true;
+    }
+    return false;
+}
+
+/** Worker messages carrying a masternode signature, recovered by the signature check threads before they are handled. */
+bool static IsSignedWorkerMessage(const string& strCommand)
+{
+    return strCommand == "mnb" || strCommand == "mnp" || strCommand == "mnw" || strCommand == "mvote" || strCommand == "fbvote";
+}
+
+/**
+ * Recover the signers of a queued message so its handler only has to compare key ids. Reads a copy of the
+ * payload; anything that does not parse is left for the handler to reject.
+ */
+void static PrecheckMessageSignatures(const string& strCommand, CDataStream vRecv)
+{
+    try {
+        if (strCommand == "mnb") {
+            CMasternodeBroadcast mnb;
+            vRecv >> mnb;
+            obfuScationSigner.PrecheckMessage(mnb.GetStrMessage(), mnb.sig);
+            if (!mnb.lastPing.vchSig.empty())
+                obfuScationSigner.PrecheckMessage(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig);
+        } else if (strCommand == "mnp") {
+            CMasternodePing mnp;
+            vRecv >> mnp;
+            obfuScationSigner.PrecheckMessage(mnp.GetStrMessage(), mnp.vchSig);
+        } else if (strCommand == "mnw") {
+            CMasternodePaymentWinner winner;
+            vRecv >> winner;
+            obfuScationSigner.PrecheckMessage(winner.GetStrMessage(), winner.vchSig);
+        } else if (strCommand == "mvote") {
+            CBudgetVote vote;
+            vRecv >> vote;
+            obfuScationSigner.PrecheckMessage(vote.GetStrMessage(), vote.vchSig);
+        } else if (strCommand == "fbvote") {
+            CFinalizedBudgetVote vote;
+            vRecv >> vote;
+            obfuScationSigner.PrecheckMessage(vote.GetStrMessage(), vote.vchSig);
+        }
+    } catch (const std::exception&) {
+    }
+}
+
+namespace
+{
+/** A message handed from the message handler thread to a message worker. */
+struct CWorkerMessage {
+    CNode* pfrom;
+    string strCommand;
+    CDataStream vRecv;
+    //! Set once the signature check threads are done with the message; workers don't handle it before
+    bool fChecked;
+
+    //! Takes over the data of vRecvIn, which must not have been read from yet, instead of copying it
+    CWorkerMessage(CNode* pfromIn, const string& strCommandIn, CDataStream& vRecvIn) : pfrom(pfromIn), strCommand(strCommandIn), vRecv(vRecvIn.nType, vRecvIn.nVersion), fChecked(true)
+    {
+        CSerializeData data;
+        vRecvIn.SwapBuffer(data);
+        vRecv.SwapBuffer(data);
+    }
+};
+
+/** Protects the worker queues, the signature check queue, CWorkerMessage::fChecked and CNode::nWorkerMessages. */
+CWaitableCriticalSection csWorkerMessages;
+CConditionVariable condWorkerMessages;
+/** One queue per worker. A peer always maps to the same worker, so its messages are handled in order. */
+std::vector<std::deque<CWorkerMessage*> > vWorkerQueues(MAX_MESSAGE_WORKER_THREADS);
+/** Queued signed messages not yet picked up by a signature check thread. */
+std::deque<CWorkerMessage*> dequeSignatureChecks;
+} // anon namespace
+
+void static QueueWorkerMessage(CNode* pfrom, const string& strCommand, CDataStream& vRecv)
+{
+    CWorkerMessage* pmsg = new CWorkerMessage(pfrom->AddRef(), strCommand, vRecv);
+
+    boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+    if (nSignatureCheckThreads && IsSignedWorkerMessage(strCommand)) {
+        pmsg->fChecked = false;
+        dequeSignatureChecks.push_back(pmsg);
+    }
+    vWorkerQueues[pfrom->GetId() % nMessageWorkerThreads].push_back(pmsg);
+    pfrom->nWorkerMessages++;
+    condWorkerMessages.notify_all();
+}
+
+bool static IsWorkerBacklogFull(CNode* pfrom)
+{
+    boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+    return pfrom->nWorkerMessages >= MAX_PEER_WORKER_MESSAGES;
+}
+
+void ThreadSignatureCheck()
+{
+    RenameThread("lapo-sigcheck");
+    while (true) {
+        CWorkerMessage* pmsg;
+        {
+            boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+            while (dequeSignatureChecks.empty())
+                condWorkerMessages.wait(lock);
+            pmsg = dequeSignatureChecks.front();
+            dequeSignatureChecks.pop_front();
+        }
+        // The worker waits for fChecked, so the payload is not read from meanwhile
+        PrecheckMessageSignatures(pmsg->strCommand, pmsg->vRecv);
+        {
+            boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+            pmsg->fChecked = true;
+            condWorkerMessages.notify_all();
+        }
+    }
+}
+
+void ThreadMessageWorker(int nWorker)
+{
+    RenameThread("lapo-msgworker");
+    while (true) {
+        CWorkerMessage* pmsg;
+        {
+            boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+            // Signatures are checked in parallel across the queues, the messages themselves are handled in arrival order
+            while (vWorkerQueues[nWorker].empty() || !vWorkerQueues[nWorker].front()->fChecked)
+                condWorkerMessages.wait(lock);
+            pmsg = vWorkerQueues[nWorker].front();
+            vWorkerQueues[nWorker].pop_front();
+        }
+
+        CNode* pfrom = pmsg->pfrom;
+        if (!pfrom->fDisconnect) {
+            try {
+                ProcessExtensionMessage(pfrom, pmsg->strCommand, pmsg->vRecv);
+            } catch (std::ios_base::failure& e) {
+                pfrom->PushMessage("reject", pmsg->strCommand, REJECT_MALFORMED, string("error parsing message"));
+                LogPrintf("ThreadMessageWorker(%s, %u bytes): Exception '%s' caught\n", SanitizeString(pmsg->strCommand), pmsg->vRecv.size(), e.what());
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadMessageWorker()");
+            }
+        }
+
+        bool fWake;
+        {
+            boost::unique_lock<boost::mutex> lock(csWorkerMessages);
+            fWake = --pfrom->nWorkerMessages == MAX_PEER_WORKER_MESSAGES / 2;
+        }
+        // The message handler holds back this peer's messages while its backlog is full
+        if (fWake)
+            WakeMessageHandler();
+        pfrom->Release();
+        delete pmsg;
+    }
+}
+
+/**
+ * The header checks of AcceptBlockHeader and AcceptBlock for a compact block, run before its transactions are
+ * looked up in the mempool: version and timestamp rules, checkpoints, the required difficulty and, while blocks
+ * are mined, the proof of work. The proof of stake needs the coinstake, which is left to the full block. The
+ * header is not added to the block index, that happens once the block is accepted.
+ */
+bool static CheckCompactBlockHeader(const CBlockHeader& header, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("%s : prev block %s is invalid", __func__, header.hashPrevBlock.ToString()),
+            REJECT_INVALID, "bad-prevblk");
+
+    if (!CheckBlockHeader(header, state, pindexPrev->nHeight + 1 <= Params().LAST_POW_BLOCK()))
+        return false;
+    if (!ContextualCheckBlockHeader(header, state, pindexPrev))
+        return false;
+    if (!CheckWork(CBlock(header), pindexPrev))
+        return state.DoS(100, error("%s : incorrect difficulty", __func__), REJECT_INVALID, "bad-diffbits");
+    return true;
+}
+
+/** Hand a block received in full or reconstructed from a compact block to validation. */
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    CValidationState state;
+    bool fKnown;
+    {
+        LOCK(cs_main);
+        fKnown = mapBlockIndex.count(block.GetHash()) > 0;
+    }
+    if (!fKnown && nBlockCheckThreads) {
+        // Pre-validate in parallel with the blocks received next; connection happens in arrival order.
+        QueueBlockForProcessing(pfrom, block);
+    } else if (!fKnown) {
+        ProcessNewBlock(state, pfrom, &block);
+        int nDoS;
+        if(state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if(nDoS > 0) {
+                TRY_LOCK(cs_main, lockMain);
+                if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+    } else {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -6004,7 +6778,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -6065,6 +6839,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+                RecordBlockAnnouncement(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
                     // Add this to the list of blocks to request
                     vToFetch.push_back(inv);
@@ -6241,6 +7016,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
             vWorkQueue.push_back(inv.hash);
+            pfrom->nLastTXTime = GetTime();
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                      pfrom->id, pfrom->cleanSubVer,
@@ -6295,6 +7071,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
             //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
             RelayTransaction(tx);
+            pfrom->nLastTXTime = GetTime();
             LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
                      pfrom->id, pfrom->cleanSubVer,
                      tx.GetHash().ToString(),
@@ -6400,37 +7177,158 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
-                pfrom->vBlockRequested.push_back(hashBlock);
+        bool fOrphan;
+        {
+            LOCK(cs_main);
+            fOrphan = !mapBlockIndex.count(block.hashPrevBlock) && !IsBlockPending(block.hashPrevBlock);
+            if (fOrphan) {
+                if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+                    //we already asked for this block, so lets work backwards and ask for the previous block
+                    pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+                    pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+                } else {
+                    //ask to sync to this block
+                    pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                    pfrom->vBlockRequested.push_back(hashBlock);
+                }
             }
-        } else {
+        }
+        if (!fOrphan) {
             pfrom->AddInventoryKnown(inv);
+            ProcessReceivedBlock(pfrom, block, strCommand);
+        }
+    }
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received cmpctblock %s (%u txn) peer=%d\n", hashBlock.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fReconstructed = false;
+        {
+            LOCK(cs_main);
+            RecordBlockAnnouncement(pfrom->GetId(), hashBlock);
+            if (mapBlockIndex.count(hashBlock) || IsBlockPending(hashBlock))
+                return true;
+            // Orphans are resolved through the full block path, which knows how to walk back. So are blocks on
+            // top of one still being validated, whose header can't be checked against its parent yet.
+            BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (mi == mapBlockIndex.end()) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
 
+            // Scanning the mempool is not cheap, only do it for a header that could make a valid block
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckCompactBlockHeader(cmpctblock.header, state, mi->second)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrint("net", "Peer %d sent us a compact block %s with an invalid header\n", pfrom->id, hashBlock.ToString());
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+            partialBlock.SetNull();
+            ReadStatus status = partialBlock.InitData(cmpctblock, mempool);
+            if (status == READ_STATUS_INVALID) {
+                partialBlock.SetNull();
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block %s\n", pfrom->id, hashBlock.ToString());
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                partialBlock.SetNull();
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            partialBlock.GetMissing(req.indexes);
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
             } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                status = partialBlock.FillBlock(block, vector<CTransaction>());
+                partialBlock.SetNull();
+                if (status == READ_STATUS_OK)
+                    fReconstructed = true;
+                else
+                    pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            }
+        }
+        if (fReconstructed)
+            ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) {
+        BlockTransactions resp;
+        vRecv >> resp;
+        CInv inv(MSG_BLOCK, resp.blockhash);
+        LogPrint("net", "received blocktxn %s (%u txn) peer=%d\n", resp.blockhash.ToString(), resp.txn.size(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            PartiallyDownloadedBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+            if (partialBlock.IsNull() || partialBlock.header.GetHash() != resp.blockhash) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            partialBlock.SetNull();
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid block transactions for %s\n", pfrom->id, resp.blockhash.ToString());
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+            if (mapBlockIndex.count(resp.blockhash) || IsBlockPending(resp.blockhash))
+                return true;
+        }
+        ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
             }
+            // Requests for old blocks get the full block, so a peer asking for many of them pays for the disk
+            // reads in bandwidth
+            if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+                ProcessGetData(pfrom);
+                return true;
+            }
+            if (!ReadBlockFromDisk(block, it->second))
+                return error("%s : cannot load block %s from disk", __func__, req.blockhash.ToString());
         }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indexes\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
     }
 
 
@@ -6510,6 +7408,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (pingUsecTime > 0) {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+                        pfrom->nMinPingUsecTime = std::min(pfrom->nMinPingUsecTime, pingUsecTime);
                     } else {
                         // This should never happen
                         sProblem = "Timing mishap";
@@ -6646,15 +7545,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "Unparseable reject message received\n");
             }
         }
+    } else if (nMessageWorkerThreads && IsWorkerMessage(strCommand)) {
+        QueueWorkerMessage(pfrom, strCommand, vRecv);
     } else {
         //probably one the extensions
-        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageLPCtx(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        ProcessExtensionMessage(pfrom, strCommand, vRecv);
     }
 
 
@@ -6724,6 +7619,11 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // hold back the peer's messages while its backlog at the message workers is full
+        pfrom->fWorkerBacklogFull = nMessageWorkerThreads && IsWorkerMessage(msg.hdr.GetCommand()) && IsWorkerBacklogFull(pfrom);
+        if (pfrom->fWorkerBacklogFull)
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -6744,6 +7644,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
+        CNode::RecordMessageRecv(strCommand, nMessageSize + CMessageHeader::HEADER_SIZE);
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
@@ -6788,7 +7689,7 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->EraseRecvMsgs(it);
 
     return fOk;
 }
@@ -6839,9 +7740,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6857,8 +7758,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6872,6 +7773,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
 
+        // Penalties the message workers handed out since the last pass, this peer's included
+        ApplyQueuedMisbehavior();
         CNodeState& state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -6891,6 +7794,21 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("reject", (string) "block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
         state.rejects.clear();
 
+        // Replace the slowest automatic outbound peer now and then; ThreadOpenConnections fills the slot
+        state.fEvictable = pto->fAutomaticOutbound && pto->fSuccessfullyConnected && !pto->fWhitelisted && !pto->fObfuScationMaster;
+        if (fEvictSlowPeers && GetTime() >= nNextOutboundEvictionCheck) {
+            nNextOutboundEvictionCheck = GetTime() + OUTBOUND_EVICTION_INTERVAL;
+            nOutboundToEvict = SelectOutboundPeerToEvict();
+        }
+        if (pto->GetId() == nOutboundToEvict) {
+            nOutboundToEvict = -1;
+            if (state.fEvictable) {
+                LogPrint("net", "replacing slow outbound peer=%d (%d announcements, %d first, delay %dms)\n", pto->id,
+                    state.nBlockAnnouncements, state.nBlocksFirst, state.nBlockAnnounceDelay / 1000);
+                pto->fDisconnect = true;
+            }
+        }
+
         // Start block sync
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
@@ -6924,7 +7842,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -6943,13 +7861,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -6961,10 +7877,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
-            // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
-            // should only happen during initial block download.
-            LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
-            pto->fDisconnect = true;
+            // the download window should be much larger than the to-be-downloaded set of blocks, so this
+            // should only happen during initial block download. Hand the peer's blocks to the other peers
+            // first, and only disconnect it if it keeps stalling.
+            if (state.nStallReassigned >= MAX_STALL_REASSIGNMENTS) {
+                LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
+                pto->fDisconnect = true;
+            } else {
+                LogPrintf("Peer=%d is stalling block download, reassigning %d blocks\n", pto->id, state.nBlocksInFlight);
+                while (!state.vBlocksInFlight.empty())
+                    EraseBlockInFlight(mapBlocksInFlight.find(state.vBlocksInFlight.front().hash));
+                state.nStallReassigned++;
+                state.nBlockInterval = 1000000 * (int64_t)BLOCK_DOWNLOAD_TARGET_TIME / MIN_BLOCKS_IN_TRANSIT_PER_PEER;
+                state.nDownloadBackoffUntil = nNow + 1000000 * BLOCK_STALLING_TIMEOUT;
+            }
         }
         // In case there is a block that has been in flight from this peer for (2 + 0.5 * N) times the block interval
         // (with N the number of validated blocks that were in flight at the time it was requested), disconnect due to
@@ -6980,10 +7906,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInFlightTarget = GetBlocksInFlightTarget(&state);
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < nBlocksInFlightTarget && state.nDownloadBackoffUntil < nNow) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInFlightTarget - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
@@ -46,6 +46,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
@@ -91,10 +92,47 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Maximum number of blocks read ahead and disconnected against a single coins cache during a reorg */
+static const int MAX_DISCONNECT_BATCH = 64;
+/** Number of threads reading block and undo data ahead of a multi-block disconnect */
+static const int DISCONNECT_READ_THREADS = 4;
+/** Number of blocks that can be requested at any given time from a single peer whose delivery rate is not known yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
-/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+/** Bounds on the number of blocks in flight from a single peer once its delivery rate is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 128;
+/** Seconds of a peer's observed block delivery rate to keep requested from it. */
+static const unsigned int BLOCK_DOWNLOAD_TARGET_TIME = 4;
+/** Timeout in seconds during which a peer must stall block download progress before its blocks are reassigned. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Number of times a peer's blocks are reassigned for stalling before it is disconnected. */
+static const int MAX_STALL_REASSIGNMENTS = 2;
+/** -blockcheckthreads default (threads pre-validating received blocks ahead of connection, 0 = none) */
+static const int DEFAULT_BLOCK_CHECK_THREADS = 2;
+static const int MAX_BLOCK_CHECK_THREADS = 16;
+/** Maximum number of received blocks waiting for pre-validation or connection. */
+static const unsigned int MAX_BLOCKS_PENDING_CHECK = 128;
+/** -messagethreads default (threads handling masternode, budget and spork messages off the validation thread, 0 = none) */
+static const int DEFAULT_MESSAGE_WORKER_THREADS = 2;
+static const int MAX_MESSAGE_WORKER_THREADS = 16;
+/** -sigcheckthreads default (threads checking masternode-layer signatures ahead of the message workers, 0 = one per core) */
+static const int DEFAULT_SIGNATURE_CHECK_THREADS = 0;
+static const int MAX_SIGNATURE_CHECK_THREADS = 16;
+/** Maximum number of messages from one peer waiting for a message worker before the rest are held back. */
+static const int MAX_PEER_WORKER_MESSAGES = 64;
+/** Number of recent new blocks whose first announcement time is kept for timing later announcements. */
+static const unsigned int BLOCK_ANNOUNCE_HISTORY = 100;
+/** Announcements of blocks whose header we don't have yet that are kept per peer until the header is accepted. */
+static const unsigned int MAX_UNCONFIRMED_ANNOUNCEMENTS = 16;
+/** Announcements later than this many seconds after the first one count as this late. */
+static const int BLOCK_ANNOUNCE_DELAY_MAX = 30;
+/** Seconds between checks for a slow automatic outbound peer to replace with a fresh address. */
+static const int OUTBOUND_EVICTION_INTERVAL = 10 * 60;
+/** Outbound peers are only replaced after this many seconds connected, with at least this many new blocks seen meanwhile. */
+static const int OUTBOUND_EVICTION_MIN_CONNECT_TIME = 20 * 60;
+static const int OUTBOUND_EVICTION_MIN_BLOCKS = 10;
+/** -evictslowpeers default */
+static const bool DEFAULT_EVICT_SLOW_PEERS = true;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
@@ -110,6 +148,10 @@ static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
+/** Relay new blocks as compact blocks to peers that support them */
+static const bool DEFAULT_PEERCOMPACTBLOCKS = true;
+/** Depth up to which getblocktxn is answered with the transactions asked for; deeper blocks are sent in full */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 
 /** "reject" message codes */
 static const unsigned char REJECT_MALFORMED = 0x01;
@@ -139,10 +181,14 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockCheckThreads;
+extern int nMessageWorkerThreads;
+extern int nSignatureCheckThreads;
+extern bool fEvictSlowPeers;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -191,9 +237,18 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pfrom   The node which we are receiving the block from; it is added to mapBlockSource and may be penalised if the block is invalid.
  * @param[in]   pblock  The block we want to process.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   fPrechecked  Whether pblock already passed PrecheckBlock, so its merkle root and signature need no re-check.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL, bool fPrechecked = false);
+/** The context-free block checks CheckBlock skips for a prechecked block, run before its parent is connected: merkle root and signature */
+bool PrecheckBlock(const CBlock& block, CValidationState& state);
+/** Hand a block received from pfrom to the pre-validation threads; it is connected in arrival order. */
+void QueueBlockForProcessing(CNode* pfrom, const CBlock& block);
+/** Whether a received block is waiting for pre-validation or connection */
+bool IsBlockPending(const uint256& hash);
+/** Drop the blocks still waiting for pre-validation or connection, once the block threads have stopped */
+void ClearPendingBlocks();
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -223,6 +278,14 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block pre-validation thread */
+void ThreadBlockCheck();
+/** Run the thread connecting pre-validated blocks in arrival order */
+void ThreadBlockProcess();
+/** Run message worker nWorker, handling the masternode-layer messages of the peers mapped to it */
+void ThreadMessageWorker(int nWorker);
+/** Run a thread recovering the signers of queued masternode-layer messages ahead of the message workers */
+void ThreadSignatureCheck();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -254,6 +317,8 @@ bool AbortNode(const std::string& msg, const std::string& userMessage = "");
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
+/** Increase a node's misbehavior score from a thread that does not hold cs_main, such as a message worker. */
+void QueueMisbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
 
@@ -273,6 +338,10 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlockAnnouncements;
+    int nBlocksFirst;
+    int64_t nBlockAnnounceDelay;
+    int64_t nBlockThroughput;
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -458,11 +527,22 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
+/** Zerocoin index entries removed by disconnected blocks, erased from the zerocoin DB in one batch */
+struct CZerocoinEraseBatch {
+    std::vector<CBigNum> vMints;
+    std::vector<CBigNum> vSerials;
+    //! accumulator checkpoints to erase, each with the checkpoint of the block before it
+    std::vector<std::pair<uint256, uint256> > vCheckpoints;
+};
+
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified.
+ *  If pblockUndo is provided it is used instead of reading the undo data from disk. If pzcErase
+ *  is provided the zerocoin entries and accumulator checkpoints to remove are appended to it and
+ *  left for the caller to erase, otherwise they are erased here, the entries in a single batch. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, const CBlockUndo* pblockUndo = NULL, CZerocoinEraseBatch* pzcErase = NULL);
 
 /** Reprocess a number of blocks to try and get on the correct chain again **/
 bool DisconnectBlocksAndReprocess(int blocks);
@@ -642,6 +722,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the coin database underneath pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
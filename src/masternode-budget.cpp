@@ -8,6 +8,7 @@
 #include "main.h"
 
 #include "addrman.h"
+#include "governancedb.h"
 #include "masternode-budget.h"
 #include "masternode-sync.h"
 #include "masternode.h"
@@ -252,39 +253,6 @@ CBudgetDB::CBudgetDB()
     strMagicMessage = "MasternodeBudget";
 }
 
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
-{
-    LOCK(objToSave.cs);
-
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
 CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
 {
     LOCK(objToLoad.cs);
@@ -370,31 +338,50 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
     return Ok;
 }
 
-void DumpBudgets()
+void CBudgetManager::Flush(CGovernanceDB& db)
 {
-    int64_t nStart = GetTimeMillis();
+    CLevelDBBatch batch;
+    db.proposals.BeginPass();
+    db.finalizedBudgets.BeginPass();
+    db.orphanProposalVotes.BeginPass();
+    db.orphanFinalizedBudgetVotes.BeginPass();
 
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrint("masternode","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrint("masternode","Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok) {
-        LogPrint("masternode","Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
+    {
+        LOCK(cs);
+        for (std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin(); it != mapProposals.end(); ++it)
+            db.proposals.Write(batch, it->first, it->second);
+        for (std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin(); it != mapFinalizedBudgets.end(); ++it)
+            db.finalizedBudgets.Write(batch, it->first, it->second);
+        for (std::map<uint256, CBudgetVote>::iterator it = mapOrphanMasternodeBudgetVotes.begin(); it != mapOrphanMasternodeBudgetVotes.end(); ++it)
+            db.orphanProposalVotes.Write(batch, it->first, it->second);
+        for (std::map<uint256, CFinalizedBudgetVote>::iterator it = mapOrphanFinalizedBudgetVotes.begin(); it != mapOrphanFinalizedBudgetVotes.end(); ++it)
+            db.orphanFinalizedBudgetVotes.Write(batch, it->first, it->second);
     }
-    LogPrint("masternode","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
 
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    db.proposals.EraseOthers(batch);
+    db.finalizedBudgets.EraseOthers(batch);
+    db.orphanProposalVotes.EraseOthers(batch);
+    db.orphanFinalizedBudgetVotes.EraseOthers(batch);
+    db.WriteBatch(batch);
+
+    db.proposals.Commit();
+    db.finalizedBudgets.Commit();
+    db.orphanProposalVotes.Commit();
+    db.orphanFinalizedBudgetVotes.Commit();
+}
+
+void CBudgetManager::Load(CGovernanceDB& db)
+{
+    LOCK(cs);
+    mapProposals.clear();
+    mapFinalizedBudgets.clear();
+    mapOrphanMasternodeBudgetVotes.clear();
+    mapOrphanFinalizedBudgetVotes.clear();
+    db.ReadRecords(db.proposals, mapProposals);
+    db.ReadRecords(db.finalizedBudgets, mapFinalizedBudgets);
+    db.ReadRecords(db.orphanProposalVotes, mapOrphanMasternodeBudgetVotes);
+    db.ReadRecords(db.orphanFinalizedBudgetVotes, mapOrphanFinalizedBudgetVotes);
+    NotifyProposalUpdates();
 }
 
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
@@ -424,6 +411,7 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    NotifyProposalUpdates();
     LogPrint("masternode","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
     return true;
 }
@@ -674,6 +662,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
+        // only walks the votes if the masternode list changed since the last time
         (*it).second.CleanAndRemove(false);
 
         CBudgetProposal* pbudgetProposal = &((*it).second);
@@ -697,24 +686,45 @@ struct sortProposalsByVotes {
     }
 };
 
-//Need to review this function
-std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+std::vector<CBudgetProposal*> CBudgetManager::GetRankedProposals()
 {
     LOCK(cs);
 
-    // ------- Sort budgets by Yes Count
-
-    std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
-
+    // Revalidating the votes is what moves the tallies when masternodes go away, and is free when none did
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
         (*it).second.CleanAndRemove(false);
-        vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
         ++it;
     }
 
+    uint64_t nVersion = nProposalsVersion;
+    if (nRankedVersion == nVersion) return vecRankedProposals;
+
+    std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
+    vBudgetPorposalsSort.reserve(mapProposals.size());
+    for (it = mapProposals.begin(); it != mapProposals.end(); ++it)
+        vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
+
     std::sort(vBudgetPorposalsSort.begin(), vBudgetPorposalsSort.end(), sortProposalsByVotes());
 
+    vecRankedProposals.clear();
+    vecRankedProposals.reserve(vBudgetPorposalsSort.size());
+    for (unsigned int i = 0; i < vBudgetPorposalsSort.size(); i++)
+        vecRankedProposals.push_back(vBudgetPorposalsSort[i].first);
+    nRankedVersion = nVersion;
+
+    return vecRankedProposals;
+}
+
+//Need to review this function
+std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+{
+    LOCK(cs);
+
+    // ------- Sort budgets by Yes Count
+
+    std::vector<CBudgetProposal*> vBudgetPorposalsSort = GetRankedProposals();
+
     // ------- Grab The Budgets In Order
 
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
@@ -728,9 +738,9 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
 
 
-    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
+    std::vector<CBudgetProposal*>::iterator it2 = vBudgetPorposalsSort.begin();
     while (it2 != vBudgetPorposalsSort.end()) {
-        CBudgetProposal* pbudgetProposal = (*it2).first;
+        CBudgetProposal* pbudgetProposal = *it2;
 
         LogPrint("masternode","CBudgetManager::GetBudget() - Processing Budget %s\n", pbudgetProposal->strProposalName.c_str());
         //prop start/end should be inside this period
@@ -870,15 +880,28 @@ void CBudgetManager::NewBlock()
     // incremental sync with our peers
     if (masternodeSync.IsSynced()) {
         LogPrint("masternode","CBudgetManager::NewBlock - incremental sync started\n");
-        if (chainActive.Height() % 1440 == rand() % 1440) {
+        bool fFullSync = chainActive.Height() % 1440 == rand() % 1440;
+
+        // On the daily full sync, peers answering sync summaries are asked for what we lack instead of
+        // being sent everything; they do the same with us. The summary has to be taken before ClearSeen.
+        CSyncSummary summary;
+        if (fFullSync) {
+            std::vector<CInv> vInv;
+            GetSyncInventory(vInv);
+            summary = CSyncSummary(vInv);
+
             ClearSeen();
             ResetSync();
         }
 
         LOCK(cs_vNodes);
-        BOOST_FOREACH (CNode* pnode, vNodes)
-            if (pnode->nVersion >= ActiveProtocol())
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->nVersion < ActiveProtocol()) continue;
+            if (fFullSync && pnode->nVersion >= SYNC_SUMMARY_VERSION)
+                pnode->PushMessage("mnvssum", summary);
+            else
                 Sync(pnode, 0, true);
+        }
 
         MarkSynced();
     }
@@ -981,7 +1004,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             if (nProp == 0) {
                 if (pfrom->HasFulfilledRequest("mnvs")) {
                     LogPrint("masternode","mnvs - peer already asked me for the list\n");
-                    Misbehaving(pfrom->GetId(), 20);
+                    QueueMisbehaving(pfrom->GetId(), 20);
                     return;
                 }
                 pfrom->FulfilledRequest("mnvs");
@@ -992,6 +1015,40 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("mnbudget", "mnvs - Sent Masternode votes to peer %i\n", pfrom->GetId());
     }
 
+    if (strCommand == "mnvssum") { //Masternode vote sync of the items missing from a summary
+        CSyncSummary summary;
+        vRecv >> summary;
+
+        if (!summary.IsValid()) {
+            QueueMisbehaving(pfrom->GetId(), 20);
+            return;
+        }
+        // Peers ask again on their daily full sync, so this is limited by time rather than once per connection.
+        // The limit outlives the connection, so an honest peer that reconnects is only ignored, not penalised.
+        if (Params().NetworkID() == CBaseChainParams::MAIN && !(pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal())) {
+            std::map<CNetAddr, int64_t>::iterator it = mapAskedUsForSummary.find(pfrom->addr);
+            if (it != mapAskedUsForSummary.end() && GetTime() < (*it).second) {
+                LogPrint("masternode","mnvssum - peer already asked me for the list\n");
+                return;
+            }
+            mapAskedUsForSummary[pfrom->addr] = GetTime() + BUDGET_SUMMARY_SECONDS;
+        }
+
+        std::vector<CInv> vInv, vInvMissing;
+        GetSyncInventory(vInv);
+        summary.GetDifferences(vInv, vInvMissing);
+        BOOST_FOREACH (const CInv& inv, vInvMissing)
+            pfrom->PushInventory(inv);
+
+        // The counts cover the items the peer already has, as if it had been sent all of them
+        int nPropCount = 0;
+        BOOST_FOREACH (const CInv& inv, vInv)
+            if (inv.type == MSG_BUDGET_PROPOSAL || inv.type == MSG_BUDGET_VOTE) nPropCount++;
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_BUDGET_PROP, nPropCount);
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_BUDGET_FIN, (int)vInv.size() - nPropCount);
+        LogPrint("mnbudget", "mnvssum - Sent %d of %d budget items to peer %i\n", vInvMissing.size(), vInv.size(), pfrom->GetId());
+    }
+
     if (strCommand == "mprop") { //Masternode Proposal
         CBudgetProposalBroadcast budgetProposalBroadcast;
         vRecv >> budgetProposalBroadcast;
@@ -1049,7 +1106,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
         if (!vote.SignatureValid(true)) {
             LogPrint("masternode","mvote - signature invalid\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20);
+            if (masternodeSync.IsSynced()) QueueMisbehaving(pfrom->GetId(), 20);
             // it could just be a non-synced masternode
             mnodeman.AskForMN(pfrom, vote.vin);
             return;
@@ -1121,7 +1178,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
         if (!vote.SignatureValid(true)) {
             LogPrint("masternode","fbvote - signature invalid\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20);
+            if (masternodeSync.IsSynced()) QueueMisbehaving(pfrom->GetId(), 20);
             // it could just be a non-synced masternode
             mnodeman.AskForMN(pfrom, vote.vin);
             return;
@@ -1290,6 +1347,64 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
     LogPrint("mnbudget", "CBudgetManager::Sync - sent %d items\n", nInvCount);
 }
 
+void CBudgetManager::GetSyncInventory(std::vector<CInv>& vInv)
+{
+    LOCK(cs);
+
+    std::map<uint256, CBudgetProposalBroadcast>::iterator it1 = mapSeenMasternodeBudgetProposals.begin();
+    while (it1 != mapSeenMasternodeBudgetProposals.end()) {
+        CBudgetProposal* pbudgetProposal = FindProposal((*it1).first);
+        if (pbudgetProposal && pbudgetProposal->fValid) {
+            vInv.push_back(CInv(MSG_BUDGET_PROPOSAL, (*it1).second.GetHash()));
+
+            std::map<uint256, CBudgetVote>::iterator it2 = pbudgetProposal->mapVotes.begin();
+            while (it2 != pbudgetProposal->mapVotes.end()) {
+                if ((*it2).second.fValid)
+                    vInv.push_back(CInv(MSG_BUDGET_VOTE, (*it2).second.GetHash()));
+                ++it2;
+            }
+        }
+        ++it1;
+    }
+
+    std::map<uint256, CFinalizedBudgetBroadcast>::iterator it3 = mapSeenFinalizedBudgets.begin();
+    while (it3 != mapSeenFinalizedBudgets.end()) {
+        CFinalizedBudget* pfinalizedBudget = FindFinalizedBudget((*it3).first);
+        if (pfinalizedBudget && pfinalizedBudget->fValid) {
+            vInv.push_back(CInv(MSG_BUDGET_FINALIZED, (*it3).second.GetHash()));
+
+            std::map<uint256, CFinalizedBudgetVote>::iterator it4 = pfinalizedBudget->mapVotes.begin();
+            while (it4 != pfinalizedBudget->mapVotes.end()) {
+                if ((*it4).second.fValid)
+                    vInv.push_back(CInv(MSG_BUDGET_FINALIZED_VOTE, (*it4).second.GetHash()));
+                ++it4;
+            }
+        }
+        ++it3;
+    }
+}
+
+void CBudgetManager::RequestSync(CNode* pnode)
+{
+    uint256 n = 0;
+    if (pnode->nVersion < SYNC_SUMMARY_VERSION) {
+        pnode->PushMessage("mnvs", n);
+        return;
+    }
+
+    // NewBlock takes cs_vNodes with cs held, and our callers may hold cs_vNodes; fall back to a full request
+    // rather than wait for cs
+    TRY_LOCK(cs, lockBudget);
+    if (!lockBudget) {
+        pnode->PushMessage("mnvs", n);
+        return;
+    }
+
+    std::vector<CInv> vInv;
+    GetSyncInventory(vInv);
+    pnode->PushMessage("mnvssum", CSyncSummary(vInv));
+}
+
 bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string& strError)
 {
     LOCK(cs);
@@ -1351,6 +1466,7 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1363,6 +1479,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1377,6 +1494,12 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    for (int i = 0; i < 3; i++) {
+        vTallyAll[i] = other.vTallyAll[i];
+        vTallyValid[i] = other.vTallyValid[i];
+    }
+    fVotesChecked = other.fVotesChecked;
+    nVotesCheckedVersion = other.nVotesCheckedVersion;
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1483,7 +1606,14 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
-    mapVotes[hash] = vote;
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) {
+        CountVote(it->second, -1);
+        it->second = vote;
+    } else {
+        it = mapVotes.insert(make_pair(hash, vote)).first;
+    }
+    CountVote(it->second, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
@@ -1492,69 +1622,60 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
-    while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
-        ++it;
-    }
-}
-
-double CBudgetProposal::GetRatio()
-{
-    int yeas = 0;
-    int nays = 0;
+    // Without signatures a vote is valid as long as its masternode is known, which only changes with the list
+    uint64_t nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && fVotesChecked && nVotesCheckedVersion == nListVersion) return;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
+        bool fValidVote = (*it).second.SignatureValid(fSignatureCheck);
+        if (fValidVote != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fValidVote;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
 
-    if (yeas + nays == 0) return 0.0f;
-
-    return ((double)(yeas) / (double)(yeas + nays));
+    fVotesChecked = !fSignatureCheck;
+    nVotesCheckedVersion = nListVersion;
 }
 
-int CBudgetProposal::GetYeas()
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
 {
-    int ret = 0;
+    if (vote.nVote < VOTE_ABSTAIN || vote.nVote > VOTE_NO) return;
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
+    vTallyAll[vote.nVote] += nDelta;
+    if (vote.fValid) {
+        vTallyValid[vote.nVote] += nDelta;
+        // the budget ranks proposals by yeas minus nays
+        if (vote.nVote != VOTE_ABSTAIN) budget.NotifyProposalUpdates();
     }
-
-    return ret;
 }
 
-int CBudgetProposal::GetNays()
+void CBudgetProposal::RecountVotes()
 {
-    int ret = 0;
+    for (int i = 0; i < 3; i++)
+        vTallyAll[i] = vTallyValid[i] = 0;
+    fVotesChecked = false;
+    nVotesCheckedVersion = 0;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
+        CountVote((*it).second, 1);
         ++it;
     }
-
-    return ret;
 }
 
-int CBudgetProposal::GetAbstains()
+double CBudgetProposal::GetRatio()
 {
-    int ret = 0;
+    int yeas = vTallyAll[VOTE_YES];
+    int nays = vTallyAll[VOTE_NO];
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
+    if (yeas + nays == 0) return 0.0f;
 
-    return ret;
+    return ((double)(yeas) / (double)(yeas + nays));
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1661,7 +1782,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1676,10 +1797,15 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -1710,6 +1836,8 @@ CFinalizedBudget::CFinalizedBudget()
     nTime = 0;
     fValid = true;
     fAutoChecked = false;
+    fVotesChecked = false;
+    nVotesCheckedVersion = 0;
 }
 
 CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
@@ -1722,6 +1850,8 @@ CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
     nTime = other.nTime;
     fValid = true;
     fAutoChecked = false;
+    fVotesChecked = false;
+    nVotesCheckedVersion = 0;
 }
 
 bool CFinalizedBudget::AddOrUpdateVote(CFinalizedBudgetVote& vote, std::string& strError)
@@ -1837,12 +1967,18 @@ void CFinalizedBudget::AutoCheck()
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CFinalizedBudget::CleanAndRemove(bool fSignatureCheck)
 {
+    uint64_t nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && fVotesChecked && nVotesCheckedVersion == nListVersion) return;
+
     std::map<uint256, CFinalizedBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
         (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
         ++it;
     }
+
+    fVotesChecked = !fSignatureCheck;
+    nVotesCheckedVersion = nListVersion;
 }
 
 
@@ -2105,7 +2241,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2120,11 +2256,16 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CFinalizedBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
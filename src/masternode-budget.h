@@ -17,11 +17,14 @@
 #include "util.h"
 #include <boost/lexical_cast.hpp>
 
+#include <atomic>
+
 using namespace std;
 
 extern CCriticalSection cs_budget;
 
 class CBudgetManager;
+class CGovernanceDB;
 class CFinalizedBudgetBroadcast;
 class CFinalizedBudget;
 class CBudgetProposal;
@@ -35,12 +38,13 @@ class CTxBudgetPayment;
 static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (50 * COIN);
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
+/** Minimum time between two "mnvssum" requests from the same address */
+static const int64_t BUDGET_SUMMARY_SECONDS = 3 * 60 * 60;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 extern CBudgetManager budget;
-void DumpBudgets();
 
 // Define amount of blocks in budget payment cycle
 int GetBudgetPaymentCycleBlocks();
@@ -68,6 +72,8 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
     void Relay();
 
     std::string GetVoteString()
@@ -120,6 +126,8 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -143,7 +151,7 @@ public:
     }
 };
 
-/** Save Budget Manager (budget.dat)
+/** Access to budget.dat, where the budget was kept before the governance database; read once to import it
  */
 class CBudgetDB
 {
@@ -163,7 +171,6 @@ public:
     };
 
     CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
     ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
 };
 
@@ -178,6 +185,12 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // bumped whenever a proposal is added or removed or its yeas minus nays changes
+    std::atomic<uint64_t> nProposalsVersion;
+    // mapProposals by yeas minus nays, best first, as of nRankedVersion
+    std::vector<CBudgetProposal*> vecRankedProposals;
+    uint64_t nRankedVersion;
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -192,13 +205,18 @@ public:
     std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
     std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
     std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    // who asked us for a summary sync and when they may ask again; guarded by cs_budget
+    std::map<CNetAddr, int64_t> mapAskedUsForSummary;
 
-    CBudgetManager()
+    CBudgetManager() : nProposalsVersion(1), nRankedVersion(0)
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
     }
 
+    /// Drop the cached proposal ranking after a proposal or its tally changed; safe to call without cs
+    void NotifyProposalUpdates() { nProposalsVersion++; }
+
     void ClearSeen()
     {
         mapSeenMasternodeBudgetProposals.clear();
@@ -213,6 +231,10 @@ public:
     void ResetSync();
     void MarkSynced();
     void Sync(CNode* node, uint256 nProp, bool fPartial = false);
+    /// Announcements of all valid proposals, finalized budgets and their votes, which peers syncing the budget get
+    void GetSyncInventory(std::vector<CInv>& vInv);
+    /// Ask a peer for the budget, or for the items we lack if it answers sync summaries
+    void RequestSync(CNode* pnode);
 
     void Calculate();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
@@ -225,6 +247,8 @@ public:
     CAmount GetTotalBudget(int nHeight);
     std::vector<CBudgetProposal*> GetBudget();
     std::vector<CBudgetProposal*> GetAllProposals();
+    /// All proposals sorted by yeas minus nays, ties broken by fee transaction, with their votes revalidated
+    std::vector<CBudgetProposal*> GetRankedProposals();
     std::vector<CFinalizedBudget*> GetFinalizedBudgets();
     bool IsBudgetPaymentBlock(int nBlockHeight);
     bool AddProposal(CBudgetProposal& budgetProposal);
@@ -245,6 +269,7 @@ public:
 
         LogPrintf("Budget object cleared\n");
         mapProposals.clear();
+        NotifyProposalUpdates();
         mapFinalizedBudgets.clear();
         mapSeenMasternodeBudgetProposals.clear();
         mapSeenMasternodeBudgetVotes.clear();
@@ -256,6 +281,12 @@ public:
     void CheckAndRemove();
     std::string ToString() const;
 
+    /// Write the proposals, finalized budgets and orphan votes that changed since the last flush to the governance
+    /// database; the seen maps are left out, they are cleared on startup anyway
+    void Flush(CGovernanceDB& db);
+    /// Replace the proposals, finalized budgets and orphan votes with the ones in the governance database
+    void Load(CGovernanceDB& db);
+
 
     ADD_SERIALIZE_METHODS;
 
@@ -271,6 +302,8 @@ public:
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
+        if (ser_action.ForRead())
+            NotifyProposalUpdates();
     }
 };
 
@@ -311,6 +344,9 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     bool fAutoChecked; //If it matches what we see, we'll auto vote for it (masternode only)
+    // masternode list version the votes were last revalidated against
+    bool fVotesChecked;
+    uint64_t nVotesCheckedVersion;
 
 public:
     bool fValid;
@@ -457,6 +493,17 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+    void CountVote(const CBudgetVote& vote, int nDelta);
+
+protected:
+    // tallies of mapVotes by VOTE_*, kept up to date as votes are added, replaced and revalidated:
+    // all votes, and the valid ones only
+    int vTallyAll[3];
+    int vTallyValid[3];
+    // masternode list version the votes were last revalidated against, the list can't have dropped a voter since
+    bool fVotesChecked;
+    uint64_t nVotesCheckedVersion;
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -507,9 +554,11 @@ public:
     int GetBlockCurrentCycle();
     int GetBlockEndCycle();
     double GetRatio();
-    int GetYeas();
-    int GetNays();
-    int GetAbstains();
+    int GetYeas() { return vTallyValid[VOTE_YES]; }
+    int GetNays() { return vTallyValid[VOTE_NO]; }
+    int GetAbstains() { return vTallyValid[VOTE_ABSTAIN]; }
+    /// Rebuild the tallies from mapVotes
+    void RecountVotes();
     CAmount GetAmount() { return nAmount; }
     void SetAllotted(CAmount nAllotedIn) { nAlloted = nAllotedIn; }
     CAmount GetAllotted() { return nAlloted; }
@@ -548,6 +597,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -576,6 +627,10 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.vTallyAll, second.vTallyAll);
+        swap(first.vTallyValid, second.vTallyValid);
+        swap(first.fVotesChecked, second.fVotesChecked);
+        swap(first.nVotesCheckedVersion, second.nVotesCheckedVersion);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
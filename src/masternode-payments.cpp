@@ -6,6 +6,7 @@
 
 #include "masternode-payments.h"
 #include "addrman.h"
+#include "governancedb.h"
 #include "masternode-budget.h"
 #include "masternode-sync.h"
 #include "masternodeman.h"
@@ -34,37 +35,6 @@ CMasternodePaymentDB::CMasternodePaymentDB()
     strMagicMessage = "MasternodePayments";
 }
 
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
-{
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
 CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
@@ -147,33 +117,6 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
     return Ok;
 }
 
-void DumpMasternodePayments()
-{
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrint("masternode","Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
-
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
-}
-
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
@@ -349,6 +292,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
 
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
 
+    LOCK(cs_process_message);
 
     if (strCommand == "mnget") { //Masternode Payments Request Sync
         if (fLiteMode) return;   //disable all Obfuscation/Masternode related functionality
@@ -359,7 +303,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         if (Params().NetworkID() == CBaseChainParams::MAIN) {
             if (pfrom->HasFulfilledRequest("mnget")) {
                 LogPrint("masternode","mnget - peer already asked me for the list\n");
-                Misbehaving(pfrom->GetId(), 20);
+                QueueMisbehaving(pfrom->GetId(), 20);
                 return;
             }
         }
@@ -367,6 +311,33 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         pfrom->FulfilledRequest("mnget");
         masternodePayments.Sync(pfrom, nCountNeeded);
         LogPrint("mnpayments", "mnget - Sent Masternode winners to peer %i\n", pfrom->GetId());
+    } else if (strCommand == "mngetsum") { //Masternode Payments Request Sync of the votes missing from a summary
+        int nCountNeeded;
+        CSyncSummary summary;
+        vRecv >> nCountNeeded >> summary;
+
+        if (!summary.IsValid()) {
+            QueueMisbehaving(pfrom->GetId(), 20);
+            return;
+        }
+        if (Params().NetworkID() == CBaseChainParams::MAIN) {
+            if (pfrom->HasFulfilledRequest("mnget")) {
+                LogPrint("masternode","mngetsum - peer already asked me for the list\n");
+                QueueMisbehaving(pfrom->GetId(), 20);
+                return;
+            }
+        }
+        pfrom->FulfilledRequest("mnget");
+
+        std::vector<CInv> vInv, vInvMissing;
+        if (!masternodePayments.GetSyncInventory(nCountNeeded, vInv)) return;
+        summary.GetDifferences(vInv, vInvMissing);
+        BOOST_FOREACH (const CInv& inv, vInvMissing)
+            pfrom->PushInventory(inv);
+
+        // The count covers the votes the peer already has, as if it had been sent all of them
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_MNW, (int)vInv.size());
+        LogPrint("mnpayments", "mngetsum - Sent %d of %d Masternode winners to peer %i\n", vInvMissing.size(), vInv.size(), pfrom->GetId());
     } else if (strCommand == "mnw") { //Masternode Payments Declare Winner
         //this is required in litemodef
         CMasternodePaymentWinner winner;
@@ -406,7 +377,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
 
         if (!winner.SignatureValid()) {
             // LogPrint("masternode","mnw - invalid signature\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20);
+            if (masternodeSync.IsSynced()) QueueMisbehaving(pfrom->GetId(), 20);
             // it could just be a non-synced masternode
             mnodeman.AskForMN(pfrom, winner.vinMasternode);
             return;
@@ -430,9 +401,7 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -502,16 +471,93 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
 
         mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        AddBlockPayee(winnerIn.nBlockHeight, winnerIn.payee, 1);
+    }
 
-        if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
-            CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
-            mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
-        }
+    return true;
+}
+
+void CMasternodePayments::AddBlockPayee(int nBlockHeight, const CScript& payee, int nIncrement)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    if (!mapMasternodeBlocks.count(nBlockHeight)) {
+        CMasternodeBlockPayees blockPayees(nBlockHeight);
+        mapMasternodeBlocks[nBlockHeight] = blockPayees;
     }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+    CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[nBlockHeight];
+    blockPayees.AddPayee(payee, nIncrement);
+    if (blockPayees.HasPayeeWithVotes(payee, MNPAYMENTS_PAID_VOTES))
+        mapPayeePaidHeights[payee].insert(nBlockHeight);
+}
 
-    return true;
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nTipHeight, int nMaxDepth)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator mi = mapPayeePaidHeights.find(payee);
+    if (mi == mapPayeePaidHeights.end())
+        return 0;
+
+    // Heights above the tip are votes for blocks still to come (or disconnected ones), skip them
+    std::set<int>::const_iterator it = mi->second.upper_bound(nTipHeight);
+    if (it == mi->second.begin())
+        return 0;
+    --it;
+    if (*it <= 0 || *it <= nTipHeight - nMaxDepth)
+        return 0;
+    return *it;
+}
+
+void CMasternodePayments::Flush(CGovernanceDB& db)
+{
+    CLevelDBBatch batch;
+    db.paymentVotes.BeginPass();
+    db.paymentBlocks.BeginPass();
+
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        for (std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it)
+            db.paymentVotes.Write(batch, it->first, it->second, true);
+    }
+    {
+        LOCK2(cs_mapMasternodeBlocks, cs_vecPayments);
+        for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it)
+            db.paymentBlocks.Write(batch, it->first, it->second);
+    }
+
+    db.paymentVotes.EraseOthers(batch);
+    db.paymentBlocks.EraseOthers(batch);
+    db.WriteBatch(batch);
+
+    db.paymentVotes.Commit();
+    db.paymentBlocks.Commit();
+}
+
+void CMasternodePayments::Load(CGovernanceDB& db)
+{
+    {
+        LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+        mapMasternodePayeeVotes.clear();
+        mapMasternodeBlocks.clear();
+        db.ReadRecords(db.paymentVotes, mapMasternodePayeeVotes);
+        db.ReadRecords(db.paymentBlocks, mapMasternodeBlocks);
+    }
+    RebuildPaidHeightIndex();
+}
+
+void CMasternodePayments::RebuildPaidHeightIndex()
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_vecPayments);
+
+    mapPayeePaidHeights.clear();
+    for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        BOOST_FOREACH (const CMasternodePayee& payee, it->second.vecPayments) {
+            if (payee.nVotes >= MNPAYMENTS_PAID_VOTES)
+                mapPayeePaidHeights[payee.scriptPubKey].insert(it->first);
+        }
+    }
 }
 
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
@@ -641,7 +687,18 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
+            std::map<int, CMasternodeBlockPayees>::iterator mi = mapMasternodeBlocks.find(winner.nBlockHeight);
+            if (mi != mapMasternodeBlocks.end()) {
+                BOOST_FOREACH (const CMasternodePayee& payee, mi->second.vecPayments) {
+                    std::map<CScript, std::set<int> >::iterator pi = mapPayeePaidHeights.find(payee.scriptPubKey);
+                    if (pi == mapPayeePaidHeights.end())
+                        continue;
+                    pi->second.erase(winner.nBlockHeight);
+                    if (pi->second.empty())
+                        mapPayeePaidHeights.erase(pi);
+                }
+                mapMasternodeBlocks.erase(mi);
+            }
         } else {
             ++it;
         }
@@ -759,14 +816,19 @@ void CMasternodePaymentWinner::Relay()
     RelayInv(inv);
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePaymentWinner::SignatureValid()
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
@@ -780,30 +842,48 @@ bool CMasternodePaymentWinner::SignatureValid()
 }
 
 void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
+{
+    std::vector<CInv> vInv;
+    if (!GetSyncInventory(nCountNeeded, vInv)) return;
+
+    BOOST_FOREACH (const CInv& inv, vInv)
+        node->PushInventory(inv);
+    node->PushMessage("ssc", MASTERNODE_SYNC_MNW, (int)vInv.size());
+}
+
+bool CMasternodePayments::GetSyncInventory(int nCountNeeded, std::vector<CInv>& vInv)
 {
     LOCK(cs_mapMasternodePayeeVotes);
 
     int nHeight;
     {
         TRY_LOCK(cs_main, locked);
-        if (!locked || chainActive.Tip() == NULL) return;
+        if (!locked || chainActive.Tip() == NULL) return false;
         nHeight = chainActive.Tip()->nHeight;
     }
 
     int nCount = (mnodeman.CountEnabled() * 1.25);
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
-    int nInvCount = 0;
     std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
     while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
-            nInvCount++;
-        }
+        CMasternodePaymentWinner& winner = (*it).second;
+        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20)
+            vInv.push_back(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
         ++it;
     }
-    node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
+    return true;
+}
+
+void CMasternodePayments::RequestSync(CNode* pnode, int nCountNeeded)
+{
+    if (pnode->nVersion >= SYNC_SUMMARY_VERSION) {
+        std::vector<CInv> vInv;
+        GetSyncInventory(nCountNeeded, vInv);
+        pnode->PushMessage("mngetsum", nCountNeeded, CSyncSummary(vInv));
+    } else {
+        pnode->PushMessage("mnget", nCountNeeded);
+    }
 }
 
 std::string CMasternodePayments::ToString() const
@@ -18,6 +18,7 @@ extern CCriticalSection cs_vecPayments;
 extern CCriticalSection cs_mapMasternodeBlocks;
 extern CCriticalSection cs_mapMasternodePayeeVotes;
 
+class CGovernanceDB;
 class CMasternodePayments;
 class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
@@ -26,6 +27,8 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 4
 #define MNPAYMENTS_SIGNATURES_TOTAL 5
+// a payee counts as paid for a block once it has this many votes for it
+#define MNPAYMENTS_PAID_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -33,9 +36,7 @@ std::string GetRequiredPaymentsString(int nBlockHeight);
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted);
 void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
 
-void DumpMasternodePayments();
-
-/** Save Masternode Payment Data (mnpayments.dat)
+/** Access to mnpayments.dat, where the payment votes were kept before the governance database; read once to import them
  */
 class CMasternodePaymentDB
 {
@@ -55,7 +56,6 @@ public:
     };
 
     CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
     ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
 };
 
@@ -196,6 +196,8 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
     void Relay();
 
     void AddPayee(CScript payeeIn)
@@ -241,6 +243,11 @@ public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    // heights in mapMasternodeBlocks at which each payee has at least MNPAYMENTS_PAID_VOTES votes (protected by cs_mapMasternodeBlocks)
+    std::map<CScript, std::set<int> > mapPayeePaidHeights;
+
+    // serializes mnget/mnw handling, which may run on several message worker threads
+    CCriticalSection cs_process_message;
 
     CMasternodePayments()
     {
@@ -253,12 +260,27 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeePaidHeights.clear();
     }
 
+    /// Write the votes and block payees that changed since the last flush to the governance database
+    void Flush(CGovernanceDB& db);
+    /// Replace the votes and block payees with the ones in the governance database
+    void Load(CGovernanceDB& db);
+
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
+    void AddBlockPayee(int nBlockHeight, const CScript& payee, int nIncrement);
+    /** Height of the newest block at or below nTipHeight and within nMaxDepth blocks of it that pays payee, 0 if none */
+    int GetLastPaidHeight(const CScript& payee, int nTipHeight, int nMaxDepth);
+    void RebuildPaidHeightIndex();
     bool ProcessBlock(int nBlockHeight);
 
     void Sync(CNode* node, int nCountNeeded);
+    /// Announcements of the votes for the last nCountNeeded blocks and the next 20, which peers syncing votes get;
+    /// false if the chain was busy
+    bool GetSyncInventory(int nCountNeeded, std::vector<CInv>& vInv);
+    /// Ask a peer for the votes, or for the ones we lack if it answers sync summaries
+    void RequestSync(CNode* pnode, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
@@ -296,6 +318,8 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead())
+            RebuildPaidHeightIndex();
     }
 };
 
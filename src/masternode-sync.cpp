@@ -20,6 +20,35 @@
 class CMasternodeSync;
 CMasternodeSync masternodeSync;
 
+CSyncSummary::CSyncSummary(const std::vector<CInv>& vInv)
+{
+    vBuckets.resize(std::max((size_t)1, std::min((size_t)MAX_SYNC_SUMMARY_BUCKETS, vInv.size() / SYNC_SUMMARY_BUCKET_ITEMS)));
+    BOOST_FOREACH (const CInv& inv, vInv)
+        Add(inv.hash);
+}
+
+void CSyncSummary::Add(const uint256& hash)
+{
+    std::pair<uint32_t, uint64_t>& bucket = vBuckets[GetBucket(hash)];
+    bucket.first++;
+    // The bucket index comes from the low bits, so summarize with others
+    bucket.second ^= hash.Get64(1);
+}
+
+void CSyncSummary::GetDifferences(const std::vector<CInv>& vInv, std::vector<CInv>& vInvRet) const
+{
+    CSyncSummary summary;
+    summary.vBuckets.resize(vBuckets.size());
+    BOOST_FOREACH (const CInv& inv, vInv)
+        summary.Add(inv.hash);
+
+    BOOST_FOREACH (const CInv& inv, vInv) {
+        unsigned int nBucket = GetBucket(inv.hash);
+        if (summary.vBuckets[nBucket] != vBuckets[nBucket])
+            vInvRet.push_back(inv);
+    }
+}
+
 CMasternodeSync::CMasternodeSync()
 {
     Reset();
@@ -63,6 +92,7 @@ bool CMasternodeSync::IsBlockchainSynced()
 
 void CMasternodeSync::Reset()
 {
+    LOCK(cs);
     lastMasternodeList = 0;
     lastMasternodeWinner = 0;
     lastBudgetItem = 0;
@@ -86,6 +116,7 @@ void CMasternodeSync::Reset()
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
 {
+    LOCK(cs);
     if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
         if (mapSeenSyncMNB[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeList = GetTime();
@@ -99,6 +130,7 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
 
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
+    LOCK(cs);
     if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
         if (mapSeenSyncMNW[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeWinner = GetTime();
@@ -112,6 +144,7 @@ void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 
 void CMasternodeSync::AddedBudgetItem(uint256 hash)
 {
+    LOCK(cs);
     if (budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
         budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash)) {
         if (mapSeenSyncBudget[hash] < MASTERNODE_SYNC_THRESHOLD) {
@@ -188,29 +221,38 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
         int nCount;
         vRecv >> nItemID >> nCount;
 
+        LOCK(cs);
         if (RequestedMasternodeAssets >= MASTERNODE_SYNC_FINISHED) return;
 
+        // Peers answering sync summaries only announce what we lack, their count stands for the items we
+        // already had, so it counts as sync progress like the announcements would have
+        bool fSummary = pfrom->nVersion >= SYNC_SUMMARY_VERSION && nCount > 0;
+
         //this means we will receive no further communication
         switch (nItemID) {
         case (MASTERNODE_SYNC_LIST):
             if (nItemID != RequestedMasternodeAssets) return;
             sumMasternodeList += nCount;
             countMasternodeList++;
+            if (fSummary) lastMasternodeList = GetTime();
             break;
         case (MASTERNODE_SYNC_MNW):
             if (nItemID != RequestedMasternodeAssets) return;
             sumMasternodeWinner += nCount;
             countMasternodeWinner++;
+            if (fSummary) lastMasternodeWinner = GetTime();
             break;
         case (MASTERNODE_SYNC_BUDGET_PROP):
             if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
             sumBudgetItemProp += nCount;
             countBudgetItemProp++;
+            if (fSummary) lastBudgetItem = GetTime();
             break;
         case (MASTERNODE_SYNC_BUDGET_FIN):
             if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
             sumBudgetItemFin += nCount;
             countBudgetItemFin++;
+            if (fSummary) lastBudgetItem = GetTime();
             break;
         }
 
@@ -273,9 +315,8 @@ void CMasternodeSync::Process()
                 mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 6) {
                 int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
-                uint256 n = 0;
-                pnode->PushMessage("mnvs", n); //sync masternode votes
+                masternodePayments.RequestSync(pnode, nMnCount); //sync payees
+                budget.RequestSync(pnode); //sync masternode votes
             } else {
                 RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
             }
@@ -358,7 +399,7 @@ void CMasternodeSync::Process()
                 if (pindexPrev == NULL) return;
 
                 int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
+                masternodePayments.RequestSync(pnode, nMnCount); //sync payees
                 RequestedMasternodeAttempt++;
 
                 return;
@@ -394,8 +435,7 @@ void CMasternodeSync::Process()
 
                 if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
 
-                uint256 n = 0;
-                pnode->PushMessage("mnvs", n); //sync masternode votes
+                budget.RequestSync(pnode); //sync masternode votes
                 RequestedMasternodeAttempt++;
 
                 return;
@@ -7,6 +7,12 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "protocol.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <vector>
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -20,9 +26,45 @@
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
 
+/** Average number of items a sync summary bucket stands for */
+static const unsigned int SYNC_SUMMARY_BUCKET_ITEMS = 8;
+static const unsigned int MAX_SYNC_SUMMARY_BUCKETS = 65536;
+
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
 
+/**
+ * Hash summary of the masternode-layer items a node has, sent by SYNC_SUMMARY_VERSION peers in place of a
+ * full list request. Items are split into buckets by hash; each bucket is summed up by its item count and the
+ * XOR of its item hashes. The peer answering only announces the items of the buckets whose summary differs from
+ * its own, so an up to date node downloads a few buckets instead of the whole list.
+ */
+class CSyncSummary
+{
+public:
+    //! (item count, XOR of the item hashes) per bucket
+    std::vector<std::pair<uint32_t, uint64_t> > vBuckets;
+
+    CSyncSummary() {}
+    explicit CSyncSummary(const std::vector<CInv>& vInv);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(vBuckets);
+    }
+
+    bool IsValid() const { return !vBuckets.empty() && vBuckets.size() <= MAX_SYNC_SUMMARY_BUCKETS; }
+    //! Select the items of vInv, the answering node's items, that fall into buckets this summary disagrees on
+    void GetDifferences(const std::vector<CInv>& vInv, std::vector<CInv>& vInvRet) const;
+
+private:
+    void Add(const uint256& hash);
+    unsigned int GetBucket(const uint256& hash) const { return hash.GetLow64() % vBuckets.size(); }
+};
+
 //
 // CMasternodeSync : Sync masternode assets in stages
 //
@@ -30,6 +72,9 @@ extern CMasternodeSync masternodeSync;
 class CMasternodeSync
 {
 public:
+    // protects the seen maps and the counters updated from the message workers
+    CCriticalSection cs;
+
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
     std::map<uint256, int> mapSeenSyncBudget;
@@ -6,6 +6,7 @@
 
 #include "masternode.h"
 #include "addrman.h"
+#include "lpctx.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "sync.h"
@@ -16,6 +17,8 @@
 map<uint256, int> mapSeenMasternodeScanningErrors;
 // cache block hashes as we calculate them
 std::map<int64_t, uint256> mapCacheBlockHashes;
+// spent state of the masternode collaterals
+CCollateralWatcher collateralWatcher;
 
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
@@ -146,6 +149,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         protocolVersion = mnb.protocolVersion;
         addr = mnb.addr;
         lastTimeChecked = 0;
+        mnodeman.NotifyMasternodeUpdates(true);
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
@@ -166,7 +170,6 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     if (chainActive.Tip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
@@ -175,16 +178,25 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
-    uint256 hash2 = ss.GetHash();
 
-    CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
-    ss2 << hash;
-    ss2 << aux;
-    uint256 hash3 = ss2.GetHash();
+    return CalculateScore(hash, ss.GetHash());
+}
+
+uint256 CMasternode::CalculateScore(const uint256& hashBlock, const uint256& hashBlockHash) const
+{
+    return CalculateScore(vin.prevout, hashBlock, hashBlockHash);
+}
 
-    uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
+uint256 CMasternode::CalculateScore(const COutPoint& outpoint, const uint256& hashBlock, const uint256& hashBlockHash)
+{
+    uint256 aux = outpoint.hash + outpoint.n;
 
-    return r;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    ss << aux;
+    uint256 hash3 = ss.GetHash();
+
+    return (hash3 > hashBlockHash ? hash3 - hashBlockHash : hashBlockHash - hash3);
 }
 
 void CMasternode::Check(bool forceCheck)
@@ -194,7 +206,14 @@ void CMasternode::Check(bool forceCheck)
     if (!forceCheck && (GetTime() - lastTimeChecked < MASTERNODE_CHECK_SECONDS)) return;
     lastTimeChecked = GetTime();
 
+    int nActiveStatePrev = activeState;
+    UpdateActiveState();
+    if (activeState != nActiveStatePrev)
+        mnodeman.NotifyMasternodeUpdates();
+}
 
+void CMasternode::UpdateActiveState()
+{
     //once spent, stop doing the checks
     if (activeState == MASTERNODE_VIN_SPENT) return;
 
@@ -210,32 +229,131 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut((Params().MasternodeCollateral() - 0.01) * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+        bool fSpent;
+        // cs_main is busy, keep the state we have
+        if (!collateralWatcher.IsSpent(vin.prevout, fSpent)) return;
 
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
+        if (fSpent) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
+        }
+    }
+
+    activeState = MASTERNODE_ENABLED; // OK
+}
+
+void CCollateralWatcher::MarkSpent(const CTransaction& tx, bool fFinal)
+{
+    LOCK(cs);
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        std::map<COutPoint, bool>::iterator it = mapCollateral.find(txin.prevout);
+        if (it == mapCollateral.end() || it->second) continue;
+
+        LogPrint("masternode", "CCollateralWatcher -- collateral %s spent by %s%s\n", txin.prevout.ToString(), tx.GetHash().ToString(), fFinal ? "" : " in the mempool");
+        if (fFinal) {
+            it->second = true;
+            mapMempoolSpends.erase(txin.prevout);
+        } else {
+            mapMempoolSpends[txin.prevout] = tx.GetHash();
+        }
+        // rank tables built since then still count the masternode as enabled
+        mnodeman.NotifyMasternodeUpdates();
+    }
+}
 
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
+void CCollateralWatcher::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    // Confirming spends the collateral for good. Entering the mempool, or coming back from a disconnected
+    // block, only as long as the transaction stays there, just like the old fake spend conflicted with it.
+    MarkSpent(tx, pblock != NULL);
+}
+
+void CCollateralWatcher::NotifyTransactionLock(const CTransaction& tx)
+{
+    MarkSpent(tx, true);
+}
+
+bool CCollateralWatcher::IsSpent(const COutPoint& outpoint, bool& fSpent)
+{
+    bool fWatched = false;
+    {
+        LOCK(cs);
+        std::map<COutPoint, bool>::const_iterator it = mapCollateral.find(outpoint);
+        if (it != mapCollateral.end()) {
+            if (it->second || !mapMempoolSpends.count(outpoint)) {
+                fSpent = it->second;
+                return true;
             }
+            fWatched = true;
         }
     }
 
-    activeState = MASTERNODE_ENABLED; // OK
+    // Transactions are only announced with cs_main held, so none can slip by between the lookup and watching
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) return false;
+
+    if (fWatched) {
+        // The mempool doesn't say when it drops a transaction, so see whether the spend is still there
+        uint256 hashSpender;
+        {
+            LOCK(cs);
+            std::map<COutPoint, uint256>::const_iterator mi = mapMempoolSpends.find(outpoint);
+            if (mi != mapMempoolSpends.end())
+                hashSpender = mi->second;
+        }
+        bool fInMempool = !hashSpender.IsNull() && mempool.exists(hashSpender);
+
+        LOCK(cs);
+        if (!fInMempool && mapMempoolSpends.erase(outpoint))
+            LogPrint("masternode", "CCollateralWatcher -- collateral %s no longer spent by %s\n", outpoint.ToString(), hashSpender.ToString());
+        std::map<COutPoint, bool>::const_iterator it = mapCollateral.find(outpoint);
+        fSpent = (it != mapCollateral.end() && it->second) || mapMempoolSpends.count(outpoint);
+        return true;
+    }
+
+    bool fFinal = txLockManager.IsInputLocked(outpoint);
+    uint256 hashSpender;
+    if (!fFinal) {
+        // The collateral has to cover the same output the old fake spend created
+        CCoins coins;
+        fFinal = !pcoinsTip->GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n) ||
+                 coins.vout[outpoint.n].nValue < (Params().MasternodeCollateral() - 0.01) * COIN;
+    }
+    if (!fFinal) {
+        LOCK(mempool.cs);
+        std::map<COutPoint, CInPoint>::const_iterator it = mempool.mapNextTx.find(outpoint);
+        if (it != mempool.mapNextTx.end())
+            hashSpender = it->second.ptx->GetHash();
+    }
+
+    LOCK(cs);
+    mapCollateral[outpoint] = fFinal;
+    if (!hashSpender.IsNull())
+        mapMempoolSpends[outpoint] = hashSpender;
+    fSpent = fFinal || !hashSpender.IsNull();
+    return true;
+}
+
+void CCollateralWatcher::Unwatch(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    mapCollateral.erase(outpoint);
+    mapMempoolSpends.erase(outpoint);
 }
 
-int64_t CMasternode::SecondsSincePayment()
+void CCollateralWatcher::Clear()
+{
+    LOCK(cs);
+    mapCollateral.clear();
+    mapMempoolSpends.clear();
+}
+
+int64_t CMasternode::SecondsSincePayment(int nMnCount)
 {
     CScript pubkeyScript;
     pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMnCount));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -248,7 +366,7 @@ int64_t CMasternode::SecondsSincePayment()
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasternode::GetLastPaid()
+int64_t CMasternode::GetLastPaid(int nMnCount)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -264,36 +382,16 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
+    if (nMnCount < 0) nMnCount = mnodeman.CountEnabled();
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    /*
+        Search the last 1.25 payment cycles for this payee, with at least 2 votes. This will aid in consensus
+        allowing the network to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexPrev->nHeight, (int)(nMnCount * 1.25));
+    if (nHeight == 0) return 0;
 
-    return 0;
+    return chainActive[nHeight]->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -481,9 +579,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         return false;
     }
 
-    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
-    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
         LogPrint("masternode","mnb - ignoring outdated Masternode %s protocol version %d\n", vin.prevout.hash.ToString(), protocolVersion);
@@ -650,12 +746,9 @@ bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
 {
     std::string errorMessage;
 
-    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
-    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
-
     sigTime = GetAdjustedTime();
 
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, sig, keyCollateralAddress)) {
         LogPrint("masternode","CMasternodeBroadcast::Sign() - Error: %s\n", errorMessage);
@@ -670,6 +763,14 @@ bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
     return true;
 }
 
+std::string CMasternodeBroadcast::GetStrMessage() const
+{
+    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
+    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
+
+    return addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+}
+
 CMasternodePing::CMasternodePing()
 {
     vin = CTxIn();
@@ -693,7 +794,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -708,6 +809,11 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+}
+
 bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
 {
     if (sigTime > GetAdjustedTime() + 60 * 60) {
@@ -733,7 +839,7 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
         // update only if there is no known ping for this masternode or
         // last ping was more then MASTERNODE_MIN_MNP_SECONDS-60 ago comparing to this one
         if (!pmn->IsPingedWithin(MASTERNODE_MIN_MNP_SECONDS - 60, sigTime)) {
-            std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+            std::string strMessage = GetStrMessage();
 
             std::string errorMessage = "";
             if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
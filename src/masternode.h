@@ -14,6 +14,7 @@
 #include "sync.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 15
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -32,6 +33,36 @@ extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
+/**
+ * Tracks whether masternode collaterals are spent. Each collateral is looked up in the UTXO set
+ * and mempool once, after that the transactions the node sees (mempool, blocks, SwiftX locks)
+ * flag the ones that get spent. A spend that is only in the mempool counts as long as it stays there.
+ */
+class CCollateralWatcher : public CValidationInterface
+{
+private:
+    CCriticalSection cs;
+    // watched collateral outpoints, true once spent by a block or a SwiftX lock
+    std::map<COutPoint, bool> mapCollateral;
+    // watched collateral outpoints spent by a mempool transaction only, and that transaction
+    std::map<COutPoint, uint256> mapMempoolSpends;
+
+    void MarkSpent(const CTransaction& tx, bool fFinal);
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void NotifyTransactionLock(const CTransaction& tx);
+
+public:
+    /// Whether outpoint is spent, in fSpent. An unknown outpoint is looked up and watched from then on.
+    /// False if that lookup, or checking a mempool spend, needs cs_main while it is busy; ask again later.
+    bool IsSpent(const COutPoint& outpoint, bool& fSpent);
+    void Unwatch(const COutPoint& outpoint);
+    void Clear();
+};
+
+extern CCollateralWatcher collateralWatcher;
+
 
 //
 // The Masternode Ping Class : Contains a different serialize method for sending pings from masternodes throughout the network
@@ -62,6 +93,8 @@ public:
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -111,6 +144,8 @@ private:
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
 
+    void UpdateActiveState();
+
 public:
     enum state {
         MASTERNODE_PRE_ENABLED,
@@ -192,6 +227,10 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    /// Score against the block hashBlock, where hashBlockHash = Hash(hashBlock) is the same for every Masternode
+    uint256 CalculateScore(const uint256& hashBlock, const uint256& hashBlockHash) const;
+    /// The same score for the Masternode with this collateral outpoint, which is all it depends on
+    static uint256 CalculateScore(const COutPoint& outpoint, const uint256& hashBlock, const uint256& hashBlockHash);
 
     ADD_SERIALIZE_METHODS;
 
@@ -218,7 +257,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -281,7 +320,8 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    /// nMnCount is the number of enabled masternodes, counted here if not given
+    int64_t GetLastPaid(int nMnCount = -1);
     bool IsValidNetAddr();
 };
 
@@ -300,6 +340,8 @@ public:
     bool CheckAndUpdate(int& nDoS);
     bool CheckInputsAndAdd(int& nDos);
     bool Sign(CKey& keyCollateralAddress);
+    /// The message the collateral key signs
+    std::string GetStrMessage() const;
     void Relay();
 
     ADD_SERIALIZE_METHODS;
@@ -7,12 +7,16 @@
 #include "masternodeman.h"
 #include "activemasternode.h"
 #include "addrman.h"
+#include "checkqueue.h"
+#include "governancedb.h"
 #include "masternode.h"
 #include "obfuscation.h"
 #include "spork.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
 
@@ -20,8 +24,8 @@
 CMasternodeMan mnodeman;
 
 struct CompareLastPaid {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -36,8 +40,8 @@ struct CompareScoreTxIn {
 };
 
 struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+    bool operator()(const pair<int64_t, COutPoint>& t1,
+        const pair<int64_t, COutPoint>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -53,39 +57,6 @@ CMasternodeDB::CMasternodeDB()
     strMagicMessage = "MasternodeCache";
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
-{
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
-
-    return true;
-}
-
 CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
@@ -167,34 +138,7 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     return Ok;
 }
 
-void DumpMasternodes()
-{
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
-
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
-}
-
-CMasternodeMan::CMasternodeMan()
+CMasternodeMan::CMasternodeMan() : fKeyIndexDirty(false), nListVersion(0), pAddrCache(new std::set<CNetAddr>()), nAddrCacheVersion(0)
 {
     nDsqCount = 0;
 }
@@ -209,7 +153,11 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        listMasternodes.push_back(mn);
+        pmn = &listMasternodes.back();
+        mapByOutpoint.insert(make_pair(pmn->vin.prevout, pmn));
+        IndexKeys(pmn);
+        NotifyMasternodeUpdates();
         return true;
     }
 
@@ -236,7 +184,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -248,8 +196,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -279,7 +227,10 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            collateralWatcher.Unwatch((*it).vin.prevout);
+            mapByOutpoint.erase((*it).vin.prevout);
+            it = listMasternodes.erase(it);
+            NotifyMasternodeUpdates(true);
         } else {
             ++it;
         }
@@ -340,15 +291,98 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapByOutpoint.clear();
+    mapByPubKey.clear();
+    mapByPayee.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mapRankTables.clear();
+    collateralWatcher.Clear();
+    NotifyMasternodeUpdates();
     nDsqCount = 0;
 }
 
+void CMasternodeMan::Flush(CGovernanceDB& db)
+{
+    CLevelDBBatch batch;
+    db.masternodes.BeginPass();
+    db.masternodeOrder.BeginPass();
+    db.masternodeRequests.BeginPass();
+    db.seenMasternodeBroadcasts.BeginPass();
+    db.seenMasternodePings.BeginPass();
+
+    {
+        LOCK2(cs_process_message, cs);
+        std::vector<COutPoint> vOrder;
+        vOrder.reserve(listMasternodes.size());
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+            db.masternodes.Write(batch, mn.vin.prevout, mn);
+            vOrder.push_back(mn.vin.prevout);
+        }
+        // only rewritten when an entry is added or removed
+        db.masternodeOrder.Write(batch, 0, vOrder);
+        db.masternodeRequests.Write(batch, 0, mAskedUsForMasternodeList);
+        db.masternodeRequests.Write(batch, 1, mWeAskedForMasternodeList);
+        db.masternodeRequests.Write(batch, 2, mWeAskedForMasternodeListEntry);
+        db.masternodeRequests.Write(batch, 3, nDsqCount);
+
+        // broadcasts carry the last ping and change with it, pings never do
+        for (map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it)
+            db.seenMasternodeBroadcasts.Write(batch, it->first, it->second);
+        for (map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+            db.seenMasternodePings.Write(batch, it->first, it->second, true);
+    }
+
+    db.masternodes.EraseOthers(batch);
+    db.masternodeOrder.EraseOthers(batch);
+    db.masternodeRequests.EraseOthers(batch);
+    db.seenMasternodeBroadcasts.EraseOthers(batch);
+    db.seenMasternodePings.EraseOthers(batch);
+    db.WriteBatch(batch);
+
+    db.masternodes.Commit();
+    db.masternodeOrder.Commit();
+    db.masternodeRequests.Commit();
+    db.seenMasternodeBroadcasts.Commit();
+    db.seenMasternodePings.Commit();
+}
+
+void CMasternodeMan::Load(CGovernanceDB& db)
+{
+    std::map<COutPoint, CMasternode> mapMasternodes;
+    db.ReadRecords(db.masternodes, mapMasternodes);
+    std::vector<COutPoint> vOrder;
+    db.ReadRecord(db.masternodeOrder, 0, vOrder);
+
+    LOCK2(cs_process_message, cs);
+    listMasternodes.clear();
+    mapByOutpoint.clear();
+    // back in the order they were added; any entry the order misses goes last
+    BOOST_FOREACH (const COutPoint& outpoint, vOrder) {
+        std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.find(outpoint);
+        if (it == mapMasternodes.end()) continue;
+        listMasternodes.push_back(it->second);
+        mapByOutpoint.insert(std::make_pair(it->first, &listMasternodes.back()));
+        mapMasternodes.erase(it);
+    }
+    for (std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it) {
+        listMasternodes.push_back(it->second);
+        mapByOutpoint.insert(std::make_pair(it->first, &listMasternodes.back()));
+    }
+    db.ReadRecord(db.masternodeRequests, 0, mAskedUsForMasternodeList);
+    db.ReadRecord(db.masternodeRequests, 1, mWeAskedForMasternodeList);
+    db.ReadRecord(db.masternodeRequests, 2, mWeAskedForMasternodeListEntry);
+    db.ReadRecord(db.masternodeRequests, 3, nDsqCount);
+    db.ReadRecords(db.seenMasternodeBroadcasts, mapSeenMasternodeBroadcast);
+    db.ReadRecords(db.seenMasternodePings, mapSeenMasternodePing);
+    NotifyMasternodeUpdates(true);
+    UpdateAddressCache();
+}
+
 int CMasternodeMan::stable_size ()
 {
     int nStable_size = 0;
@@ -356,7 +390,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -381,7 +415,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -394,7 +428,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -415,6 +449,67 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
     }
 }
 
+boost::shared_ptr<const std::set<CNetAddr> > CMasternodeMan::GetMasternodeAddresses() const
+{
+    LOCK(cs_addrCache);
+    return pAddrCache;
+}
+
+void CMasternodeMan::UpdateAddressCache()
+{
+    if (nAddrCacheVersion == nListVersion)
+        return;
+
+    LOCK(cs);
+    // A change made while the set is built bumps nListVersion again and gets picked up next time
+    uint64_t nVersion = nListVersion;
+    boost::shared_ptr<std::set<CNetAddr> > pAddr(new std::set<CNetAddr>());
+    BOOST_FOREACH (const CMasternode& mn, listMasternodes)
+        pAddr->insert(mn.addr);
+    {
+        LOCK(cs_addrCache);
+        pAddrCache = pAddr;
+    }
+    nAddrCacheVersion = nVersion;
+}
+
+bool CMasternodeMan::AllowListRequest(CNode* pfrom)
+{
+    //local network
+    bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
+
+    if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
+        std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+        if (i != mAskedUsForMasternodeList.end()) {
+            int64_t t = (*i).second;
+            if (GetTime() < t) {
+                QueueMisbehaving(pfrom->GetId(), 34);
+                LogPrint("masternode","dseg - peer already asked me for the list\n");
+                return false;
+            }
+        }
+        int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
+        mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+    }
+    return true;
+}
+
+void CMasternodeMan::GetSyncInventory(std::vector<CInv>& vInv, bool fServe)
+{
+    if (fServe) AssertLockHeld(cs_process_message);
+    LOCK(cs);
+
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.addr.IsRFC1918() || !mn.IsEnabled()) continue;
+
+        CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+        uint256 hash = mnb.GetHash();
+        vInv.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+
+        if (fServe && !mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+    }
+}
+
 void CMasternodeMan::DsegUpdate(CNode* pnode)
 {
     LOCK(cs);
@@ -431,33 +526,50 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
         }
     }
 
-    pnode->PushMessage("dseg", CTxIn());
+    if (pnode->nVersion >= SYNC_SUMMARY_VERSION) {
+        std::vector<CInv> vInv;
+        GetSyncInventory(vInv, false);
+        pnode->PushMessage("dsegsum", CSyncSummary(vInv));
+    } else {
+        pnode->PushMessage("dseg", CTxIn());
+    }
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+void CMasternodeMan::IndexKeys(CMasternode* pmn)
+{
+    CScript payee = GetScriptForDestination(pmn->pubKeyCollateralAddress.GetID());
+    mapByPubKey.insert(make_pair(pmn->pubKeyMasternode.GetHash(), pmn));
+    mapByPayee.insert(make_pair(Hash(payee.begin(), payee.end()), pmn));
+}
+
+void CMasternodeMan::RebuildKeyIndexes()
+{
+    AssertLockHeld(cs);
+
+    fKeyIndexDirty = false;
+    mapByPubKey.clear();
+    mapByPayee.clear();
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        IndexKeys(&mn);
+}
+
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    if (fKeyIndexDirty) RebuildKeyIndexes();
+    flatmap<uint256, CMasternode*, CMasternodeKeyHasher>::iterator it = mapByPayee.find(Hash(payee.begin(), payee.end()));
+    return it != mapByPayee.end() ? it->second : NULL;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    flatmap<COutPoint, CMasternode*, COutPointHasher>::iterator it = mapByOutpoint.find(vin.prevout);
+    return it != mapByOutpoint.end() ? it->second : NULL;
 }
 
 
@@ -465,11 +577,9 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    if (fKeyIndexDirty) RebuildKeyIndexes();
+    flatmap<uint256, CMasternode*, CMasternodeKeyHasher>::iterator it = mapByPubKey.find(pubKeyMasternode.GetHash());
+    return it != mapByPubKey.end() ? it->second : NULL;
 }
 
 //
@@ -480,14 +590,14 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     LOCK(cs);
 
     CMasternode* pBestMasternode = NULL;
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeLastPaid;
+    std::vector<pair<int64_t, CMasternode*> > vecMasternodeLastPaid;
 
     /*
         Make a vector with all of the last paid times
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -503,7 +613,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), &mn));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -518,12 +628,11 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
+    int nTenthNetwork = nMnCount / 10;
     int nCountTenth = 0;
     uint256 nHigh = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
-        CMasternode* pmn = Find(s.second);
-        if (!pmn) break;
+    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode*) & s, vecMasternodeLastPaid) {
+        CMasternode* pmn = s.second;
 
         uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
         if (n > nHigh) {
@@ -550,7 +659,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -574,7 +683,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -592,85 +701,184 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+/** Score vecScores[nBegin, nEnd) entries that are still -1, the others were ranked without a score */
+static void ScoreMasternodes(std::vector<pair<int64_t, COutPoint> >& vecScores, size_t nBegin, size_t nEnd,
+                             const uint256& hashBlock, const uint256& hashBlockHash)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
-    int64_t nMasternode_Age = 0;
+    for (size_t i = nBegin; i < nEnd; i++) {
+        if (vecScores[i].first == -1)
+            vecScores[i].first = CMasternode::CalculateScore(vecScores[i].second, hashBlock, hashBlockHash).GetCompact(false);
+    }
+}
+
+/** One chunk of a rank table to score, handed to the score threads */
+class CMasternodeScoreCheck
+{
+private:
+    std::vector<pair<int64_t, COutPoint> >* pvecScores;
+    size_t nBegin;
+    size_t nEnd;
+    uint256 hashBlock;
+    uint256 hashBlockHash;
+
+public:
+    CMasternodeScoreCheck() : pvecScores(NULL), nBegin(0), nEnd(0) {}
+    CMasternodeScoreCheck(std::vector<pair<int64_t, COutPoint> >& vecScoresIn, size_t nBeginIn, size_t nEndIn,
+                          const uint256& hashBlockIn, const uint256& hashBlockHashIn) : pvecScores(&vecScoresIn), nBegin(nBeginIn), nEnd(nEndIn),
+                                                                                       hashBlock(hashBlockIn), hashBlockHash(hashBlockHashIn) {}
+
+    bool operator()()
+    {
+        ScoreMasternodes(*pvecScores, nBegin, nEnd, hashBlock, hashBlockHash);
+        return true;
+    }
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    void swap(CMasternodeScoreCheck& check)
+    {
+        std::swap(pvecScores, check.pvecScores);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(hashBlock, check.hashBlock);
+        std::swap(hashBlockHash, check.hashBlockHash);
+    }
+};
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
-        }
+static CCheckQueue<CMasternodeScoreCheck> scorecheckqueue(1);
+/** Held by the one rank table build that uses scorecheckqueue; builds that find it taken score on their own thread */
+static CCriticalSection cs_scorecheckqueue;
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = GetAdjustedTime() - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
-                if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
+void ThreadMasternodeScore()
+{
+    RenameThread("lapo-mnscore");
+    scorecheckqueue.Thread();
+}
+
+void CMasternodeMan::UpdateRankTable(int64_t nBlockHeight, int minProtocol, int nFlags)
+{
+    uint256 hashBlock = 0;
+    std::pair<int64_t, std::pair<int, int> > key = make_pair(nBlockHeight, make_pair(minProtocol, nFlags));
+    // (score, collateral outpoint) in list order; the masternodes are looked up again once the table is swapped in
+    std::vector<pair<int64_t, COutPoint> > vecScores;
+    int64_t nValidUntil = std::numeric_limits<int64_t>::max();
+    uint64_t nVersion;
+    {
+        LOCK(cs);
+
+        //make sure we know about this block
+        if (!GetBlockHash(hashBlock, nBlockHeight)) return;
+
+        std::map<std::pair<int64_t, std::pair<int, int> >, CMasternodeRankTable>::iterator it = mapRankTables.find(key);
+        if (it != mapRankTables.end() && it->second.hashBlock == hashBlock && it->second.nListVersion == nListVersion &&
+            GetAdjustedTime() < it->second.nValidUntil)
+            return;
+
+        int64_t nNow = GetAdjustedTime();
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+            if (mn.protocolVersion < minProtocol) continue;
+
+            if ((nFlags & RANK_MIN_AGE) && nNow - mn.sigTime < MN_WINNER_MINIMUM_AGE) {
+                nValidUntil = std::min(nValidUntil, mn.sigTime + MN_WINNER_MINIMUM_AGE);
+                continue;                                                       // Skip masternodes younger than (default) 1 hour
             }
+            if (nFlags & (RANK_ONLY_ACTIVE | RANK_DISABLED_LAST)) {
+                // The table is only rebuilt when the list changes, so don't rely on a check from a while ago
+                mn.Check(true);
+                if (!mn.IsEnabled()) {
+                    if (nFlags & RANK_DISABLED_LAST)
+                        vecScores.push_back(make_pair(9999, mn.vin.prevout));
+                    continue;
+                }
+                // Expiring is the one change no event announces, a spent collateral is announced by the watcher
+                nValidUntil = std::min(nValidUntil, mn.lastPing.sigTime + MASTERNODE_EXPIRATION_SECONDS);
+            }
+            vecScores.push_back(make_pair(-1, mn.vin.prevout));
         }
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+        // Read after the checks above: a state change they cause is already part of this table
+        nVersion = nListVersion;
+    }
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+    // Hash(hashBlock) is shared by all scores, only the outpoint part needs hashing per masternode
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    uint256 hashBlockHash = ss.GetHash();
+
+    // The score threads run alongside the script check threads, one fewer than -par as this thread helps out
+    bool fParallel = false;
+    if (vecScores.size() >= MASTERNODE_RANK_PARALLEL_MIN && nScriptCheckThreads > 1) {
+        TRY_LOCK(cs_scorecheckqueue, lockQueue);
+        if (lockQueue) {
+            size_t nChunk = (vecScores.size() + nScriptCheckThreads - 1) / nScriptCheckThreads;
+            std::vector<CMasternodeScoreCheck> vChecks;
+            for (size_t nBegin = 0; nBegin < vecScores.size(); nBegin += nChunk)
+                vChecks.push_back(CMasternodeScoreCheck(vecScores, nBegin, std::min(nBegin + nChunk, vecScores.size()), hashBlock, hashBlockHash));
+            CCheckQueueControl<CMasternodeScoreCheck> control(&scorecheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+            fParallel = true;
+        }
     }
+    if (!fParallel)
+        ScoreMasternodes(vecScores, 0, vecScores.size(), hashBlock, hashBlockHash);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(vecScores.rbegin(), vecScores.rend(), CompareScoreMN());
 
+    LOCK(cs);
+    if (!mapRankTables.count(key) && mapRankTables.size() >= MASTERNODE_RANK_TABLES_MAX)
+        mapRankTables.erase(mapRankTables.begin());
+    CMasternodeRankTable& table = mapRankTables[key];
+    table.hashBlock = hashBlock;
+    // A masternode added or removed meanwhile moved nListVersion on, so the next lookup builds the table again
+    table.nListVersion = nVersion;
+    table.nValidUntil = nValidUntil;
+    table.vecScores.clear();
+    table.mapRank.clear();
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
+    for (size_t i = 0; i < vecScores.size(); i++) {
+        flatmap<COutPoint, CMasternode*, COutPointHasher>::iterator itMN = mapByOutpoint.find(vecScores[i].second);
+        if (itMN == mapByOutpoint.end()) continue;
         rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        table.vecScores.push_back(make_pair(vecScores[i].first, itMN->second));
+        table.mapRank.insert(make_pair(vecScores[i].second, rank));
     }
-
-    return -1;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+const CMasternodeRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, int nFlags)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    AssertLockHeld(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    uint256 hashBlock = 0;
+    if (!GetBlockHash(hashBlock, nBlockHeight)) return NULL;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
+    std::map<std::pair<int64_t, std::pair<int, int> >, CMasternodeRankTable>::const_iterator it = mapRankTables.find(make_pair(nBlockHeight, make_pair(minProtocol, nFlags)));
+    return it != mapRankTables.end() && it->second.hashBlock == hashBlock ? &it->second : NULL;
+}
 
-        if (mn.protocolVersion < minProtocol) continue;
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    int nFlags = (fOnlyActive ? RANK_ONLY_ACTIVE : 0) | (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) ? RANK_MIN_AGE : 0);
+    UpdateRankTable(nBlockHeight, minProtocol, nFlags);
 
-        if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
-            continue;
-        }
+    LOCK(cs);
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, nFlags);
+    if (!pTable) return -1;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    flatmap<COutPoint, int, COutPointHasher>::const_iterator it = pTable->mapRank.find(vin.prevout);
+    return it != pTable->mapRank.end() ? it->second : -1;
+}
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    UpdateRankTable(nBlockHeight, minProtocol, RANK_DISABLED_LAST);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    LOCK(cs);
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, RANK_DISABLED_LAST);
+    if (!pTable) return vecMasternodeRanks;
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, pTable->vecScores) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, *s.second));
     }
 
     return vecMasternodeRanks;
@@ -678,33 +886,13 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
+    UpdateRankTable(nBlockHeight, minProtocol, fOnlyActive ? RANK_ONLY_ACTIVE : 0);
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    LOCK(cs);
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive ? RANK_ONLY_ACTIVE : 0);
+    if (!pTable || nRank < 1 || nRank > (int)pTable->vecScores.size()) return NULL;
 
-    return NULL;
+    return pTable->vecScores[nRank - 1].second;
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -743,7 +931,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
             if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+                QueueMisbehaving(pfrom->GetId(), nDoS);
 
             //failed
             return;
@@ -753,7 +941,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         //  - this is expensive, so it's only done once per Masternode
         if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
             LogPrint("masternode","mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
+            QueueMisbehaving(pfrom->GetId(), 33);
             return;
         }
 
@@ -767,7 +955,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
 
             if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+                QueueMisbehaving(pfrom->GetId(), nDoS);
         }
     }
 
@@ -785,7 +973,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (nDoS > 0) {
             // if anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS);
+            QueueMisbehaving(pfrom->GetId(), nDoS);
         } else {
             // if nothing significant failed, search existing Masternode list
             CMasternode* pmn = Find(mnp.vin);
@@ -803,28 +991,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vin;
 
         if (vin == CTxIn()) { //only should ask for this once
-            //local network
-            bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
-
-            if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end()) {
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
-                        LogPrint("masternode","dseg - peer already asked me for the list\n");
-                        return;
-                    }
-                }
-                int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
-            }
+            if (!AllowListRequest(pfrom)) return;
         } //else, asking for a specific node which is ok
 
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -849,6 +1022,27 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
             LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
         }
+
+    } else if (strCommand == "dsegsum") { //Get the Masternode entries missing from a summary of the peer's list
+
+        CSyncSummary summary;
+        vRecv >> summary;
+
+        if (!summary.IsValid()) {
+            QueueMisbehaving(pfrom->GetId(), 20);
+            return;
+        }
+        if (!AllowListRequest(pfrom)) return;
+
+        std::vector<CInv> vInv, vInvMissing;
+        GetSyncInventory(vInv, true);
+        summary.GetDifferences(vInv, vInvMissing);
+        BOOST_FOREACH (const CInv& inv, vInvMissing)
+            pfrom->PushInventory(inv);
+
+        // The count covers the entries the peer already has, as if it had been sent the full list
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, (int)vInv.size());
+        LogPrint("masternode", "dsegsum - Sent %d of %d Masternode entries to peer %i\n", vInvMissing.size(), vInv.size(), pfrom->GetId());
     }
     /*
      * IT'S SAFE TO REMOVE THIS IN FURTHER VERSIONS
@@ -879,7 +1073,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         // make sure signature isn't in the future (past is OK)
         if (sigTime > GetAdjustedTime() + 60 * 60) {
             LogPrint("masternode","dsee - Signature rejected, too far into the future %s\n", vin.prevout.hash.ToString());
-            Misbehaving(pfrom->GetId(), 1);
+            QueueMisbehaving(pfrom->GetId(), 1);
             return;
         }
 
@@ -890,7 +1084,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
             LogPrint("masternode","dsee - ignoring outdated Masternode %s protocol version %d < %d\n", vin.prevout.hash.ToString(), protocolVersion, masternodePayments.GetMinMasternodePaymentsProto());
-            Misbehaving(pfrom->GetId(), 1);
+            QueueMisbehaving(pfrom->GetId(), 1);
             return;
         }
 
@@ -899,7 +1093,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (pubkeyScript.size() != 25) {
             LogPrint("masternode","dsee - pubkey the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
@@ -908,20 +1102,20 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (pubkeyScript2.size() != 25) {
             LogPrint("masternode","dsee - pubkey2 the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
         if (!vin.scriptSig.empty()) {
             LogPrint("masternode","dsee - Ignore Not Empty ScriptSig %s\n", vin.prevout.hash.ToString());
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)) {
             LogPrint("masternode","dsee - Got bad Masternode address signature\n");
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
@@ -943,6 +1137,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        NotifyMasternodeUpdates(true);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -975,7 +1170,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         //  - this is expensive, so it's only done once per Masternode
         if (!obfuScationSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
             LogPrint("masternode","dsee - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
@@ -1001,7 +1196,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         if (fAcceptable) {
             if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
                 LogPrint("masternode","dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
-                Misbehaving(pfrom->GetId(), 20);
+                QueueMisbehaving(pfrom->GetId(), 20);
                 return;
             }
 
@@ -1056,7 +1251,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 LogPrint("masternode","dsee - %s from %i %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
                     pfrom->GetId(), pfrom->cleanSubVer.c_str());
                 if (nDoS > 0)
-                    Misbehaving(pfrom->GetId(), nDoS);
+                    QueueMisbehaving(pfrom->GetId(), nDoS);
             }
         }
     }
@@ -1075,13 +1270,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (sigTime > GetAdjustedTime() + 60 * 60) {
             LogPrint("masternode","dseep - Signature rejected, too far into the future %s\n", vin.prevout.hash.ToString());
-            Misbehaving(pfrom->GetId(), 1);
+            QueueMisbehaving(pfrom->GetId(), 1);
             return;
         }
 
         if (sigTime <= GetAdjustedTime() - 60 * 60) {
             LogPrint("masternode","dseep - Signature rejected, too far into the past %s - %d %d \n", vin.prevout.hash.ToString(), sigTime, GetAdjustedTime());
-            Misbehaving(pfrom->GetId(), 1);
+            QueueMisbehaving(pfrom->GetId(), 1);
             return;
         }
 
@@ -1136,11 +1331,14 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            collateralWatcher.Unwatch(vin.prevout);
+            mapByOutpoint.erase((*it).vin.prevout);
+            listMasternodes.erase(it);
+            NotifyMasternodeUpdates(true);
             break;
         }
         ++it;
@@ -1170,7 +1368,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
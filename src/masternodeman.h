@@ -8,6 +8,7 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "flatmap.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
@@ -15,17 +16,27 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+#include <set>
+#include <list>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+// rank tables kept for recent heights, and the list size from which their scores are computed on several threads
+#define MASTERNODE_RANK_TABLES_MAX 32
+#define MASTERNODE_RANK_PARALLEL_MIN 2000
 
 using namespace std;
 
+class CGovernanceDB;
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
-void DumpMasternodes();
 
-/** Access to the MN database (mncache.dat)
+/** Run an instance of the thread scoring masternodes while a large rank table is built */
+void ThreadMasternodeScore();
+
+/** Access to mncache.dat, where the masternode list was kept before the governance database; read once to import it
  */
 class CMasternodeDB
 {
@@ -45,21 +56,73 @@ public:
     };
 
     CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
+/** Hasher for collateral outpoints, salted per instance */
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher() : salt(GetRandHash()) {}
+
+    size_t operator()(const COutPoint& out) const
+    {
+        return out.hash.GetHash(salt) ^ (out.n * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+/** Hasher for the masternode key and payee indexes, which are keyed by a hash already */
+class CMasternodeKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CMasternodeKeyHasher() : salt(GetRandHash()) {}
+
+    size_t operator()(const uint256& key) const
+    {
+        return key.GetHash(salt);
+    }
+};
+
+/** Which masternodes a rank table covers */
+enum {
+    RANK_ONLY_ACTIVE = (1 << 0),   // only enabled masternodes
+    RANK_MIN_AGE = (1 << 1),       // skip masternodes announced less than MN_WINNER_MINIMUM_AGE ago
+    RANK_DISABLED_LAST = (1 << 2), // keep disabled masternodes, ranked behind the enabled ones
+};
+
+/** Scores of the masternodes for one block, best first, so every rank lookup at that height shares one computation */
+struct CMasternodeRankTable {
+    uint256 hashBlock;
+    uint64_t nListVersion;
+    // the table also changes once a skipped masternode gets old enough (RANK_MIN_AGE)
+    int64_t nValidUntil;
+    // (score, masternode), in rank order
+    std::vector<std::pair<int64_t, CMasternode*> > vecScores;
+    // collateral outpoint -> rank, starting at 1
+    flatmap<COutPoint, int, COutPointHasher> mapRank;
+};
+
 class CMasternodeMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // critical section to protect the inner data structures specifically on messaging
-    mutable CCriticalSection cs_process_message;
-
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // all MNs, in the order they were added; entries never move, so pointers stay valid until they are removed
+    std::list<CMasternode> listMasternodes;
+    // listMasternodes indexed by collateral outpoint, Hash(pubKeyMasternode) and Hash(payee script); on duplicate
+    // keys the first entry in the list wins, like the scans these replace
+    flatmap<COutPoint, CMasternode*, COutPointHasher> mapByOutpoint;
+    flatmap<uint256, CMasternode*, CMasternodeKeyHasher> mapByPubKey;
+    flatmap<uint256, CMasternode*, CMasternodeKeyHasher> mapByPayee;
+    // set when keys changed in place or an entry was removed, the key indexes are rebuilt on the next lookup
+    std::atomic<bool> fKeyIndexDirty;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -67,7 +130,29 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // bumped whenever a masternode is added, removed or changes, which invalidates all rank tables
+    std::atomic<uint64_t> nListVersion;
+    // network addresses of the list, rebuilt by UpdateAddressCache once nListVersion moved past nAddrCacheVersion
+    mutable CCriticalSection cs_addrCache;
+    boost::shared_ptr<const std::set<CNetAddr> > pAddrCache;
+    std::atomic<uint64_t> nAddrCacheVersion;
+    // rank tables by (block height, minimum protocol, RANK_* flags)
+    std::map<std::pair<int64_t, std::pair<int, int> >, CMasternodeRankTable> mapRankTables;
+
+    /// Build the rank table for these parameters unless the cached one is current; scores are computed without
+    /// holding cs and the table is swapped in under it
+    void UpdateRankTable(int64_t nBlockHeight, int minProtocol, int nFlags);
+    /// The table UpdateRankTable last built for these parameters at the current block hash; requires cs
+    const CMasternodeRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, int nFlags);
+    void IndexKeys(CMasternode* pmn);
+    void RebuildKeyIndexes();
+    /// Rate limit full list requests from a peer; requires cs_process_message
+    bool AllowListRequest(CNode* pfrom);
+
 public:
+    // critical section to protect the inner data structures specifically on messaging (also guards the seen maps below)
+    mutable CCriticalSection cs_process_message;
+
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
@@ -82,6 +167,10 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // stored as a vector, as before
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
@@ -90,6 +179,13 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            mapByOutpoint.clear();
+            BOOST_FOREACH (CMasternode& mn, listMasternodes)
+                mapByOutpoint.insert(std::make_pair(mn.vin.prevout, &mn));
+            NotifyMasternodeUpdates(true);
+        }
     }
 
     CMasternodeMan();
@@ -110,11 +206,25 @@ public:
     /// Clear Masternode vector
     void Clear();
 
+    /// Write the entries that changed since the last flush to the governance database
+    void Flush(CGovernanceDB& db);
+    /// Replace the list with the one in the governance database
+    void Load(CGovernanceDB& db);
+
     int CountEnabled(int protocolVersion = -1);
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
+    /// Network addresses of all known Masternodes, without ports, as of the last UpdateAddressCache; does not take cs
+    boost::shared_ptr<const std::set<CNetAddr> > GetMasternodeAddresses() const;
+    /// Rebuild the set GetMasternodeAddresses returns if the list changed since it was built
+    void UpdateAddressCache();
+
+    /// Ask a peer for the masternode list, or for the entries our list lacks if it answers sync summaries
     void DsegUpdate(CNode* pnode);
+    /// Announcements of the entries we hand out to peers syncing the list. fServe (requires cs_process_message)
+    /// also makes sure each of them can be served by getdata.
+    void GetSyncInventory(std::vector<CInv>& vInv, bool fServe);
 
     /// Find an entry
     CMasternode* Find(const CScript& payee);
@@ -133,7 +243,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -142,10 +253,21 @@ public:
 
     void ProcessMasternodeConnections();
 
+    /// Drop the cached rank tables after the list or one of its entries changed, and the key indexes if
+    /// a pubkey may have changed or an entry was removed; safe to call without cs
+    void NotifyMasternodeUpdates(bool fKeysChanged = false)
+    {
+        if (fKeysChanged) fKeyIndexDirty = true;
+        nListVersion++;
+    }
+
+    /// Changes whenever a masternode is added, removed or changes, so callers can tell their view of the list is stale
+    uint64_t GetListVersion() const { return nListVersion; }
+
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
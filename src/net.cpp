@@ -15,6 +15,7 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "crypto/common.h"
 #include "miner.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
@@ -28,6 +29,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -36,6 +41,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -83,13 +89,20 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+/** epoll instance watching the listen sockets and all node sockets, or -1 to fall back to select() */
+static int hEpoll = -1;
+/** Tags of the listen sockets registered with hEpoll, one per entry of vhListenSocket */
+static std::vector<CEpollTag> vListenEpollTags;
+#endif
+static void RegisterNodeSocket(CNode* pnode);
 CAddrMan addrman;
 int nMaxConnections = 125;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -342,6 +355,13 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nClassBytesRecv[TRAFFIC_CLASS_COUNT] = {};
+uint64_t CNode::nClassBytesSent[TRAFFIC_CLASS_COUNT] = {};
+CTokenBucket CNode::sendBucketTotal;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundTimeframe = 60 * 60 * 24; //1 day
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -426,6 +446,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
 
+        RegisterNodeSocket(pnode);
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
@@ -449,6 +470,11 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        // Deregister explicitly: the registration outlives close() if a forked child still holds the descriptor
+        if (hEpoll != -1)
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -718,17 +744,24 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         // absorb network data
         int handled;
-        if (!msg.in_data)
+        if (!msg.in_data) {
             handled = msg.readHeader(pch, nBytes);
-        else
-            handled = msg.readData(pch, nBytes);
+            if (handled < 0)
+                return false;
 
-        if (handled < 0)
-            return false;
+            if (msg.in_data && msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH) {
+                LogPrint("net", "Oversized message from peer=%i, disconnecting", GetId());
+                return false;
+            }
 
-        if (msg.in_data && msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH) {
-            LogPrint("net", "Oversized message from peer=%i, disconnecting", GetId());
-            return false;
+            // Now that the size is known, receive all but the largest messages straight into a pooled buffer
+            if (msg.in_data && msg.hdr.nMessageSize > 0 && msg.hdr.nMessageSize <= CRecvBufferPool::MAX_BUFFER_SIZE) {
+                CSerializeData data;
+                recvBufferPool.Get(data, msg.hdr.nMessageSize);
+                msg.vRecv.SwapBuffer(data);
+            }
+        } else {
+            handled = msg.readData(pch, nBytes);
         }
 
         pch += handled;
@@ -743,25 +776,68 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
     return true;
 }
 
+void CNode::EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; it++) {
+        CSerializeData data;
+        it->vRecv.SwapBuffer(data);
+        recvBufferPool.Put(data);
+    }
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+}
+
+void CRecvBufferPool::Get(CSerializeData& data, unsigned int nSize)
+{
+    assert(data.empty() && nSize <= MAX_BUFFER_SIZE);
+    unsigned int nClass = 0;
+    while ((MIN_BUFFER_SIZE << nClass) < nSize)
+        nClass++;
+    if (nFree[nClass] > 0) {
+        data.swap(vFree[nClass][--nFree[nClass]]);
+        nPooledBytes -= data.capacity();
+        nReused++;
+    } else {
+        data.reserve(MIN_BUFFER_SIZE << nClass);
+        nAllocated++;
+    }
+}
+
+void CRecvBufferPool::Put(CSerializeData& data)
+{
+    size_t nCapacity = data.capacity();
+    if (nCapacity >= MIN_BUFFER_SIZE && nCapacity <= MAX_BUFFER_SIZE && nPooledBytes + nCapacity <= MAX_POOLED_BYTES) {
+        // The largest class this buffer can serve
+        unsigned int nClass = 0;
+        while (nClass + 1 < NUM_CLASSES && (MIN_BUFFER_SIZE << (nClass + 1)) <= nCapacity)
+            nClass++;
+        if (nFree[nClass] < MAX_PER_CLASS) {
+            data.clear();
+            vFree[nClass][nFree[nClass]++].swap(data);
+            nPooledBytes += nCapacity;
+            return;
+        }
+    }
+    CSerializeData().swap(data);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    } catch (const std::exception&) {
-        return -1;
-    }
+    // parse the CMessageHeader in place
+    memcpy(hdr.pchMessageStart, &hdrbuf[0], MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &hdrbuf[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32((const unsigned char*)&hdrbuf[CMessageHeader::MESSAGE_SIZE_OFFSET]);
+    hdr.nChecksum = ReadLE32((const unsigned char*)&hdrbuf[CMessageHeader::CHECKSUM_OFFSET]);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
@@ -790,25 +866,86 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
+#ifdef USE_EPOLL
+// requires LOCK(cs_vSend)
+static void EpollSetEvents(CNode* pnode, int op)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (pnode->fEpollWrite ? (uint32_t)EPOLLOUT : 0u);
+    event.data.ptr = &pnode->epollTag;
+    if (epoll_ctl(hEpoll, op, pnode->hSocket, &event) == SOCKET_ERROR && pnode->hSocket != INVALID_SOCKET)
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+}
+
+// requires LOCK(cs_vSend)
+/** Only ask for write readiness while there is something queued to send. */
+static void UpdateSendInterest(CNode* pnode)
+{
+    bool fWrite = pnode->HasDataToSend();
+    if (!pnode->fEpollRegistered || pnode->fEpollWrite == fWrite)
+        return;
+    pnode->fEpollWrite = fWrite;
+    EpollSetEvents(pnode, EPOLL_CTL_MOD);
+}
+#endif
+
+/** Start watching a node's socket for readiness; called right before the node is added to vNodes, while
+ *  no other thread can close its socket yet. */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    LOCK(pnode->cs_vSend);
+    pnode->fEpollRegistered = true;
+    pnode->fEpollWrite = pnode->HasDataToSend();
+    EpollSetEvents(pnode, EPOLL_CTL_ADD);
+#endif
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    // Whitelisted peers are exempt from the upload rate limits
+    bool fLimited = !pnode->fWhitelisted;
+    int64_t nNow = GetTimeMicros();
+    pnode->fSendThrottled = false;
+
+    while (true) {
+        // Finish the message in flight first; otherwise masternode sync traffic only goes out once
+        // nothing else is waiting.
+        if (pnode->nSendOffset == 0)
+            pnode->fSendingBulk = pnode->vSendMsg.empty();
+        std::deque<CSharedMessage>& queue = pnode->fSendingBulk ? pnode->vSendMsgBulk : pnode->vSendMsg;
+        if (queue.empty())
+            break;
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
+        const CSerializeData& data = *queue.front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nToSend = data.size() - pnode->nSendOffset;
+        if (fLimited) {
+            uint64_t nAllowance = CNode::GetUploadAllowance(nNow);
+            if (pnode->sendBucket.IsLimited())
+                nAllowance = std::min(nAllowance, pnode->sendBucket.Available(nNow));
+            if (nAllowance == 0) {
+                pnode->fSendThrottled = true;
+                break;
+            }
+            nToSend = std::min<uint64_t>(nToSend, nAllowance);
+        }
+
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
             pnode->nSendOffset += nBytes;
+            pnode->sendBucket.Consume(nBytes);
             pnode->RecordBytesSent(nBytes);
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
-            } else {
+                queue.pop_front();
+            } else if ((size_t)nBytes < nToSend) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -826,79 +963,448 @@ void SocketSendData(CNode* pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (!pnode->HasDataToSend()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+#ifdef USE_EPOLL
+    UpdateSendInterest(pnode);
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount);
+static void AcceptConnection(const ListenSocket& hListenSocket);
+static bool SocketRecvData(CNode* pnode);
+static void InactivityCheck(CNode* pnode);
+
+#ifdef USE_EPOLL
+static const int EPOLL_MAX_EVENTS = 256;
+/** Reads per readiness event before servicing other sockets; the rest of the data is read on the next pass. */
+static const int EPOLL_MAX_READS_PER_EVENT = 4;
+
+/** Nodes with unread or unsent data left over after an edge-triggered event. Only used by ThreadSocketHandler. */
+static set<CNode*> setRecvPending;
+static set<CNode*> setSendPending;
+
+enum RecvStatus {
+    RECV_DRAINED, //! nothing left to read until the next readiness event
+    RECV_MORE,    //! stopped reading to be fair to other sockets, continue right away
+    RECV_BLOCKED, //! cannot read now (lock busy, send queue or receive buffer full), retry on the next pass
+};
+
+static RecvStatus ServiceSocketRecv(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return RECV_DRAINED;
+    {
+        // As in the select() loop: first drain the write buffer before receiving more, so that TCP flow
+        // control applies to peers that do not read what we send them.
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend || pnode->HasDataToSend())
+            return RECV_BLOCKED;
+    }
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return RECV_BLOCKED;
+    for (int i = 0; i < EPOLL_MAX_READS_PER_EVENT; i++) {
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() && pnode->GetTotalRecvSize() > ReceiveFloodSize())
+            return RECV_BLOCKED;
+        if (!SocketRecvData(pnode))
+            return RECV_DRAINED;
+    }
+    return RECV_MORE;
+}
+
+static void ThreadSocketHandlerEpoll()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    bool fRecvMore = false;
+    std::vector<struct epoll_event> vEvents(EPOLL_MAX_EVENTS);
     while (true) {
+        DisconnectNodes(nPrevNodeCount);
+
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), fRecvMore ? 0 : 50);
+        boost::this_thread::interruption_point();
+
+        if (nEvents == SOCKET_ERROR) {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEINTR)
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            const struct epoll_event& event = vEvents[i];
+            const CEpollTag* pTag = (const CEpollTag*)event.data.ptr;
+            if (pTag->type == CEpollTag::LISTEN) {
+                AcceptConnection(*(const ListenSocket*)pTag->ptr);
+                continue;
+            }
+            CNode* pnode = (CNode*)pTag->ptr;
+            if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                setRecvPending.insert(pnode);
+            if (event.events & EPOLLOUT)
+                setSendPending.insert(pnode);
+        }
+
         //
-        // Disconnect nodes
+        // Send
         //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+        for (set<CNode*>::iterator it = setSendPending.begin(); it != setSendPending.end();) {
+            CNode* pnode = *it;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend) {
+                ++it;
+                continue;
+            }
+            if (pnode->hSocket != INVALID_SOCKET)
+                SocketSendData(pnode);
+            // A throttled node gets no new readiness event; retry it once tokens have accrued
+            if (pnode->fSendThrottled && pnode->HasDataToSend()) {
+                ++it;
+                continue;
+            }
+            setSendPending.erase(it++);
+        }
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+        //
+        // Receive
+        //
+        fRecvMore = false;
+        for (set<CNode*>::iterator it = setRecvPending.begin(); it != setRecvPending.end();) {
+            boost::this_thread::interruption_point();
+            RecvStatus status = ServiceSocketRecv(*it);
+            if (status == RECV_DRAINED) {
+                setRecvPending.erase(it++);
+                continue;
+            }
+            fRecvMore |= (status == RECV_MORE);
+            ++it;
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+        //
+        // Inactivity checking
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck) {
+            nLastInactivityCheck = nTime;
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+            }
+            // Nodes are only deleted by this thread, so the copy stays valid
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                InactivityCheck(pnode);
+        }
+    }
+}
+#endif
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                setRecvPending.erase(pnode);
+                setSendPending.erase(pnode);
+#endif
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        size_t vNodesSize;
+    }
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static bool ReverseCompareNodeMinPingTime(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nMinPingUsecTime > b.nMinPingUsecTime;
+}
+
+static bool ReverseCompareNodeTimeConnected(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool CompareNetGroupKeyed(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nKeyedNetGroup < b.nKeyedNetGroup;
+}
+
+static bool CompareNodeBlockTime(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    if (a.nLastBlockTime != b.nLastBlockTime)
+        return a.nLastBlockTime < b.nLastBlockTime;
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool CompareNodeTXTime(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    if (a.nLastTXTime != b.nLastTXTime)
+        return a.nLastTXTime < b.nLastTXTime;
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool IsMasternodeCandidate(const NodeEvictionCandidate& candidate)
+{
+    return candidate.fMasternode;
+}
+
+/** Drop up to nCount candidates from the end of the list once sorted by comp, i.e. protect the best nCount */
+template <typename Comparator>
+static void ProtectEvictionCandidates(std::vector<NodeEvictionCandidate>& vCandidates, Comparator comp, size_t nCount)
+{
+    std::sort(vCandidates.begin(), vCandidates.end(), comp);
+    vCandidates.erase(vCandidates.end() - std::min(nCount, vCandidates.size()), vCandidates.end());
+}
+
+bool SelectNodeToEvict(std::vector<NodeEvictionCandidate> vCandidates, NodeId& idEvict)
+{
+    // Masternodes have collateral at stake and need to reach each other, never drop them for an anonymous peer
+    vCandidates.erase(std::remove_if(vCandidates.begin(), vCandidates.end(), IsMasternodeCandidate), vCandidates.end());
+
+    // Each protection is a different property an attacker has to beat: an address in a netgroup we
+    // don't have yet (keyed, so the attacker can't tell which ones), low latency, relaying blocks
+    // and transactions before anyone else, and simply having been connected for a long time.
+    ProtectEvictionCandidates(vCandidates, CompareNetGroupKeyed, 4);
+    ProtectEvictionCandidates(vCandidates, ReverseCompareNodeMinPingTime, 8);
+    ProtectEvictionCandidates(vCandidates, CompareNodeTXTime, 4);
+    ProtectEvictionCandidates(vCandidates, CompareNodeBlockTime, 4);
+    ProtectEvictionCandidates(vCandidates, ReverseCompareNodeTimeConnected, vCandidates.size() / 2);
+
+    if (vCandidates.empty())
+        return false;
+
+    // Of the rest, take the netgroup with the most connections (the youngest one breaks ties) and drop its youngest
+    // peer. The candidates are still sorted youngest first, so is every group.
+    std::map<uint64_t, std::vector<NodeEvictionCandidate> > mapNetGroupNodes;
+    uint64_t nMostConnectionsGroup = 0;
+    size_t nMostConnections = 0;
+    int64_t nMostConnectionsTime = 0;
+    BOOST_FOREACH (const NodeEvictionCandidate& candidate, vCandidates) {
+        std::vector<NodeEvictionCandidate>& group = mapNetGroupNodes[candidate.nKeyedNetGroup];
+        group.push_back(candidate);
+        int64_t nGroupTime = group[0].nTimeConnected;
+        if (group.size() > nMostConnections || (group.size() == nMostConnections && nGroupTime > nMostConnectionsTime)) {
+            nMostConnections = group.size();
+            nMostConnectionsTime = nGroupTime;
+            nMostConnectionsGroup = candidate.nKeyedNetGroup;
+        }
+    }
+
+    idEvict = mapNetGroupNodes[nMostConnectionsGroup][0].id;
+    return true;
+}
+
+/** Disconnect one inbound peer to make room for a new connection; false if none may be evicted */
+static bool AttemptToEvictConnection()
+{
+    static const uint256 nNetGroupKey = GetRandHash();
+
+    std::vector<NodeEvictionCandidate> vCandidates;
+    std::vector<CNetAddr> vAddr;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (!pnode->fInbound || pnode->fWhitelisted || pnode->fDisconnect)
+                continue;
+            CHashWriter ss(SER_GETHASH, 0);
+            ss << nNetGroupKey << pnode->addr.GetGroup();
+            NodeEvictionCandidate candidate = {pnode->id, pnode->nTimeConnected, pnode->nMinPingUsecTime,
+                                               pnode->nLastBlockTime, pnode->nLastTXTime, ss.GetHash().GetLow64(), false};
+            vCandidates.push_back(candidate);
+            vAddr.push_back(pnode->addr);
+        }
+    }
+    if (vCandidates.empty())
+        return false;
+
+    // The masternode manager keeps this set current; reading it takes neither its lock nor a copy
+    boost::shared_ptr<const std::set<CNetAddr> > pMasternodeAddr = mnodeman.GetMasternodeAddresses();
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+        vCandidates[i].fMasternode = pMasternodeAddr->count(vAddr[i]) > 0;
+
+    NodeId idEvict;
+    if (!SelectNodeToEvict(vCandidates, idEvict))
+        return false;
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->id == idEvict) {
+            LogPrint("net", "evicting inbound peer=%d to make room for a new connection\n", pnode->id);
+            pnode->fDisconnect = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS && !AttemptToEvictConnection()) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        RegisterNodeSocket(pnode);
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            vNodes.push_back(pnode);
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+/** Read once from the node's socket. Returns false if nothing more can be read right now. */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    unsigned int nPrevNodeCount = 0;
+    while (true) {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -927,6 +1433,13 @@ void ThreadSocketHandler()
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
+#ifdef USE_EPOLL
+                // Only reached if epoll could not be set up, in which case sockets are not limited to FD_SETSIZE
+                if (pnode->hSocket >= FD_SETSIZE) {
+                    pnode->fDisconnect = true;
+                    continue;
+                }
+#endif
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
@@ -948,8 +1461,10 @@ void ThreadSocketHandler()
                 // * We process a message in the buffer (message handler thread).
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (lockSend && pnode->HasDataToSend()) {
+                        // While over the upload rate the send is retried below without select()
+                        if (!pnode->fSendThrottled)
+                            FD_SET(pnode->hSocket, &fdsetSend);
                         continue;
                     }
                 }
@@ -982,49 +1497,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -1047,33 +1521,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1081,31 +1530,16 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (FD_ISSET(pnode->hSocket, &fdsetSend) || pnode->fSendThrottled) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend && pnode->HasDataToSend())
                     SocketSendData(pnode);
             }
 
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1115,7 +1549,6 @@ void ThreadSocketHandler()
     }
 }
 
-
 #ifdef USE_UPNP
 void ThreadMapPort()
 {
@@ -1391,7 +1824,7 @@ void ThreadOpenConnections()
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            OpenNetworkConnection(addrConnect, &grant, NULL, false, true);
     }
 }
 
@@ -1463,7 +1896,7 @@ void ThreadOpenAddedConnections()
 }
 
 // if successful, this moves the passed grant to the constructed node
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound, const char* pszDest, bool fOneShot)
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound, const char* pszDest, bool fOneShot, bool fAutomatic)
 {
     //
     // Initiate outbound network connection
@@ -1487,6 +1920,8 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
     pnode->fNetworkNode = true;
     if (fOneShot)
         pnode->fOneShot = true;
+    if (fAutomatic)
+        pnode->fAutomaticOutbound = true;
 
     return true;
 }
@@ -1526,8 +1961,9 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                    // A deferred getdata holds back the peer's other messages too; retry it after the sleep
+                    if (pnode->nSendSize < SendBufferSize() && !pnode->fGetDataDeferred) {
+                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete() && !pnode->fWorkerBacklogFull)) {
                             fSleep = false;
                         }
                     }
@@ -1556,6 +1992,11 @@ void ThreadMessageHandler()
     }
 }
 
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
 // ppcoin: stake minter thread
 void static ThreadStakeMinter()
 {
@@ -1740,6 +2181,26 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+#ifdef USE_EPOLL
+    if (hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+            LogPrintf("epoll_create1 failed: %s, falling back to select()\n", NetworkErrorString(WSAGetLastError()));
+        // Listen sockets stay level-triggered, one connection is accepted per event. vhListenSocket and the
+        // tags don't change until shutdown, so pointers into them stay valid.
+        vListenEpollTags.clear();
+        for (size_t i = 0; i < vhListenSocket.size(); i++)
+            vListenEpollTags.push_back(CEpollTag(CEpollTag::LISTEN, &vhListenSocket[i]));
+        for (size_t i = 0; hEpoll != -1 && i < vhListenSocket.size(); i++) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &vListenEpollTags[i];
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i].socket, &event) == SOCKET_ERROR)
+                LogPrintf("epoll_ctl failed for listen socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1812,6 +2273,12 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+        vListenEpollTags.clear();
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1843,6 +2310,8 @@ void RelayTransaction(const CTransaction& tx)
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
+    // Serialized once here; getdata responses to all peers then queue this same buffer
+    CSharedMessage msg = MakeSharedMessage("tx", ss);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1852,7 +2321,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1902,6 +2371,27 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+    sendBucketTotal.Consume(bytes);
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::RecordMessageRecv(const std::string& strCommand, uint64_t bytes)
+{
+    LOCK(cs_totalBytesRecv);
+    nClassBytesRecv[GetTrafficClass(strCommand)] += bytes;
+}
+
+void CNode::RecordMessageSent(const std::string& strCommand, uint64_t bytes)
+{
+    LOCK(cs_totalBytesSent);
+    nClassBytesSent[GetTrafficClass(strCommand)] += bytes;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1916,6 +2406,137 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::GetClassBytes(uint64_t* pRecv, uint64_t* pSent)
+{
+    {
+        LOCK(cs_totalBytesRecv);
+        std::copy(nClassBytesRecv, nClassBytesRecv + TRAFFIC_CLASS_COUNT, pRecv);
+    }
+    LOCK(cs_totalBytesSent);
+    std::copy(nClassBytesSent, nClassBytesSent + TRAFFIC_CLASS_COUNT, pSent);
+}
+
+void CNode::SetMaxUploadRate(uint64_t nRate)
+{
+    LOCK(cs_totalBytesSent);
+    sendBucketTotal.SetRate(nRate);
+}
+
+uint64_t CNode::GetUploadAllowance(int64_t nNow)
+{
+    LOCK(cs_totalBytesSent);
+    if (!sendBucketTotal.IsLimited())
+        return std::numeric_limits<uint64_t>::max();
+    return sendBucketTotal.Available(nNow);
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        // keep a large enough buffer to at least relay each block once
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().TargetSpacing2() * UPLOAD_TARGET_BLOCK_RESERVE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+TrafficClass GetTrafficClass(const std::string& strCommand)
+{
+    static const char* const vBlockCommands[] = {"block", "cmpctblock", "blocktxn", "getblocktxn", "merkleblock", "headers", "getheaders", "getblocks"};
+    static const char* const vRelayCommands[] = {"inv", "getdata", "notfound", "tx", "ix", "txlvote"};
+    static const char* const vMasternodeCommands[] = {"mnb", "mnp", "dseg", "dsee", "dseep", "mnget", "mnw", "ssc", "mnvs", "mprop", "mvote", "fbs", "fbvote"};
+
+    for (unsigned int i = 0; i < ARRAYLEN(vBlockCommands); i++)
+        if (strCommand == vBlockCommands[i])
+            return TRAFFIC_BLOCK;
+    for (unsigned int i = 0; i < ARRAYLEN(vRelayCommands); i++)
+        if (strCommand == vRelayCommands[i])
+            return TRAFFIC_RELAY;
+    for (unsigned int i = 0; i < ARRAYLEN(vMasternodeCommands); i++)
+        if (strCommand == vMasternodeCommands[i])
+            return TRAFFIC_MASTERNODE;
+    return TRAFFIC_OTHER;
+}
+
+const char* GetTrafficClassName(int nClass)
+{
+    switch (nClass) {
+    case TRAFFIC_BLOCK:
+        return "block";
+    case TRAFFIC_RELAY:
+        return "relay";
+    case TRAFFIC_MASTERNODE:
+        return "masternode";
+    default:
+        return "other";
+    }
+}
+
+uint64_t CTokenBucket::Available(int64_t nNow)
+{
+    if (nLastRefill == 0 || nNow < nLastRefill) {
+        nLastRefill = nNow;
+        return nTokens;
+    }
+    // Never hold more than one second worth of tokens
+    int64_t nElapsed = std::min<int64_t>(nNow - nLastRefill, 1000000);
+    uint64_t nAdd = nRate * nElapsed / 1000000;
+    if (nAdd > 0) {
+        nTokens = std::min(nRate, nTokens + nAdd);
+        nLastRefill = nNow;
+    }
+    return nTokens;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2047,23 +2668,31 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                            addrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001),
+                                                                                            filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
+    nWorkerMessages = 0;
+    fWorkerBacklogFull = false;
+    fGetDataDeferred = false;
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
+    nLastBlockTime = 0;
+    nLastTXTime = 0;
     addr = addrIn;
     addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
     nVersion = 0;
     strSubVer = "";
     fWhitelisted = false;
     fOneShot = false;
+    fAutomaticOutbound = false;
     fClient = false; // set by version message
     fInbound = fInboundIn;
     fNetworkNode = false;
@@ -2072,15 +2701,23 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSendingBulk = false;
+    fSendThrottled = false;
+    sendBucket.SetRate(1000 * GetArg("-maxpeeruploadrate", 0));
+#ifdef USE_EPOLL
+    fEpollRegistered = false;
+    fEpollWrite = false;
+    epollTag = CEpollTag(CEpollTag::NODE, this);
+#endif
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
+    nMinPingUsecTime = std::numeric_limits<int64_t>::max();
     fPingQueued = false;
     fObfuScationMaster = false;
 
@@ -2187,15 +2824,57 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    boost::shared_ptr<CSerializeData> pdata = boost::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*pdata);
+    QueueSendMessage(pdata);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSharedMessage(const CSharedMessage& msg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending shared message (%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    QueueSendMessage(msg);
+}
+
+void CNode::QueueSendMessage(const CSharedMessage& msg)
+{
+    const CSerializeData& data = *msg;
+    assert(data.size() >= CMessageHeader::HEADER_SIZE);
+    const char* pszCommand = &data[MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, std::find(pszCommand, pszCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    RecordMessageSent(strCommand, data.size());
+
+    bool fWasEmpty = !HasDataToSend();
+    if (GetTrafficClass(strCommand) == TRAFFIC_MASTERNODE)
+        vSendMsgBulk.push_back(msg);
+    else
+        vSendMsg.push_back(msg);
+    nSendSize += data.size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (fWasEmpty)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << CMessageHeader(pszCommand, ssPayload.size());
+    ss << ssPayload;
+
+    // Set the checksum
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> pdata = boost::make_shared<CSerializeData>();
+    ss.GetAndClear(*pdata);
+    return pdata;
 }
 
 //
@@ -12,7 +12,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -21,6 +20,7 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
 #include <deque>
 #include <stdint.h>
 
@@ -30,6 +30,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -62,6 +63,13 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** Upload budget kept back per block expected in the rest of the -maxuploadtarget cycle, so new blocks still get relayed */
+static const uint64_t UPLOAD_TARGET_BLOCK_RESERVE = 100 * 1000;
+/** Number of inventory items and addresses remembered per peer as already known to it (about 21 kB for inventory at 1e-6) */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 2000;
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -74,16 +82,43 @@ CNode* FindNode(const CSubNet& subNet);
 CNode* FindNode(const std::string& addrName);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest = NULL, bool obfuScationMaster = false);
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound = NULL, const char* strDest = NULL, bool fOneShot = false);
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound = NULL, const char* strDest = NULL, bool fOneShot = false, bool fAutomatic = false);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Wake the message handler thread, e.g. after work that held back a peer's messages has completed */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
+/** A complete serialized message (header and payload), shared read-only by mapRelay and the send queues of all peers it goes to. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Serialize a message once so it can be queued to any number of peers with CNode::PushSharedMessage. */
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+/** What decides whether an inbound peer keeps its slot when a new inbound connection arrives and all slots are taken */
+struct NodeEvictionCandidate {
+    NodeId id;
+    int64_t nTimeConnected;
+    int64_t nMinPingUsecTime;
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
+    uint64_t nKeyedNetGroup;
+    bool fMasternode;
+};
+
+/**
+ * Pick the inbound peer to drop in favour of a new one. Peers are protected for distinct
+ * netgroups, low ping, recently relaying novel blocks or transactions, running a masternode
+ * and long uptime; the youngest peer of the most crowded netgroup among the rest is chosen.
+ * Returns false if every candidate is protected.
+ */
+bool SelectNodeToEvict(std::vector<NodeEvictionCandidate> vCandidates, NodeId& idEvict);
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
@@ -132,7 +167,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -174,13 +209,88 @@ public:
 };
 
 
+/**
+ * Keeps the data buffers of processed messages for reuse by later messages on the same connection, so
+ * the steady stream of small messages does not go through the allocator (and the zeroing allocator's
+ * cleanse) each time. Buffers are kept per power-of-two size class. Protected by the owning CNode's
+ * cs_vRecvMsg.
+ */
+class CRecvBufferPool
+{
+public:
+    static const unsigned int MIN_BUFFER_SIZE = 256;
+    static const unsigned int MAX_BUFFER_SIZE = 32 * 1024;
+    static const unsigned int NUM_CLASSES = 8; // MIN_BUFFER_SIZE << (NUM_CLASSES - 1) == MAX_BUFFER_SIZE
+    static const unsigned int MAX_PER_CLASS = 4;
+    //! Upper bound on the bytes kept per connection, idle ones included; about 8 MB across a full set of peers
+    static const size_t MAX_POOLED_BYTES = 64 * 1024;
+
+    uint64_t nAllocated; //! buffers that had to be allocated
+    uint64_t nReused;    //! buffers served from the pool
+
+    CRecvBufferPool() : nAllocated(0), nReused(0), nPooledBytes(0)
+    {
+        for (unsigned int i = 0; i < NUM_CLASSES; i++)
+            nFree[i] = 0;
+    }
+
+    /** Replace data (which must be empty) with a buffer of capacity >= nSize; nSize must not exceed MAX_BUFFER_SIZE */
+    void Get(CSerializeData& data, unsigned int nSize);
+    /** Keep data's buffer for reuse if there is room; data is left empty either way */
+    void Put(CSerializeData& data);
+
+private:
+    CSerializeData vFree[NUM_CLASSES][MAX_PER_CLASS];
+    unsigned int nFree[NUM_CLASSES];
+    size_t nPooledBytes;
+};
+
+/** Message classes for send prioritisation and traffic accounting */
+enum TrafficClass {
+    TRAFFIC_BLOCK,      //! blocks, headers and compact block relay
+    TRAFFIC_RELAY,      //! inventory, transactions and SwiftX locks
+    TRAFFIC_MASTERNODE, //! masternode list, winners and budget sync; sent after everything else
+    TRAFFIC_OTHER,
+    TRAFFIC_CLASS_COUNT
+};
+
+TrafficClass GetTrafficClass(const std::string& strCommand);
+const char* GetTrafficClassName(int nClass);
+
+/**
+ * Token bucket limiting a byte rate. Tokens accrue at nRate bytes per second, up to one second
+ * worth of burst. A rate of 0 means unlimited. Not thread safe; callers hold the owner's lock.
+ */
+class CTokenBucket
+{
+public:
+    CTokenBucket() : nRate(0), nTokens(0), nLastRefill(0) {}
+
+    void SetRate(uint64_t nRateIn)
+    {
+        nRate = nRateIn;
+        nTokens = nRateIn;
+        nLastRefill = 0;
+    }
+    bool IsLimited() const { return nRate != 0; }
+
+    /** Bytes that may be sent at nNow (in microseconds) */
+    uint64_t Available(int64_t nNow);
+    void Consume(uint64_t nBytes) { nTokens -= std::min(nTokens, nBytes); }
+
+private:
+    uint64_t nRate;
+    uint64_t nTokens;
+    int64_t nLastRefill;
+};
+
 class CNetMessage
 {
 public:
     bool in_data; // parsing header (false) or data (true)
 
-    CDataStream hdrbuf; // partially received header
-    CMessageHeader hdr; // complete header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
+    CMessageHeader hdr;                        // complete header
     unsigned int nHdrPos;
 
     CDataStream vRecv; // received message data
@@ -188,9 +298,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -206,7 +315,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -276,6 +384,20 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+#ifdef USE_EPOLL
+/** What a socket registered with the socket handler's epoll instance belongs to; the event's data.ptr points at one */
+struct CEpollTag {
+    enum Type {
+        LISTEN, //! ptr is the ListenSocket
+        NODE,   //! ptr is the CNode
+    };
+    Type type;
+    void* ptr;
+
+    CEpollTag() : type(NODE), ptr(NULL) {}
+    CEpollTag(Type typeIn, void* ptrIn) : type(typeIn), ptr(ptrIn) {}
+};
+#endif
 
 /** Information about a peer */
 class CNode
@@ -288,19 +410,39 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;     // everything but TRAFFIC_MASTERNODE
+    std::deque<CSharedMessage> vSendMsgBulk; // TRAFFIC_MASTERNODE, only sent while vSendMsg is empty
+    bool fSendingBulk;                       // the partially sent message (nSendOffset) is the front of vSendMsgBulk
+    CTokenBucket sendBucket;                 // -maxpeeruploadrate, protected by cs_vSend
+    bool fSendThrottled;                     // the last send stopped for lack of upload tokens (protected by cs_vSend)
     CCriticalSection cs_vSend;
+#ifdef USE_EPOLL
+    // whether hSocket is registered with the socket handler's epoll instance, and with write interest (protected by cs_vSend)
+    bool fEpollRegistered;
+    bool fEpollWrite;
+    CEpollTag epollTag;
+#endif
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    CRecvBufferPool recvBufferPool;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // messages from this peer waiting for a message worker (protected by the worker queue lock in main.cpp)
+    int nWorkerMessages;
+    // set while vRecvMsg is held back because nWorkerMessages is at its limit (protected by cs_vRecvMsg)
+    bool fWorkerBacklogFull;
+    // set while vRecvGetData waits for a message worker to release the inventory it asks for (protected by cs_vRecvMsg)
+    bool fGetDataDeferred;
 
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
     int64_t nTimeOffset;
+    // Last time this peer gave us a block that extended our tip / a transaction we accepted to the mempool (protected by cs_main)
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -312,6 +454,7 @@ public:
     std::string strSubVer, cleanSubVer;
     bool fWhitelisted; // This peer can bypass DoS banning.
     bool fOneShot;
+    bool fAutomaticOutbound; // Outbound peer picked from addrman, may be replaced by a better one
     bool fClient;
     bool fInbound;
     bool fNetworkNode;
@@ -357,12 +500,12 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -375,6 +518,8 @@ public:
     int64_t nPingUsecStart;
     // Last measured round-trip time.
     int64_t nPingUsecTime;
+    // Best measured round-trip time.
+    int64_t nMinPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
 
@@ -387,6 +532,15 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static uint64_t nClassBytesRecv[TRAFFIC_CLASS_COUNT];
+    static uint64_t nClassBytesSent[TRAFFIC_CLASS_COUNT];
+
+    // Global upload rate (-maxuploadrate) and target (-maxuploadtarget), protected by cs_totalBytesSent
+    static CTokenBucket sendBucketTotal;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundTimeframe;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -415,6 +569,10 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    /** Remove the messages before itEnd from vRecvMsg, returning their buffers to recvBufferPool */
+    void EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -437,7 +595,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -445,7 +603,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -459,7 +617,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -467,7 +625,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -483,8 +641,21 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    // requires LOCK(cs_vSend)
+    /** Queue a complete message by its traffic class and try to send it right away if nothing was queued */
+    void QueueSendMessage(const CSharedMessage& msg);
+
+    // requires LOCK(cs_vSend)
+    bool HasDataToSend() const
+    {
+        return !vSendMsg.empty() || !vSendMsgBulk.empty();
+    }
+
     void PushVersion();
 
+    /** Queue a message built by MakeSharedMessage, without copying it */
+    void PushSharedMessage(const CSharedMessage& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -724,9 +895,37 @@ public:
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
+    static void RecordMessageRecv(const std::string& strCommand, uint64_t bytes);
+    static void RecordMessageSent(const std::string& strCommand, uint64_t bytes);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static void GetClassBytes(uint64_t* pRecv, uint64_t* pSent);
+
+    //! bytes per second for all peers together; 0 disables the limit
+    static void SetMaxUploadRate(uint64_t nRate);
+    //! bytes the global upload rate allows right now
+    static uint64_t GetUploadAllowance(int64_t nNow);
+
+    //! set the max outbound target in bytes per timeframe
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! returns the max outbound timeframe in seconds
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! check if the outbound target is reached
+    //! if historicalBlockServingLimit is set true, the function will leave room
+    //! for relaying a new block during the rest of the timeframe
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! response the bytes left in the current max outbound cycle
+    //! in case of no limit, it will always response 0
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! response the time in second left in the current max outbound cycle
+    //! in case of no limit, it will always response 0
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CExplicitNetCleanup
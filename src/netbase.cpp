@@ -9,6 +9,7 @@
 
 #include "netbase.h"
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "sync.h"
 #include "uint256.h"
@@ -27,6 +28,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <poll.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
 #include <boost/thread.hpp>
@@ -239,6 +244,25 @@ struct timeval MillisToTimeval(int64_t nTimeout)
     return timeout;
 }
 
+/** Wait up to nTimeout milliseconds for hSocket to become readable (or writable). Returns like select(). */
+static int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout)
+{
+#ifdef USE_EPOLL
+    // Sockets may be numbered beyond FD_SETSIZE when the epoll socket handler is used
+    struct pollfd pollfd;
+    pollfd.fd = hSocket;
+    pollfd.events = fWrite ? POLLOUT : POLLIN;
+    pollfd.revents = 0;
+    return poll(&pollfd, 1, nTimeout);
+#else
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, fWrite ? NULL : &fdset, fWrite ? &fdset : NULL, NULL, &timeout);
+#endif
+}
+
 /**
  * Read bytes from socket. This will either read the full number of bytes requested
  * or return False on error or timeout.
@@ -270,11 +294,7 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
                 if (!IsSelectableSocket(hSocket)) {
                     return false;
                 }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -471,11 +491,7 @@ bool static ConnectSocketDirectly(const CService& addrConnect, SOCKET& hSocketRe
         int nErr = WSAGetLastError();
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+            int nRet = WaitForSocket(hSocket, true, nTimeout);
             if (nRet == 0) {
                 LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
                 CloseSocket(hSocket);
@@ -998,6 +1014,11 @@ uint64_t CNetAddr::GetHash() const
     return nRet;
 }
 
+uint64_t CNetAddr::GetHash(uint64_t k0, uint64_t k1) const
+{
+    return CSipHasher(k0, k1).Write(ReadLE64(&ip[0])).Write(ReadLE64(&ip[8])).Finalize();
+}
+
 // private extensions to enum Network, only returned by GetExtNetwork,
 // and only used in GetReachabilityFrom
 static const int NET_UNKNOWN = NET_MAX + 0;
@@ -84,6 +84,8 @@ public:
     std::string ToStringIP() const;
     unsigned int GetByte(int n) const;
     uint64_t GetHash() const;
+    //! Keyed SipHash of the address, for hash tables indexed by addresses peers choose
+    uint64_t GetHash(uint64_t k0, uint64_t k1) const;
     bool GetInAddr(struct in_addr* pipv4Addr) const;
     std::vector<unsigned char> GetGroup() const;
     int GetReachabilityFrom(const CNetAddr* paddrPartner = NULL) const;
@@ -6,6 +6,7 @@
 
 #include "obfuscation.h"
 #include "coincontrol.h"
+#include "governancedb.h"
 #include "init.h"
 #include "main.h"
 #include "masternodeman.h"
@@ -2163,22 +2164,69 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
+uint256 CObfuScationSigner::SignerCacheKey(const uint256& hashMessage, const vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << hashMessage;
+    ss << vchSig;
+    return ss.GetHash();
+}
+
+void CObfuScationSigner::PrecheckMessage(const std::string& strMessage, const vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
+
+    CPubKey pubkey;
+    CKeyID keyID;
+    if (pubkey.RecoverCompact(hashMessage, vchSig))
+        keyID = pubkey.GetID();
+
+    uint256 hashKey = SignerCacheKey(hashMessage, vchSig);
+    LOCK(cs);
+    if (!mapPrecheckedSigners.insert(std::make_pair(hashKey, keyID)).second)
+        return;
+    dequePrecheckedSigners.push_back(hashKey);
+    if (dequePrecheckedSigners.size() > MAX_PRECHECKED_SIGNERS) {
+        mapPrecheckedSigners.erase(dequePrecheckedSigners.front());
+        dequePrecheckedSigners.pop_front();
+    }
+}
+
 bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    CKeyID keyID;
+    bool fPrechecked = false;
+    {
+        LOCK(cs);
+        std::map<uint256, CKeyID>::const_iterator it = mapPrecheckedSigners.find(SignerCacheKey(hashMessage, vchSig));
+        if (it != mapPrecheckedSigners.end()) {
+            keyID = it->second;
+            fPrechecked = true;
+        }
+    }
+
+    if (!fPrechecked) {
+        CPubKey pubkey2;
+        if (pubkey2.RecoverCompact(hashMessage, vchSig))
+            keyID = pubkey2.GetID();
+    }
+    if (keyID.IsNull()) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    return (keyID == pubkey.GetID());
 }
 
 bool CObfuscationQueue::Sign()
@@ -2298,6 +2346,9 @@ void ThreadCheckObfuScationPool()
         // try to sync from all available nodes, one step at a time
         masternodeSync.Process();
 
+        // keep the masternode addresses connection eviction protects current
+        mnodeman.UpdateAddressCache();
+
         if (masternodeSync.IsBlockchainSynced()) {
             c++;
 
@@ -2312,7 +2363,7 @@ void ThreadCheckObfuScationPool()
                 CleanTransactionLocksList();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            if (c % MASTERNODES_DUMP_SECONDS == 0) FlushGovernanceDB();
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
@@ -243,10 +243,22 @@ public:
     int64_t sigTime;
 };
 
+/** Number of signers recovered ahead of time that CObfuScationSigner remembers */
+static const unsigned int MAX_PRECHECKED_SIGNERS = 20000;
+
 /** Helper object for signing and checking signatures
  */
 class CObfuScationSigner
 {
+private:
+    CCriticalSection cs;
+    /// Key ids recovered by PrecheckMessage, keyed by SignerCacheKey. A null id marks a signature that does not recover.
+    std::map<uint256, CKeyID> mapPrecheckedSigners;
+    /// Keys of mapPrecheckedSigners, oldest first
+    std::deque<uint256> dequePrecheckedSigners;
+
+    static uint256 SignerCacheKey(const uint256& hashMessage, const std::vector<unsigned char>& vchSig);
+
 public:
     /// Is the inputs associated with this public key? (and there is LAX collateral - checking if valid masternode)
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
@@ -258,6 +270,8 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Recover the signer of a message ahead of VerifyMessage, which then only compares key ids. Safe to call from any thread.
+    void PrecheckMessage(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
 };
 
 /** Used to keep track of current status of Obfuscation pool
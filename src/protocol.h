@@ -77,6 +77,10 @@ enum {
 
 	 NODE_BLOOM_WITHOUT_MN = (1 << 4),
 
+    // NODE_COMPACT_BLOCKS means the node relays new blocks as cmpctblock announcements and
+    // answers getblocktxn requests. Peers advertising it get compact blocks instead of an inv.
+    NODE_COMPACT_BLOCKS = (1 << 5),
+
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
     // bitcoin-development mailing list. Remember that service bits are just
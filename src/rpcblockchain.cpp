@@ -552,6 +552,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainstateflush\": {     (object) coin database flush statistics\n"
+            "    \"flushes\": xxxx,       (numeric) number of batches written to the coin database\n"
+            "    \"pending\": true|false, (boolean) whether a batch is currently being written\n"
+            "    \"lastentries\": xxxx,   (numeric) changed coin records in the last batch\n"
+            "    \"lastqueuems\": xxxx,   (numeric) time spent handing the last batch to the writer, in milliseconds\n"
+            "    \"lastwaitms\": xxxx,    (numeric) part of lastqueuems spent waiting for the previous batch\n"
+            "    \"lastwritems\": xxxx,   (numeric) time the last batch took to commit, in milliseconds\n"
+            "    \"maxwritems\": xxxx,    (numeric) longest commit so far, in milliseconds\n"
+            "    \"totalwritems\": xxxx   (numeric) total commit time, in milliseconds\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -566,6 +576,19 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    if (pcoinsdbview) {
+        CCoinsFlushStats flushStats = pcoinsdbview->GetFlushStats();
+        UniValue flush(UniValue::VOBJ);
+        flush.push_back(Pair("flushes", (uint64_t)flushStats.nFlushes));
+        flush.push_back(Pair("pending", flushStats.fPending));
+        flush.push_back(Pair("lastentries", (uint64_t)flushStats.nLastEntries));
+        flush.push_back(Pair("lastqueuems", flushStats.nLastQueueMicros * 0.001));
+        flush.push_back(Pair("lastwaitms", flushStats.nLastWaitMicros * 0.001));
+        flush.push_back(Pair("lastwritems", flushStats.nLastWriteMicros * 0.001));
+        flush.push_back(Pair("maxwritems", flushStats.nMaxWriteMicros * 0.001));
+        flush.push_back(Pair("totalwritems", flushStats.nTotalWriteMicros * 0.001));
+        obj.push_back(Pair("chainstateflush", flush));
+    }
     return obj;
 }
 
@@ -7,6 +7,7 @@
 #include "activemasternode.h"
 #include "db.h"
 #include "init.h"
+#include "lpctx.h"
 #include "main.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
@@ -944,3 +945,73 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
 
     return obj;
 }
+
+UniValue getlpctxinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getlpctxinfo\n"
+            "\nReturns the state of LPCtx transaction locking and how long locks took to complete\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"requests\": n,        (numeric) Accepted lock requests kept\n"
+            "  \"rejected\": n,        (numeric) Rejected lock requests kept\n"
+            "  \"locks\": n,           (numeric) Transaction locks kept\n"
+            "  \"votes\": n,           (numeric) Lock votes kept\n"
+            "  \"lockedinputs\": n,    (numeric) Outputs held by a lock\n"
+            "  \"completed\": n,       (numeric) Locks that got the required signatures since startup\n"
+            "  \"conflicts\": n,       (numeric) Conflicting complete locks cancelled since startup\n"
+            "  \"expired\": n,         (numeric) Locks dropped after expiring since startup\n"
+            "  \"latency\": {          (object) Time from the lock request to the lock getting its signatures\n"
+            "    \"count\": n,         (numeric) Locks timed\n"
+            "    \"average\": n,       (numeric) Average in seconds (if any)\n"
+            "    \"min\": n,           (numeric) Fastest in seconds (if any)\n"
+            "    \"max\": n,           (numeric) Slowest in seconds (if any)\n"
+            "    \"histogram\": [\n"
+            "      {\n"
+            "        \"upto\": n,      (numeric) Upper bound of the bucket in seconds, missing for the last one\n"
+            "        \"count\": n      (numeric) Locks in the bucket\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getlpctxinfo", "") + HelpExampleRpc("getlpctxinfo", ""));
+
+    CTransactionLockStats stats;
+    txLockManager.GetStats(stats);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("requests", (uint64_t)stats.nRequests));
+    obj.push_back(Pair("rejected", (uint64_t)stats.nRejected));
+    obj.push_back(Pair("locks", (uint64_t)stats.nLocks));
+    obj.push_back(Pair("votes", (uint64_t)stats.nVotes));
+    obj.push_back(Pair("lockedinputs", (uint64_t)stats.nLockedInputs));
+    obj.push_back(Pair("completed", stats.nCompleted));
+    obj.push_back(Pair("conflicts", stats.nConflicts));
+    obj.push_back(Pair("expired", stats.nExpired));
+
+    const CLatencyHistogram& latency = stats.latency;
+    UniValue latencyObj(UniValue::VOBJ);
+    latencyObj.push_back(Pair("count", latency.nCount));
+    if (latency.nCount) {
+        latencyObj.push_back(Pair("average", latency.nTotal / (double)latency.nCount * 0.000001));
+        latencyObj.push_back(Pair("min", latency.nMin * 0.000001));
+        latencyObj.push_back(Pair("max", latency.nMax * 0.000001));
+    }
+    UniValue histogram(UniValue::VARR);
+    for (int n = 0; n < LPCTX_LATENCY_BUCKETS; n++) {
+        UniValue bucket(UniValue::VOBJ);
+        int64_t nLimit = CLatencyHistogram::GetBucketLimit(n);
+        if (nLimit >= 0)
+            bucket.push_back(Pair("upto", nLimit * 0.000001));
+        bucket.push_back(Pair("count", latency.vBuckets[n]));
+        histogram.push_back(bucket);
+    }
+    latencyObj.push_back(Pair("histogram", histogram));
+    obj.push_back(Pair("latency", latencyObj));
+
+    return obj;
+}
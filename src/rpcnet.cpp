@@ -105,7 +105,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blockannouncements\": n,  (numeric) New blocks this peer announced to us\n"
+            "    \"blocksfirst\": n,         (numeric) How many of those it announced before any other peer\n"
+            "    \"blockannouncedelay\": n,  (numeric) Smoothed delay in seconds of its announcements after the first one (if any)\n"
+            "    \"blockthroughput\": n,     (numeric) Smoothed rate in bytes per second at which requested blocks arrive (if known)\n"
+            "    \"whitelisted\": true|false (boolean) Whether the peer is whitelisted\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -153,6 +158,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blockannouncements", statestats.nBlockAnnouncements));
+            obj.push_back(Pair("blocksfirst", statestats.nBlocksFirst));
+            if (statestats.nBlockAnnounceDelay >= 0)
+                obj.push_back(Pair("blockannouncedelay", statestats.nBlockAnnounceDelay * 0.000001));
+            if (statestats.nBlockThroughput > 0)
+                obj.push_back(Pair("blockthroughput", statestats.nBlockThroughput));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -342,7 +353,23 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"classes\":             (json object) Message bytes by traffic class\n"
+            "  {\n"
+            "    \"block\": {            (json object) Blocks, headers and compact blocks (also \"relay\", \"masternode\" and \"other\")\n"
+            "      \"bytesrecv\": n,     (numeric) Bytes received\n"
+            "      \"bytessent\": n      (numeric) Bytes queued for sending\n"
+            "    }, ...\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -351,6 +378,26 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    uint64_t nClassRecv[TRAFFIC_CLASS_COUNT], nClassSent[TRAFFIC_CLASS_COUNT];
+    CNode::GetClassBytes(nClassRecv, nClassSent);
+    UniValue classes(UniValue::VOBJ);
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; i++) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("bytesrecv", nClassRecv[i]));
+        entry.push_back(Pair("bytessent", nClassSent[i]));
+        classes.push_back(Pair(GetTrafficClassName(i), entry));
+    }
+    obj.push_back(Pair("classes", classes));
     return obj;
 }
 
@@ -781,7 +781,7 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
         if (fLPCtx) {
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddRequest(tx);
             CreateNewLock(tx);
             RelayTransactionLockReq(tx, true);
         }
@@ -366,6 +366,7 @@ static const CRPCCommand vRPCCommands[] =
         {"lapo", "getmasternodestatus", &getmasternodestatus, true, true, false},
         {"lapo", "getmasternodewinners", &getmasternodewinners, true, true, false},
         {"lapo", "getmasternodescores", &getmasternodescores, true, true, false},
+        {"lapo", "getlpctxinfo", &getlpctxinfo, true, true, false},
         {"lapo", "mnbudget", &mnbudget, true, true, false},
         {"lapo", "preparebudget", &preparebudget, true, true, false},
         {"lapo", "submitbudget", &submitbudget, true, true, false},
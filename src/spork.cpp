@@ -24,6 +24,7 @@ class CSporkManager;
 
 CSporkManager sporkManager;
 
+CCriticalSection cs_mapSporks;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
@@ -43,8 +44,11 @@ void LoadSporksFromDB()
         }
 
         // add spork to memory
-        mapSporks[spork.GetHash()] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            mapSporks[spork.GetHash()] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -75,12 +79,15 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         if (strSpork == "Unknown") return;
 
         uint256 hash = spork.GetHash();
-        if (mapSporksActive.count(spork.nSporkID)) {
-            if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
-                if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
-                return;
-            } else {
-                if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+        {
+            LOCK(cs_mapSporks);
+            if (mapSporksActive.count(spork.nSporkID)) {
+                if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
+                    if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+                    return;
+                } else {
+                    if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+                }
             }
         }
 
@@ -88,21 +95,32 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
         if (!sporkManager.CheckSignature(spork)) {
             LogPrintf("spork - invalid signature\n");
-            Misbehaving(pfrom->GetId(), 100);
+            QueueMisbehaving(pfrom->GetId(), 100);
             return;
         }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            // another peer may have delivered a newer value in the meantime
+            if (mapSporksActive.count(spork.nSporkID) && mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned)
+                return;
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         // LAPO: add to spork database.
         pSporkDB->WriteSpork(spork.nSporkID, spork);
     }
     if (strCommand == "getsporks") {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
+        std::map<int, CSporkMessage> mapActive;
+        {
+            LOCK(cs_mapSporks);
+            mapActive = mapSporksActive;
+        }
+        std::map<int, CSporkMessage>::iterator it = mapActive.begin();
 
-        while (it != mapSporksActive.end()) {
+        while (it != mapActive.end()) {
             pfrom->PushMessage("spork", it->second);
             it++;
         }
@@ -115,6 +133,7 @@ int64_t GetSporkValue(int nSporkID)
 {
     int64_t r = -1;
 
+    LOCK(cs_mapSporks);
     if (mapSporksActive.count(nSporkID)) {
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -225,6 +244,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if (Sign(msg)) {
         Relay(msg);
+        LOCK(cs_mapSporks);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
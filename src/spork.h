@@ -62,6 +62,7 @@ using namespace boost;
 class CSporkMessage;
 class CSporkManager;
 
+extern CCriticalSection cs_mapSporks;
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
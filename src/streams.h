@@ -286,6 +286,13 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    //! Exchange the underlying buffer with data (e.g. to hand it to a pool or take one from it) and rewind
+    void SwapBuffer(CSerializeData& data)
+    {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
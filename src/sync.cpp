@@ -7,11 +7,66 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
+#include <map>
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+std::atomic<bool> fLockProfiling(false);
+
+// A plain mutex, a CCriticalSection would record itself
+static boost::mutex csLockProfile;
+static std::map<std::pair<const char*, int>, CLockSiteProfile> mapLockProfile;
+
+void RecordLockHold(const char* pszName, const char* pszFile, int nLine, int64_t nMicros)
+{
+    boost::unique_lock<boost::mutex> lock(csLockProfile);
+    // Keyed by the __FILE__ pointer to keep this cheap, GetLockProfile merges sites seen from several translation units
+    CLockSiteProfile& profile = mapLockProfile[std::make_pair(pszFile, nLine)];
+    if (profile.nCount == 0) {
+        profile.strName = pszName;
+        profile.strSite = strprintf("%s:%d", pszFile, nLine);
+    }
+    profile.nCount++;
+    profile.nTotalMicros += nMicros;
+    profile.nMaxMicros = std::max(profile.nMaxMicros, nMicros);
+}
+
+static bool CompareLockSiteTotal(const CLockSiteProfile& a, const CLockSiteProfile& b)
+{
+    return a.nTotalMicros > b.nTotalMicros;
+}
+
+void GetLockProfile(std::vector<CLockSiteProfile>& vProfile)
+{
+    std::map<std::string, CLockSiteProfile> mapSites;
+    {
+        boost::unique_lock<boost::mutex> lock(csLockProfile);
+        for (std::map<std::pair<const char*, int>, CLockSiteProfile>::const_iterator it = mapLockProfile.begin(); it != mapLockProfile.end(); ++it) {
+            CLockSiteProfile& site = mapSites[it->second.strSite];
+            if (site.nCount == 0) {
+                site = it->second;
+                continue;
+            }
+            site.nCount += it->second.nCount;
+            site.nTotalMicros += it->second.nTotalMicros;
+            site.nMaxMicros = std::max(site.nMaxMicros, it->second.nMaxMicros);
+        }
+    }
+    vProfile.clear();
+    for (std::map<std::string, CLockSiteProfile>::const_iterator it = mapSites.begin(); it != mapSites.end(); ++it)
+        vProfile.push_back(it->second);
+    std::sort(vProfile.begin(), vProfile.end(), CompareLockSiteTotal);
+}
+
+void ResetLockProfile()
+{
+    boost::unique_lock<boost::mutex> lock(csLockProfile);
+    mapLockProfile.clear();
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
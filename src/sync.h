@@ -7,6 +7,11 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -104,12 +109,43 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** How long locks were held at one LOCK site, while lock profiling was on */
+struct CLockSiteProfile {
+    std::string strName;
+    std::string strSite;
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+};
+
+/** When set, every lock taken through CMutexLock records how long it was held. Off by default, it costs one
+ *  atomic load per lock then. */
+extern std::atomic<bool> fLockProfiling;
+void RecordLockHold(const char* pszName, const char* pszFile, int nLine, int64_t nMicros);
+/** The recorded sites, longest total hold time first */
+void GetLockProfile(std::vector<CLockSiteProfile>& vProfile);
+void ResetLockProfile();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    // where the lock was taken and since when, 0 unless lock profiling was on
+    const char* pszLockName;
+    const char* pszLockFile;
+    int nLockLine;
+    int64_t nLockStart;
+
+    void StartProfile(const char* pszName, const char* pszFile, int nLine)
+    {
+        if (!fLockProfiling.load(std::memory_order_relaxed)) return;
+        pszLockName = pszName;
+        pszLockFile = pszFile;
+        nLockLine = nLine;
+        nLockStart = GetTimeMicros();
+    }
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
@@ -122,6 +158,7 @@ private:
 #ifdef DEBUG_LOCKCONTENTION
         }
 #endif
+        StartProfile(pszName, pszFile, nLine);
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
@@ -130,11 +167,13 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else
+            StartProfile(pszName, pszFile, nLine);
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), nLockStart(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -142,7 +181,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : nLockStart(0)
     {
         if (!pmutexIn) return;
 
@@ -155,8 +194,13 @@ public:
 
     ~CMutexLock()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
             LeaveCritical();
+            if (nLockStart) {
+                lock.unlock();
+                RecordLockHold(pszLockName, pszLockFile, nLockLine, GetTimeMicros() - nLockStart);
+            }
+        }
     }
 
     operator bool()
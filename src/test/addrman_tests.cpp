@@ -0,0 +1,107 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CAddress RoutableAddress(unsigned int n, int64_t nTime)
+{
+    CAddress addr(CService(strprintf("%u.%u.%u.%u", 1 + (n >> 24) % 200, (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff), 31714));
+    addr.nTime = nTime;
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_simple)
+{
+    CAddrMan addrman;
+    int64_t nNow = GetAdjustedTime();
+    CNetAddr source("250.1.2.1");
+
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CAddress addr1 = RoutableAddress(0x01020304, nNow);
+    BOOST_CHECK(addrman.Add(addr1, source));
+    BOOST_CHECK(!addrman.Add(addr1, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+
+    // Unroutable addresses are never stored
+    BOOST_CHECK(!addrman.Add(CAddress(CService("10.0.0.1", 31714)), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    addrman.Good(addr1);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    int64_t nNow = GetAdjustedTime();
+    for (unsigned int i = 0; i < 2000; i++) {
+        CAddress addr = RoutableAddress(0x01000000 + i * 7919, nNow);
+        addrman.Add(addr, CNetAddr(strprintf("250.%u.1.1", i % 200)));
+        if (i % 10 == 0)
+            addrman.Good(addr);
+    }
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 1000);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), nSize);
+
+    // A second dump of the restored tables is byte for byte the same
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << addrman;
+    ss2 << addrman2;
+    BOOST_CHECK(ss1.str() == ss2.str());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_benchmark)
+{
+    // Fill the tables the way address gossip does, then time the hot operations
+    static const unsigned int NUM_ADDRESSES = 40000;
+    CAddrMan addrman;
+    int64_t nNow = GetAdjustedTime();
+    std::vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < NUM_ADDRESSES; i++)
+        vAddr.push_back(RoutableAddress(0x01000000 + i * 104729, nNow - i));
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vAddr.size(); i += 10)
+        addrman.Add(std::vector<CAddress>(vAddr.begin() + i, vAddr.begin() + i + 10), CNetAddr(strprintf("250.%u.%u.1", i % 250, i / 250 % 250)));
+    int64_t nAdd = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vAddr.size(); i += 20)
+        addrman.Good(vAddr[i], nNow - 3600);
+    int64_t nGood = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 10000; i++)
+        addrman.Select();
+    int64_t nSelect = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    int64_t nDump = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(addrman.size() > 0);
+    BOOST_TEST_MESSAGE(strprintf("addrman_benchmark: %d addresses, add %.2fms, good %.2fms, 10000 selects %.2fms, dump %.2fms (%u bytes)",
+        addrman.size(), nAdd * 0.001, nGood * 0.001, nSelect * 0.001, nDump * 0.001, ss.size()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,152 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CMutableTransaction SpendingTx(int n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = n;
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 1000 * n;
+    return tx;
+}
+
+/** Proof-of-stake block: coinbase, coinstake, three ordinary transactions and a block signature */
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    coinbase.vout.resize(1);
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction coinstake = SpendingTx(1);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 5000;
+    block.vtx.push_back(coinstake);
+
+    for (int i = 2; i < 5; i++)
+        block.vtx.push_back(SpendingTx(i));
+
+    block.nVersion = 4;
+    block.nBits = 0x207fffff;
+    block.nTime = 1500000000;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.vchBlockSig.assign(71, 0x42);
+    BOOST_CHECK(block.IsProofOfStake());
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_roundtrip)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase();
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0.0, 1));
+
+    // Relay encoding: coinbase and coinstake are sent in full, the rest as short IDs
+    CBlockHeaderAndShortTxIDs cmpctblockSent(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblockSent;
+    BOOST_CHECK(stream.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    stream >> cmpctblock;
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.GetShortID(block.vtx[2].GetHash()), cmpctblockSent.GetShortID(block.vtx[2].GetHash()));
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 2U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0) && partialBlock.IsTxAvailable(1) && partialBlock.IsTxAvailable(3));
+
+    std::vector<uint16_t> vMissing;
+    partialBlock.GetMissing(vMissing);
+    BOOST_REQUIRE_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 2);
+    BOOST_CHECK_EQUAL(vMissing[1], 4);
+
+    CBlock blockOut;
+    std::vector<CTransaction> vtxMissing;
+    vtxMissing.push_back(block.vtx[2]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_INVALID);
+
+    // The wrong transaction surfaces as a merkle root mismatch
+    vtxMissing.push_back(block.vtx[3]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_FAILED);
+
+    vtxMissing[1] = block.vtx[4];
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.vchBlockSig == block.vchBlockSig);
+    BOOST_CHECK(blockOut.IsProofOfStake());
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_from_mempool)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase();
+    for (int i = 2; i < 5; i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+
+    std::vector<uint16_t> vMissing;
+    partialBlock.GetMissing(vMissing);
+    BOOST_CHECK(vMissing.empty());
+
+    CBlock blockOut;
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockOut.vtx.size(), block.vtx.size());
+}
+
+BOOST_AUTO_TEST_CASE(blocktxn_request_encoding)
+{
+    BlockTransactionsRequest req;
+    req.blockhash = GetRandHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(3);
+    req.indexes.push_back(4000);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    // 32 byte hash, count and the differences 0, 0, 1 and 3995
+    BOOST_CHECK_EQUAL(stream.size(), 32U + 1 + 1 + 1 + 1 + 3);
+
+    BlockTransactionsRequest reqOut;
+    stream >> reqOut;
+    BOOST_CHECK(reqOut.blockhash == req.blockhash);
+    BOOST_CHECK(reqOut.indexes == req.indexes);
+
+    // Differences may not run past the 16 bit index space
+    CDataStream streamBad(SER_NETWORK, PROTOCOL_VERSION);
+    streamBad << req.blockhash;
+    WriteCompactSize(streamBad, 2);
+    WriteCompactSize(streamBad, 65535);
+    WriteCompactSize(streamBad, 0);
+    BOOST_CHECK_THROW(streamBad >> reqOut, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
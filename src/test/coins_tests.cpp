@@ -4,12 +4,15 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <vector>
 #include <map>
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace
 {
@@ -58,6 +61,22 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -89,8 +108,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -135,6 +154,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +173,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +197,290 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Flush random modifications through a CCoinsViewCache into a CCoinsViewDB that
+// commits on its background thread, and check that reads stay consistent both
+// while a batch is in flight and after it has been committed.
+BOOST_AUTO_TEST_CASE(coins_async_flush_test)
+{
+    CCoinsViewDB db(1 << 20, true, false, true);
+    std::map<uint256, CCoins> result;
+
+    std::vector<uint256> txids;
+    txids.resize(500);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = GetRandHash();
+    }
+
+    for (unsigned int round = 0; round < 20; round++) {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < 200; i++) {
+            uint256 txid = txids[insecure_rand() % txids.size()];
+            CCoins& coins = result[txid];
+            CCoinsModifier entry = cache.ModifyCoins(txid);
+            BOOST_CHECK(coins == *entry);
+            if (coins.IsPruned() || insecure_rand() % 3 != 0) {
+                coins.nVersion = 1;
+                coins.vout.resize(1);
+                coins.vout[0].nValue = insecure_rand();
+                *entry = coins;
+            } else {
+                coins.Clear();
+                entry->Clear();
+            }
+        }
+        uint256 hashBlock = GetRandHash();
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+
+        // Possibly still in flight
+        BOOST_CHECK(db.GetBestBlock() == hashBlock);
+        for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+            CCoins coins;
+            BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+            BOOST_CHECK(coins == it->second);
+            BOOST_CHECK_EQUAL(db.HaveCoins(it->first), !it->second.IsPruned());
+        }
+
+        if (round % 2 == 0) {
+            BOOST_CHECK(db.WaitForFlush());
+            BOOST_CHECK(!db.GetFlushStats().fPending);
+            BOOST_CHECK(db.GetBestBlock() == hashBlock);
+        }
+    }
+
+    BOOST_CHECK(db.WaitForFlush());
+    BOOST_CHECK_EQUAL(db.GetFlushStats().nFlushes, 20U);
+    for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        BOOST_CHECK(coins == it->second);
+    }
+}
+
+static void RandomCoins(CCoins& coins)
+{
+    coins.nVersion = 1;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.fCoinBase = insecure_rand() % 8 == 0;
+    coins.fCoinStake = !coins.fCoinBase && insecure_rand() % 8 == 0;
+    // Up to 300 outputs, so that indexes beyond 255 are covered
+    coins.vout.resize(1 + insecure_rand() % (insecure_rand() % 4 == 0 ? 300 : 4));
+    for (unsigned int n = 0; n < coins.vout.size(); n++) {
+        coins.vout[n].nValue = insecure_rand() % 1000000;
+        coins.vout[n].scriptPubKey = CScript() << OP_TRUE;
+    }
+}
+
+static void CheckCoinsDB(const CCoinsViewDB& db, const std::map<uint256, CCoins>& result)
+{
+    for (std::map<uint256, CCoins>::const_iterator it = result.begin(); it != result.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        BOOST_CHECK(coins == it->second);
+        BOOST_CHECK_EQUAL(db.HaveCoins(it->first), !it->second.IsPruned());
+    }
+}
+
+// Convert a coin database to the per-outpoint layout, keep modifying it, and
+// check that reads and gettxoutsetinfo match a database in the txid layout
+// holding the same coins.
+BOOST_AUTO_TEST_CASE(coins_outpoint_format_test)
+{
+    uint256 hashBlock = chainActive.Genesis()->GetBlockHash();
+    CCoinsViewDB db(1 << 20, true, false, false);
+    BOOST_CHECK_EQUAL(db.GetFormat(), COINS_FORMAT_TXID);
+    std::map<uint256, CCoins> result;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < 200; i++) {
+            uint256 txid = GetRandHash();
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            RandomCoins(*coins);
+            coins->Spend(insecure_rand() % coins->vout.size());
+            coins->Cleanup();
+            result[txid] = *coins;
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats statsBefore;
+    BOOST_CHECK(db.GetStats(statsBefore));
+
+    BOOST_CHECK(db.Upgrade(true));
+    BOOST_CHECK_EQUAL(db.GetFormat(), COINS_FORMAT_OUTPOINT);
+    CheckCoinsDB(db, result);
+    CCoinsStats statsAfter;
+    BOOST_CHECK(db.GetStats(statsAfter));
+    BOOST_CHECK(statsAfter.hashSerialized == statsBefore.hashSerialized);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactions, statsBefore.nTransactions);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactionOutputs, statsBefore.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsAfter.nTotalAmount, statsBefore.nTotalAmount);
+
+    // Spend, prune, re-create and add entries in the per-outpoint layout
+    {
+        CCoinsViewCache cache(&db);
+        for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+            if (insecure_rand() % 2)
+                continue;
+            CCoinsModifier coins = cache.ModifyCoins(it->first);
+            switch (insecure_rand() % 3) {
+            case 0:
+                coins->Clear();
+                break;
+            case 1:
+                RandomCoins(*coins);
+                break;
+            default:
+                if (!coins->vout.empty())
+                    coins->Spend(insecure_rand() % coins->vout.size());
+            }
+            coins->Cleanup();
+            it->second = *coins;
+        }
+        for (unsigned int i = 0; i < 50; i++) {
+            uint256 txid = GetRandHash();
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            RandomCoins(*coins);
+            result[txid] = *coins;
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    CheckCoinsDB(db, result);
+    BOOST_CHECK(db.Upgrade(false)); // never converted back
+    BOOST_CHECK_EQUAL(db.GetFormat(), COINS_FORMAT_OUTPOINT);
+
+    CCoinsViewDB dbTxid(1 << 20, true, false, false);
+    {
+        CCoinsViewCache cache(&dbTxid);
+        for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+            if (!it->second.IsPruned())
+                *cache.ModifyCoins(it->first) = it->second;
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats statsTxid, statsOutpoint;
+    BOOST_CHECK(dbTxid.GetStats(statsTxid));
+    BOOST_CHECK(db.GetStats(statsOutpoint));
+    BOOST_CHECK(statsTxid.hashSerialized == statsOutpoint.hashSerialized);
+    BOOST_CHECK_EQUAL(statsTxid.nTransactions, statsOutpoint.nTransactions);
+    BOOST_CHECK_EQUAL(statsTxid.nTransactionOutputs, statsOutpoint.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsTxid.nTotalAmount, statsOutpoint.nTotalAmount);
+}
+
+// Basic flatmap behaviour beyond what the cache simulation reaches: erasing while
+// iterating, pointer stability across rehashes, and memory release on clear.
+BOOST_AUTO_TEST_CASE(coins_map_test)
+{
+    CCoinsMap map;
+    std::vector<uint256> txids;
+    std::vector<const CCoinsCacheEntry*> ptrs;
+    for (unsigned int i = 0; i < 5000; i++) {
+        txids.push_back(GetRandHash());
+        CCoinsCacheEntry& entry = map[txids.back()];
+        entry.flags = i % 2;
+        ptrs.push_back(&entry);
+    }
+    BOOST_CHECK_EQUAL(map.size(), 5000U);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        CCoinsMap::const_iterator it = map.find(txids[i]);
+        BOOST_CHECK(it != map.end());
+        BOOST_CHECK(&it->second == ptrs[i]);
+    }
+
+    unsigned int count = 0;
+    for (CCoinsMap::iterator it = map.begin(); it != map.end();) {
+        count++;
+        if (it->second.flags)
+            map.erase(it++);
+        else
+            it++;
+    }
+    BOOST_CHECK_EQUAL(count, 5000U);
+    BOOST_CHECK_EQUAL(map.size(), 2500U);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        BOOST_CHECK_EQUAL(map.count(txids[i]), (i % 2) ? 0U : 1U);
+    }
+
+    BOOST_CHECK(map.DynamicMemoryUsage() > 0);
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(map.find(txids[0]) == map.end());
+}
+
+// Time the cache access pattern of block connection (lookup of existing
+// entries, insertion of new ones, spending) on CCoinsMap and on the
+// boost::unordered_map it replaced, and report the cache's memory usage.
+BOOST_AUTO_TEST_CASE(coins_cache_benchmark)
+{
+    static const unsigned int NUM_ENTRIES = 100000;
+    std::vector<uint256> txids(NUM_ENTRIES);
+    for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+        txids[i] = GetRandHash();
+    }
+
+    int64_t nStart = GetTimeMicros();
+    {
+        boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> map;
+        for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+            map[txids[i]].coins.vout.resize(2);
+        }
+        unsigned int found = 0;
+        for (unsigned int round = 0; round < 4; round++) {
+            for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+                found += map.find(txids[(i * 7919) % NUM_ENTRIES]) != map.end();
+            }
+        }
+        BOOST_CHECK_EQUAL(found, 4 * NUM_ENTRIES);
+        for (unsigned int i = 0; i < NUM_ENTRIES; i += 2) {
+            map.erase(txids[i]);
+        }
+    }
+    int64_t nUnorderedMap = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    {
+        CCoinsMap map;
+        for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+            map[txids[i]].coins.vout.resize(2);
+        }
+        unsigned int found = 0;
+        for (unsigned int round = 0; round < 4; round++) {
+            for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+                found += map.find(txids[(i * 7919) % NUM_ENTRIES]) != map.end();
+            }
+        }
+        BOOST_CHECK_EQUAL(found, 4 * NUM_ENTRIES);
+        for (unsigned int i = 0; i < NUM_ENTRIES; i += 2) {
+            map.erase(txids[i]);
+        }
+    }
+    int64_t nFlatMap = GetTimeMicros() - nStart;
+
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < NUM_ENTRIES; i++) {
+        CCoinsModifier coins = cache.ModifyCoins(txids[i]);
+        coins->nVersion = 1;
+        coins->vout.resize(2);
+        coins->vout[0].nValue = 1;
+        coins->vout[1].nValue = 1;
+    }
+    for (unsigned int i = 0; i < NUM_ENTRIES; i += 2) {
+        cache.ModifyCoins(txids[i])->Spend(0);
+    }
+    int64_t nCache = GetTimeMicros() - nStart;
+    cache.SelfTest();
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > NUM_ENTRIES * sizeof(CCoinsCacheEntry));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0U);
+
+    BOOST_TEST_MESSAGE(strprintf("coins_cache_benchmark: %u entries: boost::unordered_map %.2fms, CCoinsMap %.2fms, CCoinsViewCache %.2fms using %.2fMiB",
+        NUM_ENTRIES, nUnorderedMap * 0.001, nFlatMap * 0.001, nCache * 0.001, nUsage * (1.0 / (1 << 20))));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
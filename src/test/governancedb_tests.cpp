@@ -0,0 +1,179 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "governancedb.h"
+#include "masternode-payments.h"
+#include "masternodeman.h"
+#include "script/standard.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CScript PayeeScript(unsigned int n)
+{
+    uint160 id;
+    memcpy(id.begin(), &n, sizeof(n));
+    return GetScriptForDestination(CKeyID(id));
+}
+
+/** A vote for every block from nStart on, each by a different masternode, as a synced node has them */
+static void AddPaymentVotes(CMasternodePayments& payments, int nStart, int nBlocks)
+{
+    for (int nHeight = nStart; nHeight < nStart + nBlocks; nHeight++) {
+        CMasternodePaymentWinner winner(CTxIn(COutPoint(Hash(BEGIN(nHeight), END(nHeight)), 0)));
+        winner.nBlockHeight = nHeight;
+        winner.payee = PayeeScript(nHeight);
+        payments.mapMasternodePayeeVotes[winner.GetHash()] = winner;
+        payments.AddBlockPayee(nHeight, winner.payee, MNPAYMENTS_PAID_VOTES);
+    }
+}
+
+/** Collateral outpoints of the masternode list, in list order */
+static std::vector<COutPoint> MasternodeOrder(const CMasternodeMan& mnman)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << mnman;
+    std::vector<CMasternode> vMasternodes;
+    ss >> vMasternodes;
+    std::vector<COutPoint> vOrder;
+    for (unsigned int i = 0; i < vMasternodes.size(); i++)
+        vOrder.push_back(vMasternodes[i].vin.prevout);
+    return vOrder;
+}
+
+BOOST_AUTO_TEST_SUITE(governancedb_tests)
+
+BOOST_AUTO_TEST_CASE(governance_records)
+{
+    CGovernanceDB db(1 << 20, true, true);
+    std::map<uint256, std::string> mapItems;
+    mapItems[uint256(1)] = "one";
+    mapItems[uint256(2)] = "two";
+
+    CLevelDBBatch batch;
+    db.proposals.BeginPass();
+    for (std::map<uint256, std::string>::iterator it = mapItems.begin(); it != mapItems.end(); ++it)
+        db.proposals.Write(batch, it->first, it->second);
+    db.proposals.EraseOthers(batch);
+    BOOST_CHECK(db.WriteBatch(batch));
+    db.proposals.Commit();
+    BOOST_CHECK_EQUAL(db.proposals.size(), 2U);
+
+    // Changed entries are rewritten, gone ones erased
+    mapItems[uint256(2)] = "deux";
+    mapItems.erase(uint256(1));
+    mapItems[uint256(3)] = "three";
+    CLevelDBBatch batch2;
+    db.proposals.BeginPass();
+    for (std::map<uint256, std::string>::iterator it = mapItems.begin(); it != mapItems.end(); ++it)
+        db.proposals.Write(batch2, it->first, it->second);
+    db.proposals.EraseOthers(batch2);
+    BOOST_CHECK(db.WriteBatch(batch2));
+    db.proposals.Commit();
+    BOOST_CHECK_EQUAL(db.proposals.size(), 2U);
+
+    std::map<uint256, std::string> mapLoaded;
+    db.ReadRecords(db.proposals, mapLoaded);
+    BOOST_CHECK(mapLoaded == mapItems);
+
+    // A pass whose batch never made it to disk leaves nothing behind
+    db.proposals.BeginPass();
+    CLevelDBBatch batch3;
+    db.proposals.Write(batch3, uint256(4), std::string("four"));
+    db.proposals.EraseOthers(batch3);
+    db.proposals.BeginPass();
+    BOOST_CHECK_EQUAL(db.proposals.size(), 2U);
+
+    // Record types don't see each other
+    std::map<uint256, std::string> mapOther;
+    db.ReadRecords(db.finalizedBudgets, mapOther);
+    BOOST_CHECK(mapOther.empty());
+}
+
+BOOST_AUTO_TEST_CASE(governance_payments_roundtrip)
+{
+    CGovernanceDB db(1 << 20, true, true);
+    CMasternodePayments payments;
+    AddPaymentVotes(payments, 100, 50);
+    payments.Flush(db);
+
+    CMasternodePayments payments2;
+    payments2.Load(db);
+    BOOST_CHECK_EQUAL(payments2.mapMasternodePayeeVotes.size(), 50U);
+    BOOST_CHECK_EQUAL(payments2.mapMasternodeBlocks.size(), 50U);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(PayeeScript(120), 200, 1000), 120);
+
+    // Votes that were cleaned up are gone after the next flush
+    payments.Clear();
+    AddPaymentVotes(payments, 140, 20);
+    payments.Flush(db);
+    CMasternodePayments payments3;
+    payments3.Load(db);
+    BOOST_CHECK_EQUAL(payments3.mapMasternodePayeeVotes.size(), 20U);
+    BOOST_CHECK_EQUAL(payments3.GetLastPaidHeight(PayeeScript(120), 200, 1000), 0);
+    BOOST_CHECK_EQUAL(payments3.GetLastPaidHeight(PayeeScript(150), 200, 1000), 150);
+}
+
+BOOST_AUTO_TEST_CASE(governance_masternode_order)
+{
+    CGovernanceDB db(1 << 20, true, true);
+    CMasternodeMan mnman;
+    for (unsigned int i = 0; i < 20; i++) {
+        CMasternode mn;
+        mn.vin = CTxIn(COutPoint(Hash(BEGIN(i), END(i)), 0));
+        mnman.Add(mn);
+    }
+    mnman.Flush(db);
+
+    // The list comes back in the order it was built, not in outpoint order
+    std::vector<COutPoint> vOrder = MasternodeOrder(mnman);
+    std::vector<COutPoint> vSorted = vOrder;
+    std::sort(vSorted.begin(), vSorted.end());
+    BOOST_CHECK(vOrder != vSorted);
+    CMasternodeMan mnman2;
+    mnman2.Load(db);
+    BOOST_CHECK(MasternodeOrder(mnman2) == vOrder);
+
+    // and keeps it across removals and additions
+    mnman.Remove(CTxIn(vOrder[3]));
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(uint256(1), 0));
+    mnman.Add(mn);
+    mnman.Flush(db);
+    CMasternodeMan mnman3;
+    mnman3.Load(db);
+    BOOST_CHECK_EQUAL(MasternodeOrder(mnman3).size(), 20U);
+    BOOST_CHECK(MasternodeOrder(mnman3) == MasternodeOrder(mnman));
+}
+
+BOOST_AUTO_TEST_CASE(governance_flush_benchmark)
+{
+    // A payment cycle worth of votes, flushed once in full and then after a few more blocks
+    static const int NUM_BLOCKS = 20000;
+    static const int NUM_NEW_BLOCKS = 15;
+    CGovernanceDB db(1 << 20, true, true);
+    CMasternodePayments payments;
+    AddPaymentVotes(payments, 1, NUM_BLOCKS);
+
+    int64_t nStart = GetTimeMicros();
+    payments.Flush(db);
+    int64_t nFull = GetTimeMicros() - nStart;
+
+    AddPaymentVotes(payments, NUM_BLOCKS + 1, NUM_NEW_BLOCKS);
+    nStart = GetTimeMicros();
+    payments.Flush(db);
+    int64_t nDelta = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CMasternodePayments payments2;
+    payments2.Load(db);
+    int64_t nLoad = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(payments2.mapMasternodePayeeVotes.size(), (unsigned int)(NUM_BLOCKS + NUM_NEW_BLOCKS));
+
+    BOOST_TEST_MESSAGE(strprintf("governance_flush_benchmark: %d votes, first flush %.2fms, flush after %d blocks %.2fms, load %.2fms",
+        NUM_BLOCKS, nFull * 0.001, NUM_NEW_BLOCKS, nDelta * 0.001, nLoad * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -46,4 +46,26 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vectors from the SipHash-2-4 paper, key 00 01 02 .. 0f
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+
+    // SipHashUint256 hashes the four little-endian words of the uint256
+    uint256 x;
+    x.SetHex("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    hasher2.Write(0x0706050403020100ULL);
+    hasher2.Write(0x0F0E0D0C0B0A0908ULL);
+    hasher2.Write(0x1716151413121110ULL);
+    hasher2.Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x), hasher2.Finalize());
+    BOOST_CHECK_EQUAL(hasher2.Finalize(), 0x7127512f72f27cceull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,191 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lpctx.h"
+#include "primitives/transaction.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CTransaction SpendingTx(unsigned int nFirstInput, unsigned int nInputs, int64_t nSalt)
+{
+    CMutableTransaction tx;
+    for (unsigned int i = nFirstInput; i < nFirstInput + nInputs; i++)
+        tx.vin.push_back(CTxIn(COutPoint(Hash(BEGIN(i), END(i)), 0)));
+    tx.vout.push_back(CTxOut(nSalt, CScript()));
+    return tx;
+}
+
+static CConsensusVote Vote(const uint256& txHash, unsigned int nMasternode, int nBlockHeight)
+{
+    CConsensusVote vote;
+    vote.vinMasternode = CTxIn(COutPoint(Hash(BEGIN(nMasternode), END(nMasternode)), 0));
+    vote.txHash = txHash;
+    vote.nBlockHeight = nBlockHeight;
+    return vote;
+}
+
+BOOST_AUTO_TEST_SUITE(lpctx_tests)
+
+BOOST_AUTO_TEST_CASE(lock_signatures)
+{
+    CTransactionLockManager manager;
+    CTransaction tx = SpendingTx(0, 2, 1);
+    uint256 txHash = tx.GetHash();
+    BOOST_CHECK_EQUAL(manager.GetSignatures(txHash), -1);
+
+    // Votes may come before the request, they only count once the lock height is known
+    for (unsigned int i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(manager.AddSignature(Vote(txHash, i, 100)), -1);
+    BOOST_CHECK(manager.AddVote(Vote(txHash, 0, 100)));
+    BOOST_CHECK(!manager.AddVote(Vote(txHash, 0, 100)));
+    BOOST_CHECK(manager.HaveVote(Vote(txHash, 0, 100).GetHash()));
+
+    manager.CreateLock(txHash, 100);
+    BOOST_CHECK_EQUAL(manager.GetSignatures(txHash), 4);
+    BOOST_CHECK_EQUAL(manager.AddSignature(Vote(txHash, 4, 99)), 4);
+    BOOST_CHECK_EQUAL(manager.AddSignature(Vote(txHash, 5, 100)), 5);
+
+    CTransaction txLocked;
+    BOOST_CHECK_EQUAL(manager.AddSignature(Vote(txHash, 6, 100)), LPCTX_SIGNATURES_REQUIRED);
+    BOOST_CHECK(!manager.NotifyCompleteLock(txHash, txLocked));
+
+    // The complete lock is announced once, when its request is known
+    manager.AddRequest(tx);
+    BOOST_CHECK(manager.HaveRequest(txHash));
+    BOOST_CHECK(!manager.IsRejected(txHash));
+    BOOST_CHECK(manager.NotifyCompleteLock(txHash, txLocked));
+    BOOST_CHECK(txLocked.GetHash() == txHash);
+    manager.AddSignature(Vote(txHash, 7, 100));
+    BOOST_CHECK(!manager.NotifyCompleteLock(txHash, txLocked));
+
+    // Moving the lock to another height recounts its votes
+    manager.CreateLock(txHash, 99);
+    BOOST_CHECK_EQUAL(manager.GetSignatures(txHash), 1);
+
+    CTransactionLockStats stats;
+    manager.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nLocks, 1U);
+    BOOST_CHECK_EQUAL(stats.nCompleted, 1U);
+    BOOST_CHECK_EQUAL(stats.latency.nCount, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(lock_conflicts_and_expiry)
+{
+    CTransactionLockManager manager;
+    int64_t nTime = GetTime();
+    SetMockTime(nTime);
+
+    CTransaction tx1 = SpendingTx(0, 3, 1);
+    CTransaction tx2 = SpendingTx(2, 2, 2);
+    manager.CreateLock(tx1.GetHash(), 100);
+    manager.CreateLock(tx2.GetHash(), 100);
+    manager.AddRequest(tx1);
+    manager.AddVote(Vote(tx1.GetHash(), 0, 100));
+    manager.AddSignature(Vote(tx1.GetHash(), 0, 100));
+    manager.LockInputs(tx1);
+
+    uint256 hashLock;
+    BOOST_CHECK(manager.GetLockedInput(tx1.vin[2].prevout, hashLock));
+    BOOST_CHECK(hashLock == tx1.GetHash());
+    BOOST_CHECK(!manager.IsInputLocked(tx2.vin[1].prevout));
+    BOOST_CHECK(!manager.CheckForConflictingLocks(tx1));
+
+    // A rejected request holds whatever inputs are still free
+    manager.AddRejectedRequest(tx2);
+    BOOST_CHECK(manager.IsRejected(tx2.GetHash()));
+    BOOST_CHECK(manager.GetLockedInput(tx2.vin[0].prevout, hashLock));
+    BOOST_CHECK(hashLock == tx1.GetHash());
+    BOOST_CHECK(manager.GetLockedInput(tx2.vin[1].prevout, hashLock));
+    BOOST_CHECK(hashLock == tx2.GetHash());
+
+    // Conflicting locks expire both at once
+    BOOST_CHECK(manager.CheckForConflictingLocks(tx2));
+    manager.Clean();
+    CTransactionLockStats stats;
+    manager.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nLocks, 2U);
+
+    SetMockTime(nTime + 1);
+    manager.Clean();
+    manager.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nLocks, 0U);
+    BOOST_CHECK_EQUAL(stats.nRequests, 0U);
+    BOOST_CHECK_EQUAL(stats.nRejected, 0U);
+    BOOST_CHECK_EQUAL(stats.nVotes, 0U);
+    BOOST_CHECK_EQUAL(stats.nLockedInputs, 0U);
+    BOOST_CHECK_EQUAL(stats.nConflicts, 1U);
+    BOOST_CHECK_EQUAL(stats.nExpired, 2U);
+
+    // Other locks last an hour
+    CTransaction tx3 = SpendingTx(10, 1, 3);
+    manager.CreateLock(tx3.GetHash(), 100);
+    manager.LockInputs(tx3);
+    SetMockTime(nTime + 60 * 60);
+    manager.Clean();
+    BOOST_CHECK(manager.IsInputLocked(tx3.vin[0].prevout));
+    BOOST_CHECK(!manager.IsLockTimedOut(tx1.GetHash()));
+    BOOST_CHECK(manager.IsLockTimedOut(tx3.GetHash()));
+    SetMockTime(nTime + 60 * 60 + 2);
+    manager.Clean();
+    BOOST_CHECK(!manager.IsInputLocked(tx3.vin[0].prevout));
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(complete_lock)
+{
+    CTransactionLockManager manager;
+    CTransaction tx1 = SpendingTx(0, 2, 1);
+    CTransaction tx2 = SpendingTx(1, 2, 2);
+
+    // The votes complete the lock before its request arrives; the request then holds the inputs
+    manager.CreateLock(tx1.GetHash(), 100);
+    for (unsigned int i = 0; i < LPCTX_SIGNATURES_REQUIRED; i++)
+        manager.AddSignature(Vote(tx1.GetHash(), i, 100));
+    BOOST_CHECK(manager.CompleteLock(tx1.GetHash()));
+    BOOST_CHECK(!manager.IsInputLocked(tx1.vin[0].prevout));
+    manager.AddRequest(tx1);
+    BOOST_CHECK(manager.CompleteLock(tx1.GetHash()));
+    BOOST_CHECK(manager.IsInputLocked(tx1.vin[0].prevout));
+    BOOST_CHECK(manager.IsInputLocked(tx1.vin[1].prevout));
+
+    // An incomplete lock holds nothing yet
+    manager.CreateLock(tx2.GetHash(), 100);
+    manager.AddRequest(tx2);
+    BOOST_CHECK(manager.CompleteLock(tx2.GetHash()));
+    BOOST_CHECK(!manager.IsInputLocked(tx2.vin[1].prevout));
+
+    // A conflicting lock completing later cancels both instead of losing to the first
+    for (unsigned int i = 0; i < LPCTX_SIGNATURES_REQUIRED; i++)
+        manager.AddSignature(Vote(tx2.GetHash(), i, 100));
+    BOOST_CHECK(!manager.CompleteLock(tx2.GetHash()));
+    BOOST_CHECK(!manager.IsInputLocked(tx2.vin[1].prevout));
+
+    CTransactionLockStats stats;
+    manager.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nConflicts, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    CLatencyHistogram histogram;
+    histogram.Add(50000);
+    histogram.Add(100000);
+    histogram.Add(100001);
+    histogram.Add(3000000);
+    histogram.Add(3600 * 1000000LL);
+
+    BOOST_CHECK_EQUAL(histogram.nCount, 5U);
+    BOOST_CHECK_EQUAL(histogram.nMin, 50000);
+    BOOST_CHECK_EQUAL(histogram.nMax, 3600 * 1000000LL);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[0], 2U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[5], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[LPCTX_LATENCY_BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucketLimit(5), 3200000);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucketLimit(LPCTX_LATENCY_BUCKETS - 1), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
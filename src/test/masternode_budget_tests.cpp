@@ -0,0 +1,198 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "masternode-budget.h"
+#include "masternodeman.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CTxIn MasternodeVin(unsigned int n)
+{
+    return CTxIn(COutPoint(Hash(BEGIN(n), END(n)), 0));
+}
+
+static void AddMasternodes(unsigned int nMasternodes)
+{
+    for (unsigned int i = 0; i < nMasternodes; i++) {
+        CMasternode mn;
+        mn.vin = MasternodeVin(i);
+        mnodeman.Add(mn);
+    }
+}
+
+static CBudgetVote MakeVote(CBudgetProposal& proposal, unsigned int nMasternode, int nVote, int64_t nTime)
+{
+    CBudgetVote vote(MasternodeVin(nMasternode), proposal.GetHash(), nVote);
+    vote.nTime = nTime;
+    return vote;
+}
+
+static CBudgetProposal MakeProposal(unsigned int n)
+{
+    return CBudgetProposal(strprintf("proposal-%u", n), "", 0, 0, CScript(), 100 * COIN, Hash(BEGIN(n), END(n)));
+}
+
+/** How GetBudget used to rank the proposals: count every proposal's valid votes, then sort */
+static int RankByCounting(std::map<uint256, CBudgetProposal>& mapProposals)
+{
+    std::vector<std::pair<int, uint256> > vRanked;
+    for (std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin(); it != mapProposals.end(); ++it) {
+        int nVotes = 0;
+        for (std::map<uint256, CBudgetVote>::iterator it2 = it->second.mapVotes.begin(); it2 != it->second.mapVotes.end(); ++it2) {
+            if (!it2->second.fValid || !mnodeman.Find(it2->second.vin)) continue;
+            if (it2->second.nVote == VOTE_YES) nVotes++;
+            if (it2->second.nVote == VOTE_NO) nVotes--;
+        }
+        vRanked.push_back(std::make_pair(nVotes, it->second.nFeeTXHash));
+    }
+    std::sort(vRanked.begin(), vRanked.end());
+    return vRanked.empty() ? 0 : vRanked.back().first;
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_budget_tests)
+
+BOOST_AUTO_TEST_CASE(proposal_tallies)
+{
+    AddMasternodes(10);
+    int64_t nTime = GetTime() - 2 * BUDGET_VOTE_UPDATE_MIN;
+    std::string strError;
+
+    CBudgetProposal proposal = MakeProposal(0);
+    for (unsigned int i = 0; i < 9; i++) {
+        CBudgetVote vote = MakeVote(proposal, i, i < 6 ? VOTE_YES : (i < 8 ? VOTE_NO : VOTE_ABSTAIN), nTime);
+        BOOST_CHECK(proposal.AddOrUpdateVote(vote, strError));
+    }
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 6);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 2);
+    BOOST_CHECK_EQUAL(proposal.GetAbstains(), 1);
+    BOOST_CHECK_EQUAL(proposal.GetRatio(), 0.75);
+
+    // A replaced vote moves from one tally to the other, one replaced too soon doesn't
+    CBudgetVote vote = MakeVote(proposal, 0, VOTE_NO, nTime + BUDGET_VOTE_UPDATE_MIN);
+    BOOST_CHECK(proposal.AddOrUpdateVote(vote, strError));
+    vote = MakeVote(proposal, 0, VOTE_YES, nTime + BUDGET_VOTE_UPDATE_MIN + 1);
+    BOOST_CHECK(!proposal.AddOrUpdateVote(vote, strError));
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 5);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 3);
+
+    // Votes of masternodes that left the list stop counting once the votes are revalidated
+    proposal.CleanAndRemove(false);
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 5);
+    mnodeman.Remove(MasternodeVin(1));
+    mnodeman.Remove(MasternodeVin(7));
+    proposal.CleanAndRemove(false);
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 4);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 2);
+    BOOST_CHECK_EQUAL(proposal.GetRatio(), 5.0 / 8.0);
+
+    // budget.dat doesn't keep the validity of the votes, the tallies are rebuilt and revalidated after loading
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << proposal;
+    CBudgetProposal proposal2;
+    ss >> proposal2;
+    BOOST_CHECK_EQUAL(proposal2.GetYeas(), 5);
+    BOOST_CHECK_EQUAL(proposal2.GetNays(), 3);
+    BOOST_CHECK_EQUAL(proposal2.GetAbstains(), 1);
+    proposal2.CleanAndRemove(false);
+    BOOST_CHECK_EQUAL(proposal2.GetYeas(), 4);
+    BOOST_CHECK_EQUAL(proposal2.GetNays(), 2);
+    BOOST_CHECK_EQUAL(CBudgetProposal(proposal2).GetYeas(), 4);
+
+    mnodeman.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(ranked_proposals)
+{
+    AddMasternodes(10);
+    int64_t nTime = GetTime() - 2 * BUDGET_VOTE_UPDATE_MIN;
+    std::string strError;
+
+    // Proposal n gets n yeas
+    std::vector<uint256> vHashes;
+    for (unsigned int n = 0; n < 3; n++) {
+        CBudgetProposal proposal = MakeProposal(n);
+        for (unsigned int i = 0; i < n; i++) {
+            CBudgetVote vote = MakeVote(proposal, i, VOTE_YES, nTime);
+            BOOST_CHECK(proposal.AddOrUpdateVote(vote, strError));
+        }
+        vHashes.push_back(proposal.GetHash());
+        budget.mapProposals.insert(std::make_pair(proposal.GetHash(), proposal));
+    }
+    budget.NotifyProposalUpdates();
+
+    std::vector<CBudgetProposal*> vRanked = budget.GetRankedProposals();
+    BOOST_CHECK_EQUAL(vRanked.size(), 3U);
+    BOOST_CHECK(vRanked[0]->GetHash() == vHashes[2]);
+    BOOST_CHECK(vRanked[2]->GetHash() == vHashes[0]);
+
+    // New votes reorder the ranking
+    for (unsigned int i = 0; i < 3; i++) {
+        CBudgetVote vote = MakeVote(budget.mapProposals[vHashes[0]], i, VOTE_YES, nTime);
+        BOOST_CHECK(budget.mapProposals[vHashes[0]].AddOrUpdateVote(vote, strError));
+    }
+    vRanked = budget.GetRankedProposals();
+    BOOST_CHECK(vRanked[0]->GetHash() == vHashes[0]);
+    BOOST_CHECK(vRanked[1]->GetHash() == vHashes[2]);
+
+    // And so does a voter leaving the list
+    mnodeman.Remove(MasternodeVin(2));
+    vRanked = budget.GetRankedProposals();
+    BOOST_CHECK(vRanked[0]->GetHash() == vHashes[2] || vRanked[0]->GetHash() == vHashes[0]);
+    BOOST_CHECK_EQUAL(vRanked[0]->GetYeas(), 2);
+    BOOST_CHECK(vRanked[2]->GetHash() == vHashes[1]);
+
+    budget.Clear();
+    mnodeman.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(ranked_proposals_benchmark)
+{
+    // A busy budget cycle: every masternode voted on every proposal
+    static const unsigned int NUM_MASTERNODES = 2000;
+    static const unsigned int NUM_PROPOSALS = 50;
+    static const int NUM_ROUNDS = 20;
+    AddMasternodes(NUM_MASTERNODES);
+    int64_t nTime = GetTime() - 2 * BUDGET_VOTE_UPDATE_MIN;
+    std::string strError;
+
+    for (unsigned int n = 0; n < NUM_PROPOSALS; n++) {
+        CBudgetProposal proposal = MakeProposal(n);
+        for (unsigned int i = 0; i < NUM_MASTERNODES; i++) {
+            CBudgetVote vote = MakeVote(proposal, i, (i + n) % 3 == 0 ? VOTE_NO : VOTE_YES, nTime);
+            proposal.AddOrUpdateVote(vote, strError);
+        }
+        budget.mapProposals.insert(std::make_pair(proposal.GetHash(), proposal));
+    }
+    budget.NotifyProposalUpdates();
+
+    // One round is a block: a few new votes, then the budget is ranked again
+    int64_t nStart = GetTimeMicros();
+    for (int r = 0; r < NUM_ROUNDS; r++) {
+        CBudgetProposal& proposal = budget.mapProposals.begin()->second;
+        CBudgetVote vote = MakeVote(proposal, r, VOTE_ABSTAIN, nTime + BUDGET_VOTE_UPDATE_MIN);
+        proposal.AddOrUpdateVote(vote, strError);
+        BOOST_CHECK_EQUAL(budget.GetRankedProposals().size(), NUM_PROPOSALS);
+    }
+    int64_t nIndexed = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    int nBest = 0;
+    for (int r = 0; r < NUM_ROUNDS; r++)
+        nBest = RankByCounting(budget.mapProposals);
+    int64_t nCounted = GetTimeMicros() - nStart;
+    std::vector<CBudgetProposal*> vRanked = budget.GetRankedProposals();
+    BOOST_CHECK_EQUAL(vRanked[0]->GetYeas() - vRanked[0]->GetNays(), nBest);
+
+    BOOST_TEST_MESSAGE(strprintf("ranked_proposals_benchmark: %u proposals, %u votes each, %d rounds, tallies %.2fms, counting %.2fms",
+        NUM_PROPOSALS, NUM_MASTERNODES, NUM_ROUNDS, nIndexed * 0.001, nCounted * 0.001));
+
+    budget.Clear();
+    mnodeman.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
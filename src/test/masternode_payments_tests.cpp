@@ -0,0 +1,87 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "masternode-payments.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CScript PayeeScript(unsigned int n)
+{
+    uint160 id;
+    memcpy(id.begin(), &n, sizeof(n));
+    return GetScriptForDestination(CKeyID(id));
+}
+
+/** The walk CMasternode::GetLastPaid used to do for every masternode: probe each block of the last nMaxDepth */
+static int LastPaidHeightByScan(CMasternodePayments& payments, const CScript& payee, int nTipHeight, int nMaxDepth)
+{
+    for (int nHeight = nTipHeight; nHeight > 0 && nHeight > nTipHeight - nMaxDepth; nHeight--) {
+        if (payments.mapMasternodeBlocks.count(nHeight) && payments.mapMasternodeBlocks[nHeight].HasPayeeWithVotes(payee, MNPAYMENTS_PAID_VOTES))
+            return nHeight;
+    }
+    return 0;
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_payments_tests)
+
+BOOST_AUTO_TEST_CASE(last_paid_index)
+{
+    CMasternodePayments payments;
+    CScript payeeA = PayeeScript(1), payeeB = PayeeScript(2);
+
+    // A single vote does not make a payment
+    payments.AddBlockPayee(100, payeeA, 1);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 1000), 0);
+    payments.AddBlockPayee(100, payeeA, 1);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 1000), 100);
+
+    payments.AddBlockPayee(150, payeeA, 2);
+    payments.AddBlockPayee(150, payeeB, 1);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 1000), 150);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeB, 200, 1000), 0);
+
+    // Votes for blocks above the tip don't count, so disconnecting blocks needs no bookkeeping
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 149, 1000), 100);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 99, 1000), 0);
+
+    // Payments older than the search depth are ignored
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 50), 0);
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 51), 150);
+
+    // The index survives a round trip through mnpayments.dat
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << payments;
+    CMasternodePayments payments2;
+    ss >> payments2;
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 200, 1000), 150);
+
+    payments.Clear();
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(payeeA, 200, 1000), 0);
+}
+
+BOOST_AUTO_TEST_CASE(last_paid_matches_walk)
+{
+    // Every masternode paid once in the last cycle, the way GetNextMasternodeInQueueForPayment sees the network
+    static const int NUM_MASTERNODES = 500;
+    int nTipHeight = NUM_MASTERNODES + 1000;
+    int nMaxDepth = NUM_MASTERNODES * 1.25;
+    CMasternodePayments payments;
+    std::vector<CScript> vPayees;
+    for (int i = 0; i < NUM_MASTERNODES; i++) {
+        vPayees.push_back(PayeeScript(i));
+        payments.AddBlockPayee(nTipHeight - (i * 7919) % NUM_MASTERNODES, vPayees.back(), MNPAYMENTS_PAID_VOTES);
+    }
+
+    for (int i = 0; i < NUM_MASTERNODES; i++) {
+        BOOST_CHECK_EQUAL(LastPaidHeightByScan(payments, vPayees[i], nTipHeight, nMaxDepth),
+                          payments.GetLastPaidHeight(vPayees[i], nTipHeight, nMaxDepth));
+        BOOST_CHECK_EQUAL(LastPaidHeightByScan(payments, vPayees[i], nTipHeight - 100, nMaxDepth / 2),
+                          payments.GetLastPaidHeight(vPayees[i], nTipHeight - 100, nMaxDepth / 2));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,110 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "hash.h"
+#include "main.h"
+#include "masternode-sync.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+static bool HasInv(const std::vector<CInv>& vInv, const CInv& inv)
+{
+    for (unsigned int i = 0; i < vInv.size(); i++) {
+        if (vInv[i].type == inv.type && vInv[i].hash == inv.hash)
+            return true;
+    }
+    return false;
+}
+
+static std::vector<CInv> AnnounceInventory(unsigned int nStart, unsigned int nItems)
+{
+    std::vector<CInv> vInv;
+    for (unsigned int i = nStart; i < nStart + nItems; i++)
+        vInv.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, Hash(BEGIN(i), END(i))));
+    return vInv;
+}
+
+/** Bytes a full list request and its answer take: the request, the announcements and the closing "ssc" */
+static size_t LegacySyncBytes(const std::vector<CInv>& vInv)
+{
+    return GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION) + GetSerializeSize(vInv, SER_NETWORK, PROTOCOL_VERSION) + 2 * sizeof(int);
+}
+
+static size_t SummarySyncBytes(const CSyncSummary& summary, const std::vector<CInv>& vInvMissing)
+{
+    return GetSerializeSize(summary, SER_NETWORK, PROTOCOL_VERSION) + GetSerializeSize(vInvMissing, SER_NETWORK, PROTOCOL_VERSION) + 2 * sizeof(int);
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_sync_tests)
+
+BOOST_AUTO_TEST_CASE(sync_summary_differences)
+{
+    std::vector<CInv> vInv = AnnounceInventory(0, 1000);
+    std::vector<CInv> vInvMissing;
+
+    // Nothing to send to a peer that has everything
+    CSyncSummary summary(vInv);
+    BOOST_CHECK(summary.IsValid());
+    summary.GetDifferences(vInv, vInvMissing);
+    BOOST_CHECK(vInvMissing.empty());
+
+    // A peer lacking a few items gets all of them and little else, whatever else it has
+    std::vector<CInv> vInvPeer(vInv.begin() + 5, vInv.end());
+    std::vector<CInv> vInvExtra = AnnounceInventory(5000, 3);
+    vInvPeer.insert(vInvPeer.end(), vInvExtra.begin(), vInvExtra.end());
+    summary = CSyncSummary(vInvPeer);
+    summary.GetDifferences(vInv, vInvMissing);
+    for (unsigned int i = 0; i < 5; i++)
+        BOOST_CHECK(HasInv(vInvMissing, vInv[i]));
+    BOOST_CHECK(vInvMissing.size() < 8 * 4 * SYNC_SUMMARY_BUCKET_ITEMS);
+
+    // A peer without anything gets everything
+    vInvMissing.clear();
+    summary = CSyncSummary(std::vector<CInv>());
+    summary.GetDifferences(vInv, vInvMissing);
+    BOOST_CHECK_EQUAL(vInvMissing.size(), vInv.size());
+
+    // Summaries survive the network, and broken ones are refused
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CSyncSummary(vInv);
+    CSyncSummary summary2;
+    ss >> summary2;
+    vInvMissing.clear();
+    summary2.GetDifferences(vInv, vInvMissing);
+    BOOST_CHECK(vInvMissing.empty());
+    BOOST_CHECK(!CSyncSummary().IsValid());
+}
+
+BOOST_AUTO_TEST_CASE(sync_summary_bytes)
+{
+    // A 10k masternode list, synced by a node that is up to date, one that missed 1% of it and a fresh one
+    static const unsigned int NUM_MASTERNODES = 10000;
+    static const unsigned int vMissing[] = {0, NUM_MASTERNODES / 100, NUM_MASTERNODES};
+    std::vector<CInv> vInv = AnnounceInventory(0, NUM_MASTERNODES);
+    for (unsigned int i = 0; i < sizeof(vMissing) / sizeof(vMissing[0]); i++) {
+        // The peer lacks a spread out share of the entries
+        std::vector<CInv> vInvPeer;
+        for (unsigned int j = 0; j < NUM_MASTERNODES; j++) {
+            if (j * vMissing[i] % NUM_MASTERNODES >= vMissing[i])
+                vInvPeer.push_back(vInv[j]);
+        }
+        BOOST_CHECK_EQUAL(vInvPeer.size(), NUM_MASTERNODES - vMissing[i]);
+
+        CSyncSummary summary(vInvPeer);
+        std::vector<CInv> vInvMissing;
+        summary.GetDifferences(vInv, vInvMissing);
+        BOOST_CHECK(vInvMissing.size() >= vMissing[i]);
+
+        size_t nLegacy = LegacySyncBytes(vInv), nSummary = SummarySyncBytes(summary, vInvMissing);
+        if (vMissing[i] < NUM_MASTERNODES / 10)
+            BOOST_CHECK(nSummary * 4 < nLegacy);
+        BOOST_TEST_MESSAGE(strprintf("sync_summary_bytes: %u masternodes, %u missing, full list %u bytes, summary sync %u bytes (%u announced)",
+            NUM_MASTERNODES, vMissing[i], nLegacy, nSummary, vInvMissing.size()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
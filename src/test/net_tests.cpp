@@ -0,0 +1,299 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+#include "chainparams.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(shared_message_format)
+{
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << std::string("payload") << 42;
+
+    CSharedMessage msg = MakeSharedMessage("tx", ssPayload);
+    BOOST_CHECK_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + ssPayload.size());
+
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssPayload.size());
+    BOOST_CHECK(std::equal(ss.begin(), ss.end(), ssPayload.begin()));
+
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    // An empty payload still gets a well-formed header
+    CSharedMessage msgEmpty = MakeSharedMessage("verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(msgEmpty->size(), CMessageHeader::HEADER_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(relay_shares_message)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout.n = 7;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000;
+    CTransaction tx(mtx);
+    RelayTransaction(tx);
+
+    CSharedMessage msg;
+    {
+        LOCK(cs_mapRelay);
+        BOOST_CHECK(mapRelay.count(CInv(MSG_TX, tx.GetHash())));
+        msg = mapRelay[CInv(MSG_TX, tx.GetHash())];
+        mapRelay.erase(CInv(MSG_TX, tx.GetHash()));
+    }
+    // Every getdata response queues this same buffer; nothing is copied per peer
+    CSharedMessage msgQueued = msg;
+    BOOST_CHECK(msgQueued.get() == msg.get());
+    BOOST_CHECK_EQUAL(msg.use_count(), 2);
+
+    CDataStream ss(msg->begin() + CMessageHeader::HEADER_SIZE, msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction txRelayed;
+    ss >> txRelayed;
+    BOOST_CHECK(txRelayed.GetHash() == tx.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CRecvBufferPool pool;
+    CSerializeData data;
+    pool.Get(data, 1000);
+    BOOST_CHECK(data.capacity() >= 1000);
+    BOOST_CHECK_EQUAL(pool.nAllocated, 1U);
+
+    // A returned buffer serves any later request of its size class or below
+    data.resize(1000);
+    pool.Put(data);
+    BOOST_CHECK(data.empty());
+    pool.Get(data, 600);
+    BOOST_CHECK(data.capacity() >= 1000);
+    BOOST_CHECK_EQUAL(pool.nReused, 1U);
+    pool.Put(data);
+
+    // Buffers beyond the size limit are released rather than pooled
+    CSerializeData large;
+    large.reserve(CRecvBufferPool::MAX_BUFFER_SIZE * 2);
+    pool.Put(large);
+    BOOST_CHECK_EQUAL(large.capacity(), 0U);
+    pool.Get(large, CRecvBufferPool::MAX_BUFFER_SIZE);
+    BOOST_CHECK_EQUAL(pool.nAllocated, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_benchmark)
+{
+    // Mix of inv, tx and block sized messages, received in 64 KiB reads as during IBD
+    static const unsigned int NUM_MESSAGES = 20000;
+    static const unsigned int SIZES[] = {37, 250, 520, 9000, 60000};
+    CSerializeData wire;
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+        ssPayload.resize(SIZES[insecure_rand() % ARRAYLEN(SIZES)]);
+        CSharedMessage msg = MakeSharedMessage("tx", ssPayload);
+        wire.insert(wire.end(), msg->begin(), msg->end());
+    }
+
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    unsigned int nReceived = 0;
+    int64_t nStart = GetTimeMicros();
+    {
+        LOCK(node.cs_vRecvMsg);
+        for (size_t nPos = 0; nPos < wire.size(); nPos += 65536) {
+            unsigned int nBytes = std::min(wire.size() - nPos, (size_t)65536);
+            BOOST_REQUIRE(node.ReceiveMsgBytes(&wire[nPos], nBytes));
+            std::deque<CNetMessage>::iterator it = node.vRecvMsg.begin();
+            while (it != node.vRecvMsg.end() && it->complete())
+                it++;
+            nReceived += it - node.vRecvMsg.begin();
+            node.EraseRecvMsgs(it);
+        }
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nReceived, NUM_MESSAGES);
+    // Previously every message allocated its receive buffer (and two header streams)
+    BOOST_CHECK(node.recvBufferPool.nAllocated < NUM_MESSAGES / 10);
+    BOOST_TEST_MESSAGE(strprintf("recv_buffer_benchmark: %u messages in %.2fms, %u buffers allocated, %u reused",
+        NUM_MESSAGES, nElapsed * 0.001, node.recvBufferPool.nAllocated, node.recvBufferPool.nReused));
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK(!bucket.IsLimited());
+
+    // Starts with one second worth of burst
+    bucket.SetRate(1000);
+    BOOST_CHECK(bucket.IsLimited());
+    int64_t nNow = 1000000;
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 1000U);
+    bucket.Consume(600);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 400U);
+    bucket.Consume(1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 0U);
+
+    // Refills at the rate, in steps too small to earn a byte as well
+    for (int i = 0; i < 100; i++)
+        bucket.Available(nNow += 100);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 10U);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow += 250000), 260U);
+
+    // Never more than one second worth of tokens
+    BOOST_CHECK_EQUAL(bucket.Available(nNow += 60 * 1000000), 1000U);
+}
+
+BOOST_AUTO_TEST_CASE(traffic_classes)
+{
+    BOOST_CHECK_EQUAL(GetTrafficClass("block"), TRAFFIC_BLOCK);
+    BOOST_CHECK_EQUAL(GetTrafficClass("cmpctblock"), TRAFFIC_BLOCK);
+    BOOST_CHECK_EQUAL(GetTrafficClass("inv"), TRAFFIC_RELAY);
+    BOOST_CHECK_EQUAL(GetTrafficClass("ix"), TRAFFIC_RELAY);
+    BOOST_CHECK_EQUAL(GetTrafficClass("mnb"), TRAFFIC_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetTrafficClass("mvote"), TRAFFIC_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetTrafficClass("ping"), TRAFFIC_OTHER);
+    BOOST_CHECK_EQUAL(GetTrafficClass(""), TRAFFIC_OTHER);
+    BOOST_CHECK_EQUAL(std::string(GetTrafficClassName(TRAFFIC_MASTERNODE)), "masternode");
+
+    uint64_t nRecv[TRAFFIC_CLASS_COUNT], nSent[TRAFFIC_CLASS_COUNT];
+    CNode::GetClassBytes(nRecv, nSent);
+    CNode::RecordMessageRecv("headers", 100);
+    CNode::RecordMessageSent("mnw", 50);
+    uint64_t nRecvAfter[TRAFFIC_CLASS_COUNT], nSentAfter[TRAFFIC_CLASS_COUNT];
+    CNode::GetClassBytes(nRecvAfter, nSentAfter);
+    BOOST_CHECK_EQUAL(nRecvAfter[TRAFFIC_BLOCK] - nRecv[TRAFFIC_BLOCK], 100U);
+    BOOST_CHECK_EQUAL(nSentAfter[TRAFFIC_MASTERNODE] - nSent[TRAFFIC_MASTERNODE], 50U);
+    BOOST_CHECK_EQUAL(nSentAfter[TRAFFIC_OTHER], nSent[TRAFFIC_OTHER]);
+}
+
+BOOST_AUTO_TEST_CASE(outbound_target)
+{
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    CNode::RecordBytesSent(1);
+    CNode::SetMaxOutboundTarget(1ULL << 40);
+    uint64_t nSentInCycle = (1ULL << 40) - CNode::GetOutboundTargetBytesLeft();
+
+    // A day of blocks needs UPLOAD_TARGET_BLOCK_RESERVE each; historical blocks only get what is left over
+    uint64_t nReserve = CNode::GetMaxOutboundTimeLeftInCycle() / Params().TargetSpacing2() * UPLOAD_TARGET_BLOCK_RESERVE;
+    BOOST_CHECK(nReserve > 0);
+    CNode::SetMaxOutboundTarget(nSentInCycle + nReserve + 1000000);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    CNode::RecordBytesSent(1000000);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nReserve);
+
+    CNode::RecordBytesSent(nReserve);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+}
+
+BOOST_AUTO_TEST_CASE(known_inventory_filter)
+{
+    CRollingBloomFilter filter(1000, 0.000001);
+    std::vector<CInv> vInv;
+    for (int i = 0; i < 1000; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+    BOOST_FOREACH (const CInv& inv, vInv)
+        filter.insert(inv);
+    BOOST_FOREACH (const CInv& inv, vInv)
+        BOOST_CHECK(filter.contains(inv));
+
+    // The type is part of the key: a lock request for a known transaction is still new
+    BOOST_CHECK(!filter.contains(CInv(MSG_TXLOCK_REQUEST, vInv[0].hash)));
+
+    // After several generations the oldest entries are gone, the recent ones kept
+    for (int i = 0; i < 2000; i++)
+        filter.insert(GetRandHash());
+    int nOld = 0;
+    BOOST_FOREACH (const CInv& inv, vInv)
+        nOld += filter.contains(inv);
+    BOOST_CHECK(nOld < 10);
+    CInv invRecent(MSG_BLOCK, GetRandHash());
+    filter.insert(invRecent);
+    BOOST_CHECK(filter.contains(invRecent));
+
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+        nFalsePositives += filter.contains(CInv(MSG_TX, GetRandHash()));
+    BOOST_CHECK(nFalsePositives < 3);
+
+    filter.reset();
+    BOOST_CHECK(!filter.contains(invRecent));
+}
+
+static NodeEvictionCandidate EvictionCandidate(NodeId id, int64_t nTimeConnected, uint64_t nNetGroup, int64_t nPingUsec)
+{
+    NodeEvictionCandidate candidate = {id, nTimeConnected, nPingUsec, 0, 0, nNetGroup, false};
+    return candidate;
+}
+
+BOOST_AUTO_TEST_CASE(inbound_eviction)
+{
+    NodeId idEvict = -1;
+    std::vector<NodeEvictionCandidate> vCandidates;
+    BOOST_CHECK(!SelectNodeToEvict(vCandidates, idEvict));
+
+    // Saturate the inbound slots: honest peers spread over 20 netgroups connected first, then
+    // an attacker filled the rest from a single netgroup with slow connections
+    static const int NUM_INBOUND = 109;
+    static const uint64_t ATTACKER_GROUP = 0;
+    int64_t nNow = GetTime();
+    for (int i = 0; i < NUM_INBOUND; i++) {
+        if (i < 60)
+            vCandidates.push_back(EvictionCandidate(i, nNow - 10000 + i, 1 + i % 20, 50000));
+        else
+            vCandidates.push_back(EvictionCandidate(i, nNow - 10000 + i, ATTACKER_GROUP, 500000));
+    }
+
+    // The youngest attacker peers each have one property worth keeping them for
+    vCandidates[108].fMasternode = true;
+    vCandidates[107].nMinPingUsecTime = 1000;
+    vCandidates[106].nLastBlockTime = nNow;
+    vCandidates[105].nLastTXTime = nNow;
+    BOOST_CHECK(SelectNodeToEvict(vCandidates, idEvict));
+    BOOST_CHECK_EQUAL(idEvict, 104);
+
+    // Keep the slots full with new attacker connections: only the attacker's netgroup loses peers
+    std::set<NodeId> setEvicted;
+    for (int i = 0; i < 200; i++) {
+        BOOST_CHECK(SelectNodeToEvict(vCandidates, idEvict));
+        for (std::vector<NodeEvictionCandidate>::iterator it = vCandidates.begin(); it != vCandidates.end(); ++it) {
+            if (it->id == idEvict) {
+                BOOST_CHECK_EQUAL(it->nKeyedNetGroup, ATTACKER_GROUP);
+                vCandidates.erase(it);
+                break;
+            }
+        }
+        setEvicted.insert(idEvict);
+        vCandidates.push_back(EvictionCandidate(NUM_INBOUND + i, nNow + i, ATTACKER_GROUP, 500000));
+    }
+    BOOST_CHECK_EQUAL(vCandidates.size(), NUM_INBOUND);
+    for (int i = 105; i <= 108; i++)
+        BOOST_CHECK(!setEvicted.count(i));
+
+    // Nobody can be evicted when every peer is a masternode
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+        vCandidates[i].fMasternode = true;
+    BOOST_CHECK(!SelectNodeToEvict(vCandidates, idEvict));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "obfuscation.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+struct CSignedMessage {
+    CPubKey pubkey;
+    std::string strMessage;
+    std::vector<unsigned char> vchSig;
+};
+
+static std::vector<CSignedMessage> SignMessages(unsigned int nMessages)
+{
+    CObfuScationSigner signer;
+    std::string strError;
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<CSignedMessage> vMessages(nMessages);
+    for (unsigned int i = 0; i < nMessages; i++) {
+        vMessages[i].pubkey = key.GetPubKey();
+        vMessages[i].strMessage = strprintf("mnp %u", i);
+        BOOST_CHECK(signer.SignMessage(vMessages[i].strMessage, strError, vMessages[i].vchSig, key));
+    }
+    return vMessages;
+}
+
+static void PrecheckStripe(CObfuScationSigner* signer, const std::vector<CSignedMessage>* vMessages, unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < vMessages->size(); i += nStep)
+        signer->PrecheckMessage((*vMessages)[i].strMessage, (*vMessages)[i].vchSig);
+}
+
+BOOST_AUTO_TEST_SUITE(obfuscation_tests)
+
+BOOST_AUTO_TEST_CASE(signer_precheck)
+{
+    std::vector<CSignedMessage> vMessages = SignMessages(2);
+    CSignedMessage& msg = vMessages[0];
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    std::string strError;
+
+    CObfuScationSigner signer;
+    signer.PrecheckMessage(msg.strMessage, msg.vchSig);
+    BOOST_CHECK(signer.VerifyMessage(msg.pubkey, msg.vchSig, msg.strMessage, strError));
+    BOOST_CHECK(!signer.VerifyMessage(keyOther.GetPubKey(), msg.vchSig, msg.strMessage, strError));
+
+    // A precheck only vouches for the exact message and signature it saw
+    BOOST_CHECK(!signer.VerifyMessage(msg.pubkey, msg.vchSig, vMessages[1].strMessage, strError));
+    BOOST_CHECK(!signer.VerifyMessage(msg.pubkey, vMessages[1].vchSig, msg.strMessage, strError));
+
+    // A signature that does not recover stays invalid once prechecked
+    std::vector<unsigned char> vchBadSig(65, 0);
+    signer.PrecheckMessage(msg.strMessage, vchBadSig);
+    BOOST_CHECK(!signer.VerifyMessage(msg.pubkey, vchBadSig, msg.strMessage, strError));
+}
+
+BOOST_AUTO_TEST_CASE(signer_precheck_benchmark)
+{
+    // A masternode list worth of pings, verified one after the other as the message workers used to do
+    static const unsigned int NUM_MESSAGES = 2000;
+    std::vector<CSignedMessage> vMessages = SignMessages(NUM_MESSAGES);
+    std::string strError;
+
+    CObfuScationSigner signerSerial;
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+        BOOST_CHECK(signerSerial.VerifyMessage(vMessages[i].pubkey, vMessages[i].vchSig, vMessages[i].strMessage, strError));
+    int64_t nSerial = GetTimeMicros() - nStart;
+
+    // The same messages prechecked by one thread per core, then verified in order
+    unsigned int nThreads = std::max(1u, boost::thread::hardware_concurrency());
+    CObfuScationSigner signerParallel;
+    nStart = GetTimeMicros();
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&PrecheckStripe, &signerParallel, &vMessages, i, nThreads));
+    threads.join_all();
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+        BOOST_CHECK(signerParallel.VerifyMessage(vMessages[i].pubkey, vMessages[i].vchSig, vMessages[i].strMessage, strError));
+    int64_t nParallel = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("signer_precheck_benchmark: %u signatures, serial %.2fms, prechecked on %u threads %.2fms",
+        NUM_MESSAGES, nSerial * 0.001, nThreads, nParallel * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,61 @@
+// Copyright (c) 2018 The LAPO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sync.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sync_tests)
+
+BOOST_AUTO_TEST_CASE(lock_profile)
+{
+    CCriticalSection cs1;
+    CCriticalSection cs2;
+    ResetLockProfile();
+
+    // Nothing is recorded while profiling is off
+    {
+        LOCK(cs1);
+    }
+    std::vector<CLockSiteProfile> vProfile;
+    GetLockProfile(vProfile);
+    BOOST_CHECK(vProfile.empty());
+
+    fLockProfiling = true;
+    for (int i = 0; i < 3; i++) {
+        LOCK(cs1);
+    }
+    {
+        LOCK(cs2);
+        MilliSleep(5);
+    }
+    {
+        TRY_LOCK(cs2, lockTry);
+        bool fLocked = lockTry;
+        BOOST_CHECK(fLocked);
+    }
+    fLockProfiling = false;
+
+    // One entry per site, the longest held first
+    GetLockProfile(vProfile);
+    BOOST_CHECK(vProfile.size() >= 3);
+    BOOST_CHECK_EQUAL(vProfile[0].strName, "cs2");
+    BOOST_CHECK_EQUAL(vProfile[0].nCount, 1U);
+    BOOST_CHECK(vProfile[0].nTotalMicros >= 5000);
+    BOOST_CHECK_EQUAL(vProfile[0].nMaxMicros, vProfile[0].nTotalMicros);
+    bool fFoundLoop = false;
+    for (unsigned int i = 0; i < vProfile.size(); i++) {
+        if (vProfile[i].strName == "cs1") {
+            BOOST_CHECK_EQUAL(vProfile[i].nCount, 3U);
+            fFoundLoop = true;
+        }
+    }
+    BOOST_CHECK(fFoundLoop);
+
+    ResetLockProfile();
+    GetLockProfile(vProfile);
+    BOOST_CHECK(vProfile.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -19,35 +19,283 @@
 using namespace std;
 using namespace libzerocoin;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+/**
+ * Coin database keys:
+ * 'B'                  best block
+ * 'c' + txid           CCoins (COINS_FORMAT_TXID)
+ * 'u' + txid           CCoinsHeader (COINS_FORMAT_OUTPOINT)
+ * 'u' + txid + n       compressed CTxOut (COINS_FORMAT_OUTPOINT)
+ * 'V'                  layout, absent for COINS_FORMAT_TXID
+ * 'M'                  present while records are being converted to the per-outpoint layout
+ */
+
+/** Transaction metadata shared by the outputs of a transaction in the per-outpoint layout */
+class CCoinsHeader
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    int nVersion;
+
+    CCoinsHeader() : fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
+    CCoinsHeader(const CCoins& coins) : fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), nHeight(coins.nHeight), nVersion(coins.nVersion) {}
+
+    friend bool operator==(const CCoinsHeader& a, const CCoinsHeader& b)
+    {
+        return a.fCoinBase == b.fCoinBase && a.fCoinStake == b.fCoinStake && a.nHeight == b.nHeight && a.nVersion == b.nVersion;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn)
+    {
+        unsigned char nCode = (fCoinBase ? 1 : 0) | (fCoinStake ? 2 : 0);
+        READWRITE(VARINT(nVersion));
+        READWRITE(nCode);
+        READWRITE(VARINT(nHeight));
+        if (ser_action.ForRead()) {
+            fCoinBase = nCode & 1;
+            fCoinStake = (nCode & 2) != 0;
+        }
+    }
+};
+
+static pair<char, uint256> CoinsHeaderKey(const uint256& txid)
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+    return make_pair('u', txid);
+}
+
+static pair<pair<char, uint256>, uint32_t> CoinsOutputKey(const uint256& txid, uint32_t n)
+{
+    return make_pair(make_pair('u', txid), n);
 }
 
+struct CompareOutputIndex {
+    bool operator()(const std::pair<uint32_t, CTxOut>& a, const std::pair<uint32_t, CTxOut>& b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+//! Number of transactions converted per LevelDB batch when upgrading the layout
+static const unsigned int COINS_UPGRADE_BATCH = 10000;
+//! gettxoutsetinfo splits the coin records into this many key ranges, by the first byte of the txid
+static const unsigned int COINS_STATS_SHARDS = 256;
+
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fAsyncFlushIn) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe),
+                                                                                            fAsyncFlush(fAsyncFlushIn),
+                                                                                            nFormat(COINS_FORMAT_TXID),
+                                                                                            fFlushQueued(false),
+                                                                                            fFlushFailed(false),
+                                                                                            fFlushStop(false)
+{
+    if (!db.Read('V', nFormat))
+        nFormat = COINS_FORMAT_TXID;
+    if (fAsyncFlush)
+        threadFlush = boost::thread(boost::bind(&CCoinsViewDB::ThreadFlush, this));
+}
+
+bool CCoinsViewDB::ReadCoinsOutpoint(const uint256& txid, CCoins& coins) const
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << CoinsHeaderKey(txid);
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+
+    // The header key is the prefix itself, so it sorts first and one seek reads the whole transaction
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(slPrefix);
+    if (!pcursor->Valid() || pcursor->key() != slPrefix) {
+        HandleError(pcursor->status());
+        return false;
+    }
+    CCoinsHeader header;
+    leveldb::Slice slHeader = pcursor->value();
+    CDataStream ssHeader(slHeader.data(), slHeader.data() + slHeader.size(), SER_DISK, CLIENT_VERSION);
+    ssHeader >> header;
+    coins.Clear();
+    coins.fCoinBase = header.fCoinBase;
+    coins.fCoinStake = header.fCoinStake;
+    coins.nHeight = header.nHeight;
+    coins.nVersion = header.nVersion;
+
+    for (pcursor->Next(); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(slPrefix))
+            break;
+        CDataStream ssKey(slKey.data() + slPrefix.size(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        uint32_t n;
+        ssKey >> n;
+        if (n >= coins.vout.size())
+            coins.vout.resize(n + 1);
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> REF(CTxOutCompressor(coins.vout[n]));
+    }
+    HandleError(pcursor->status());
+    coins.nStoredOutputs = coins.vout.size();
+    return true;
+}
+
+void CCoinsViewDB::BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins) const
+{
+    if (nFormat == COINS_FORMAT_TXID) {
+        if (coins.IsPruned())
+            batch.Erase(make_pair('c', hash));
+        else
+            batch.Write(make_pair('c', hash), coins);
+        return;
+    }
+
+    // Everything needed is in the entry: its outputs, and the bound on the records stored when it was read.
+    // Unspent outputs are rewritten as they are rather than compared against the database.
+    if (coins.IsPruned()) {
+        if (coins.nStoredOutputs > 0)
+            batch.Erase(CoinsHeaderKey(hash));
+        for (unsigned int n = 0; n < coins.nStoredOutputs; n++)
+            batch.Erase(CoinsOutputKey(hash, n));
+        return;
+    }
+
+    batch.Write(CoinsHeaderKey(hash), CCoinsHeader(coins));
+    for (unsigned int n = 0; n < std::max((unsigned int)coins.vout.size(), coins.nStoredOutputs); n++) {
+        if (n < coins.vout.size() && !coins.vout[n].IsNull())
+            batch.Write(CoinsOutputKey(hash, n), CTxOutCompressor(REF(coins.vout[n])));
+        else if (n < coins.nStoredOutputs)
+            batch.Erase(CoinsOutputKey(hash, n));
+    }
+}
+
+bool CCoinsViewDB::Upgrade(bool fPerOutpoint)
 {
+    bool fConverting = db.Exists('M');
+    if (nFormat == COINS_FORMAT_TXID && !fPerOutpoint)
+        return true;
+    if (nFormat == COINS_FORMAT_OUTPOINT && !fConverting) {
+        if (!fPerOutpoint)
+            LogPrintf("%s : coin database already uses the per-outpoint layout, keeping it\n", __func__);
+        return true;
+    }
+
+    if (nFormat == COINS_FORMAT_TXID) {
+        // From here on the database is read as per-outpoint; 'M' makes a restart finish the job.
+        CLevelDBBatch batch;
+        batch.Write('V', (int)COINS_FORMAT_OUTPOINT);
+        batch.Write('M', '1');
+        if (!db.WriteBatch(batch, true))
+            return error("%s : failed to mark coin database for upgrade", __func__);
+        nFormat = COINS_FORMAT_OUTPOINT;
+    }
+
+    LogPrintf("Upgrading coin database to the per-outpoint layout...\n");
+    int64_t nStart = GetTimeMillis();
+    uint64_t nConverted = 0;
+    try {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+        CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+        ssStart << 'c';
+        pcursor->Seek(leveldb::Slice(&ssStart[0], ssStart.size()));
+
+        CLevelDBBatch batch;
+        unsigned int nBatch = 0;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != 'c')
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+
+            // Each batch moves whole transactions, so every txid is in exactly one layout at any time
+            batch.Erase(make_pair('c', txid));
+            batch.Write(CoinsHeaderKey(txid), CCoinsHeader(coins));
+            for (unsigned int n = 0; n < coins.vout.size(); n++) {
+                if (!coins.vout[n].IsNull())
+                    batch.Write(CoinsOutputKey(txid, n), CTxOutCompressor(coins.vout[n]));
+            }
+            nConverted++;
+            if (++nBatch == COINS_UPGRADE_BATCH) {
+                if (!db.WriteBatch(batch))
+                    return error("%s : failed to write coin database upgrade after %u transactions", __func__, nConverted);
+                batch = CLevelDBBatch();
+                nBatch = 0;
+                if (nConverted % (COINS_UPGRADE_BATCH * 50) == 0)
+                    LogPrintf("Upgrading coin database: %u transactions converted\n", nConverted);
+            }
+        }
+        HandleError(pcursor->status());
+        batch.Erase('M');
+        if (!db.WriteBatch(batch, true))
+            return error("%s : failed to complete coin database upgrade", __func__);
+    } catch (const std::exception& e) {
+        return error("%s : failed to upgrade coin database: %s", __func__, e.what());
+    }
+    LogPrintf("Upgraded coin database: %u transactions converted in %dms\n", nConverted, GetTimeMillis() - nStart);
+    return true;
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    if (fAsyncFlush) {
+        {
+            boost::lock_guard<boost::mutex> lock(csFlush);
+            fFlushStop = true;
+            condFlush.notify_all();
+        }
+        // The flush thread commits any queued batch before it exits
+        threadFlush.join();
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    if (fAsyncFlush) {
+        boost::lock_guard<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end()) {
+            coins = it->second.coins;
+            // Once the batch commits, the records it writes are stored as well
+            coins.nStoredOutputs = std::max(coins.nStoredOutputs, (unsigned int)coins.vout.size());
+            return !coins.IsPruned();
+        }
+    }
+    if (nFormat == COINS_FORMAT_TXID)
+        return db.Read(make_pair('c', txid), coins);
+
+    return ReadCoinsOutpoint(txid, coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    if (fAsyncFlush) {
+        boost::lock_guard<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end())
+            return !it->second.coins.IsPruned();
+    }
+    if (nFormat == COINS_FORMAT_TXID)
+        return db.Exists(make_pair('c', txid));
+    return db.Exists(CoinsHeaderKey(txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
+    if (fAsyncFlush) {
+        boost::lock_guard<boost::mutex> lock(csFlush);
+        if (fFlushQueued && hashFlushing != uint256(0))
+            return hashFlushing;
+    }
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return uint256(0);
@@ -56,23 +304,127 @@ uint256 CCoinsViewDB::GetBestBlock() const
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
-    CLevelDBBatch batch;
+    if (!fAsyncFlush) {
+        CLevelDBBatch batch;
+        size_t count = 0;
+        size_t changed = 0;
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                BatchWriteCoins(batch, it->first, it->second.coins);
+                changed++;
+            }
+            count++;
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        }
+        if (hashBlock != uint256(0))
+            BatchWriteHashBestChain(batch, hashBlock);
+
+        LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+        return db.WriteBatch(batch);
+    }
+
+    int64_t nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fFlushQueued && !fFlushFailed)
+        condFlush.wait(lock);
+    int64_t nWaited = GetTimeMicros() - nStart;
+    if (fFlushFailed)
+        return false;
+
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CCoinsCacheEntry& entry = mapFlushing[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.flags = CCoinsCacheEntry::DIRTY;
             changed++;
         }
         count++;
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
     }
-    if (hashBlock != uint256(0))
-        BatchWriteHashBestChain(batch, hashBlock);
+    if (changed == 0 && hashBlock == uint256(0))
+        return true;
+
+    hashFlushing = hashBlock;
+    fFlushQueued = true;
+    flushStats.fPending = true;
+    flushStats.nLastWaitMicros = nWaited;
+    flushStats.nLastQueueMicros = GetTimeMicros() - nStart;
+    condFlush.notify_all();
+
+    LogPrint("coindb", "Queued %u changed transactions (out of %u) for the coin database, waited %.2fms\n", (unsigned int)changed, (unsigned int)count, nWaited * 0.001);
+    return true;
+}
+
+void CCoinsViewDB::ThreadFlush()
+{
+    RenameThread("lapo-coinsflush");
+
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (true) {
+        while (!fFlushQueued && !fFlushStop)
+            condFlush.wait(lock);
+        if (!fFlushQueued)
+            break;
+
+        // BatchWrite does not touch mapFlushing while fFlushQueued is set, and readers
+        // only look at it, so it can be serialized without holding the lock.
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = true;
+        try {
+            CLevelDBBatch batch;
+            for (CCoinsMap::const_iterator it = mapFlushing.begin(); it != mapFlushing.end(); it++)
+                BatchWriteCoins(batch, it->first, it->second.coins);
+            if (hashFlushing != uint256(0))
+                BatchWriteHashBestChain(batch, hashFlushing);
+            fOk = db.WriteBatch(batch);
+        } catch (const std::exception& e) {
+            LogPrintf("%s : error writing to coin database: %s\n", __func__, e.what());
+            fOk = false;
+        }
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        lock.lock();
+
+        if (!fOk)
+            fFlushFailed = true;
+        flushStats.nFlushes++;
+        flushStats.nLastEntries = mapFlushing.size();
+        flushStats.nLastWriteMicros = nElapsed;
+        flushStats.nMaxWriteMicros = std::max(flushStats.nMaxWriteMicros, nElapsed);
+        flushStats.nTotalWriteMicros += nElapsed;
+        flushStats.fPending = false;
+        LogPrint("coindb", "Committed %u changed transactions to coin database: %.2fms\n", (unsigned int)mapFlushing.size(), nElapsed * 0.001);
+
+        // Keep failed entries around so reads stay consistent with the in-memory chain state
+        if (fOk) {
+            mapFlushing.clear();
+            hashFlushing = uint256(0);
+            fFlushQueued = false;
+        }
+        condFlush.notify_all();
+        if (!fOk)
+            break;
+    }
+}
+
+bool CCoinsViewDB::WaitForFlush() const
+{
+    if (!fAsyncFlush)
+        return true;
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fFlushQueued && !fFlushFailed)
+        condFlush.wait(lock);
+    return !fFlushFailed;
+}
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const
+{
+    boost::lock_guard<boost::mutex> lock(csFlush);
+    return flushStats;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
@@ -118,54 +470,193 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+/** Partial gettxoutsetinfo result for one key range, in hash order */
+struct CCoinsStatsShard {
+    CDataStream ss; //! the part of the hash input covering this range
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    bool fDone;
+    std::string strError;
+
+    CCoinsStatsShard() : ss(SER_GETHASH, PROTOCOL_VERSION), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0), fDone(false) {}
+};
+
+/** State shared between GetStats and its worker threads */
+struct CCoinsStatsJob {
+    CLevelDBWrapper* pdb;
+    int nFormat;
+    std::vector<CCoinsStatsShard> vShards;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nNext;     //! next shard to be picked up by a worker
+    unsigned int nConsumed; //! shards already hashed by the caller
+    unsigned int nWindow;   //! how far workers may run ahead of the caller
+    bool fAbort;
+
+    CCoinsStatsJob(CLevelDBWrapper* pdbIn, int nFormatIn, unsigned int nWindowIn) : pdb(pdbIn), nFormat(nFormatIn), vShards(COINS_STATS_SHARDS), nNext(0), nConsumed(0), nWindow(nWindowIn), fAbort(false) {}
+};
+
+static void AddCoinsToShard(CCoinsStatsShard& shard, const uint256& txhash, const CCoinsHeader& header, const std::vector<std::pair<uint32_t, CTxOut> >& vOutputs)
+{
+    shard.ss << txhash;
+    shard.ss << VARINT(header.nVersion);
+    shard.ss << (header.fCoinBase ? 'c' : 'n');
+    shard.ss << VARINT(header.nHeight);
+    shard.nTransactions++;
+    for (unsigned int i = 0; i < vOutputs.size(); i++) {
+        const CTxOut& out = vOutputs[i].second;
+        shard.nTransactionOutputs++;
+        shard.ss << VARINT(vOutputs[i].first + 1);
+        shard.ss << out;
+        shard.nTotalAmount += out.nValue;
+    }
+    shard.ss << VARINT(0);
+}
+
+/** Walk all coin records whose txid starts with byte nShard */
+static void ScanCoinsShard(CLevelDBWrapper* pdb, int nFormat, unsigned int nShard, CCoinsStatsShard& shard)
+{
+    const char chPrefix = nFormat == COINS_FORMAT_TXID ? 'c' : 'u';
+    const char vchStart[2] = {chPrefix, (char)nShard};
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
+    pcursor->Seek(leveldb::Slice(vchStart, sizeof(vchStart)));
+
+    uint256 txhash;
+    CCoinsHeader header;
+    std::vector<std::pair<uint32_t, CTxOut> > vOutputs;
+    bool fHaveTx = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() < 2 || slKey[0] != chPrefix || (unsigned char)slKey[1] != nShard)
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        uint256 txid;
+        ssKey >> chType >> txid;
+
+        if (nFormat == COINS_FORMAT_TXID) {
+            CCoins coins;
+            ssValue >> coins;
+            vOutputs.clear();
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (!coins.vout[i].IsNull())
+                    vOutputs.push_back(make_pair(i, coins.vout[i]));
+            }
+            AddCoinsToShard(shard, txid, CCoinsHeader(coins), vOutputs);
+            shard.nSerializedSize += 32 + slValue.size();
+        } else if (ssKey.empty()) {
+            // A header starts the next transaction; its outputs follow it in key order
+            if (fHaveTx) {
+                std::sort(vOutputs.begin(), vOutputs.end(), CompareOutputIndex());
+                AddCoinsToShard(shard, txhash, header, vOutputs);
+            }
+            txhash = txid;
+            ssValue >> header;
+            vOutputs.clear();
+            fHaveTx = true;
+            shard.nSerializedSize += 32 + slValue.size();
+        } else {
+            uint32_t n;
+            ssKey >> n;
+            CTxOut out;
+            ssValue >> REF(CTxOutCompressor(out));
+            vOutputs.push_back(make_pair(n, out));
+            shard.nSerializedSize += slValue.size();
+        }
+    }
+    HandleError(pcursor->status());
+    if (fHaveTx) {
+        std::sort(vOutputs.begin(), vOutputs.end(), CompareOutputIndex());
+        AddCoinsToShard(shard, txhash, header, vOutputs);
+    }
+}
+
+static void ThreadCoinsStats(CCoinsStatsJob* job)
+{
+    while (true) {
+        unsigned int nShard;
+        {
+            boost::unique_lock<boost::mutex> lock(job->cs);
+            while (!job->fAbort && job->nNext < job->vShards.size() && job->nNext >= job->nConsumed + job->nWindow)
+                job->cond.wait(lock);
+            if (job->fAbort || job->nNext >= job->vShards.size())
+                return;
+            nShard = job->nNext++;
+        }
+        CCoinsStatsShard shard;
+        try {
+            ScanCoinsShard(job->pdb, job->nFormat, nShard, shard);
+        } catch (const std::exception& e) {
+            shard.strError = e.what();
+        }
+        boost::lock_guard<boost::mutex> lock(job->cs);
+        std::swap(job->vShards[nShard], shard);
+        job->vShards[nShard].fDone = true;
+        job->cond.notify_all();
+    }
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    if (!WaitForFlush())
+        return error("%s : coin database write failed", __func__);
+
+    /* The key space is split by the first txid byte; worker threads scan the
+       ranges ahead of this thread, which feeds the results to the hasher in
+       key order, so the result does not depend on the number of threads. */
+    unsigned int nThreads = std::max(1U, std::min(8U, boost::thread::hardware_concurrency()));
+    CCoinsStatsJob job(const_cast<CLevelDBWrapper*>(&db), nFormat, 2 * nThreads);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadCoinsStats, &job));
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+    std::string strError;
+    try {
+        for (unsigned int i = 0; i < job.vShards.size() && strError.empty(); i++) {
+            boost::this_thread::interruption_point();
+            CCoinsStatsShard shard;
+            {
+                boost::unique_lock<boost::mutex> lock(job.cs);
+                while (!job.vShards[i].fDone)
+                    job.cond.wait(lock);
+                std::swap(shard, job.vShards[i]);
+                job.nConsumed++;
+                job.cond.notify_all();
             }
-            pcursor->Next();
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            strError = shard.strError;
+            if (!shard.ss.empty())
+                ss.write(&shard.ss[0], shard.ss.size());
+            stats.nTransactions += shard.nTransactions;
+            stats.nTransactionOutputs += shard.nTransactionOutputs;
+            stats.nSerializedSize += shard.nSerializedSize;
+            nTotalAmount += shard.nTotalAmount;
         }
+    } catch (...) {
+        {
+            boost::lock_guard<boost::mutex> lock(job.cs);
+            job.fAbort = true;
+            job.cond.notify_all();
+        }
+        threads.join_all();
+        throw;
+    }
+    {
+        boost::lock_guard<boost::mutex> lock(job.cs);
+        job.fAbort = true;
+        job.cond.notify_all();
     }
+    threads.join_all();
+    if (!strError.empty())
+        return error("%s : Deserialize or I/O error - %s", __func__, strError);
+
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
@@ -315,12 +806,19 @@ bool CZerocoinDB::ReadCoinMint(const CBigNum& bnPubcoin, uint256& hashTx)
 }
 
 bool CZerocoinDB::EraseCoinMint(const CBigNum& bnPubcoin)
+{
+    CLevelDBBatch batch;
+    EraseCoinMint(batch, bnPubcoin);
+    return WriteBatch(batch);
+}
+
+void CZerocoinDB::EraseCoinMint(CLevelDBBatch& batch, const CBigNum& bnPubcoin)
 {
     CDataStream ss(SER_GETHASH, 0);
     ss << bnPubcoin;
     uint256 hash = Hash(ss.begin(), ss.end());
 
-    return Erase(make_pair('m', hash));
+    batch.Erase(make_pair('m', hash));
 }
 
 bool CZerocoinDB::WriteCoinSpend(const CBigNum& bnSerial, const uint256& txHash)
@@ -342,12 +840,34 @@ bool CZerocoinDB::ReadCoinSpend(const CBigNum& bnSerial, uint256& txHash)
 }
 
 bool CZerocoinDB::EraseCoinSpend(const CBigNum& bnSerial)
+{
+    CLevelDBBatch batch;
+    EraseCoinSpend(batch, bnSerial);
+    return WriteBatch(batch);
+}
+
+void CZerocoinDB::EraseCoinSpend(CLevelDBBatch& batch, const CBigNum& bnSerial)
 {
     CDataStream ss(SER_GETHASH, 0);
     ss << bnSerial;
     uint256 hash = Hash(ss.begin(), ss.end());
 
-    return Erase(make_pair('s', hash));
+    batch.Erase(make_pair('s', hash));
+}
+
+bool CZerocoinDB::EraseCoins(const std::vector<CBigNum>& vMints, const std::vector<CBigNum>& vSerials)
+{
+    if (vMints.empty() && vSerials.empty())
+        return true;
+
+    CLevelDBBatch batch;
+    for (const CBigNum& bnPubcoin : vMints)
+        EraseCoinMint(batch, bnPubcoin);
+    for (const CBigNum& bnSerial : vSerials)
+        EraseCoinSpend(batch, bnSerial);
+
+    LogPrint("zero", "%s : mints:%u spends:%u\n", __func__, vMints.size(), vSerials.size());
+    return WriteBatch(batch);
 }
 
 bool CZerocoinDB::WriteAccumulatorValue(const uint32_t& nChecksum, const CBigNum& bnValue)
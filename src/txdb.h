@@ -11,12 +11,15 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 #include "primitives/zerocoin.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread/thread.hpp>
+
 class CCoins;
 class uint256;
 
@@ -26,21 +29,91 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = true;
+
+/** On-disk layouts of the coin database */
+enum CoinsDBFormat {
+    COINS_FORMAT_TXID = 0,     //! one CCoins record per transaction ('c' + txid)
+    COINS_FORMAT_OUTPOINT = 1, //! a header per transaction ('u' + txid) plus one record per unspent output ('u' + txid + n)
+};
+
+/** Timing of chainstate flushes, as seen by the coin database */
+struct CCoinsFlushStats {
+    uint64_t nFlushes;           //! number of batches committed to disk
+    uint64_t nLastEntries;       //! changed coin records in the last batch
+    int64_t nLastQueueMicros;    //! time the caller (holding cs_main) spent handing over the last batch
+    int64_t nLastWaitMicros;     //! part of the above spent waiting for the previous batch to commit
+    int64_t nLastWriteMicros;    //! time the last batch took to commit
+    int64_t nMaxWriteMicros;
+    int64_t nTotalWriteMicros;
+    bool fPending;               //! a batch is currently being written
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+    CCoinsFlushStats() : nFlushes(0), nLastEntries(0), nLastQueueMicros(0), nLastWaitMicros(0), nLastWriteMicros(0), nMaxWriteMicros(0), nTotalWriteMicros(0), fPending(false) {}
+};
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * In the per-outpoint layout, spending an output only deletes that output's
+ * record instead of rewriting the whole transaction, at the cost of a prefix
+ * scan when a transaction's coins are read. Writes need no reads: the entry
+ * carries the bound on its stored records (CCoins::nStoredOutputs).
+ *
+ * With fAsyncFlush, BatchWrite only moves the dirty entries into an in-flight
+ * map and returns; a dedicated thread commits them, together with the best
+ * block marker, in a single LevelDB batch. Reads are answered from the
+ * in-flight map until the commit completes, and a new BatchWrite waits for
+ * the previous one, so at most one batch is outstanding. Since the batch is
+ * atomic, the database always describes the state at some flushed best block.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+private:
+    const bool fAsyncFlush;
+    int nFormat;
+
+    //! protects everything below
+    mutable CWaitableCriticalSection csFlush;
+    mutable CConditionVariable condFlush;
+    CCoinsMap mapFlushing;
+    uint256 hashFlushing;
+    bool fFlushQueued;
+    bool fFlushFailed;
+    bool fFlushStop;
+    CCoinsFlushStats flushStats;
+
+    boost::thread threadFlush;
+
+    void ThreadFlush();
+    void BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins) const;
+    bool ReadCoinsOutpoint(const uint256& txid, CCoins& coins) const;
+
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fAsyncFlushIn = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Block until no batch is in flight. Returns false if a background write failed.
+    bool WaitForFlush() const;
+    CCoinsFlushStats GetFlushStats() const;
+
+    /**
+     * Switch to the per-outpoint layout if requested, converting the existing
+     * records in place, or finish a conversion that was interrupted. A database
+     * in the per-outpoint layout is never converted back. Must be called before
+     * the view is used.
+     */
+    bool Upgrade(bool fPerOutpoint);
+    int GetFormat() const { return nFormat; }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -85,7 +158,11 @@ public:
     bool WriteCoinSpend(const CBigNum& bnSerial, const uint256& txHash);
     bool ReadCoinSpend(const CBigNum& bnSerial, uint256& txHash);
     bool EraseCoinMint(const CBigNum& bnPubcoin);
+    void EraseCoinMint(CLevelDBBatch& batch, const CBigNum& bnPubcoin);
     bool EraseCoinSpend(const CBigNum& bnSerial);
+    void EraseCoinSpend(CLevelDBBatch& batch, const CBigNum& bnSerial);
+    //! Erase a set of mints and spends (e.g. everything a reorg disconnects) in one atomic batch
+    bool EraseCoins(const std::vector<CBigNum>& vMints, const std::vector<CBigNum>& vSerials);
     bool WriteAccumulatorValue(const uint32_t& nChecksum, const CBigNum& bnValue);
     bool ReadAccumulatorValue(const uint32_t& nChecksum, CBigNum& bnValue);
     bool EraseAccumulatorValue(const uint32_t& nChecksum);
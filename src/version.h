@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
- static const int PROTOCOL_VERSION = 70915;
+ static const int PROTOCOL_VERSION = 70916;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -38,5 +38,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "dsegsum", "mngetsum" and "mnvssum" summary sync requests are answered starting with this version
+static const int SYNC_SUMMARY_VERSION = 70916;
+
 
 #endif // BITCOIN_VERSION_H
@@ -1492,7 +1492,7 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if (strCommand == "ix") {
-                mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                txLockManager.AddRequest((CTransaction) * this);
                 CreateNewLock(((CTransaction) * this));
                 RelayTransactionLockReq((CTransaction) * this, true);
             } else {
@@ -4325,26 +4325,14 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!IsSporkActive(SPORK_2_LPCTX)) return -3;
     if (!fEnableLPCtx) return -1;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()) {
-        return (*i).second.CountSignatures();
-    }
-
-    return -1;
+    return txLockManager.GetSignatures(GetHash());
 }
 
 bool CMerkleTx::IsTransactionLockTimedOut() const
 {
     if (!fEnableLPCtx) return 0;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()) {
-        return GetTime() > (*i).second.nTimeout;
-    }
-
-    return false;
+    return txLockManager.IsLockTimedOut(GetHash());
 }
 
 // Given a set of inputs, find the public key that contributes the most coins to the input set